@@ -173,8 +173,14 @@ static int sc_apdu2bytes(sc_context_t *ctx, const sc_apdu_t *apdu,
 
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len, int is_out)
 {
-	size_t blen = len * 5 + 128;
-	char   *buf = malloc(blen);
+	size_t blen;
+	char   *buf;
+
+	if (!sc_log_enabled(ctx, level))
+		return;
+
+	blen = len * 5 + 128;
+	buf = malloc(blen);
 	if (buf == NULL)
 		return;
 
@@ -215,6 +221,48 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	return SC_SUCCESS;
 }
 
+int sc_apdu_get_reader_buffers(sc_reader_t *reader, const sc_apdu_t *apdu,
+	unsigned int proto, u8 **sbuf, size_t *slen, u8 **rbuf, size_t rlen)
+{
+	size_t	nlen, need;
+
+	if (reader == NULL || apdu == NULL || sbuf == NULL || slen == NULL || rbuf == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	nlen = sc_apdu_get_length(apdu, proto);
+	if (nlen == 0)
+		return SC_ERROR_INTERNAL;
+	need = nlen + rlen;
+	if (need > reader->apdu_buf_size) {
+		/* never give back the old content to the heap */
+		sc_apdu_clear_reader_buffers(reader);
+		free(reader->apdu_buf);
+		reader->apdu_buf_size = 0;
+		if (need < 2 * SC_MAX_APDU_BUFFER_SIZE)
+			need = 2 * SC_MAX_APDU_BUFFER_SIZE;
+		reader->apdu_buf = malloc(need);
+		if (reader->apdu_buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		reader->apdu_buf_size = need;
+	}
+	reader->apdu_buf_used = nlen + rlen;
+
+	if (sc_apdu2bytes(reader->ctx, apdu, proto, reader->apdu_buf, nlen) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
+	*sbuf = reader->apdu_buf;
+	*slen = nlen;
+	*rbuf = reader->apdu_buf + nlen;
+
+	return SC_SUCCESS;
+}
+
+void sc_apdu_clear_reader_buffers(sc_reader_t *reader)
+{
+	if (reader->apdu_buf != NULL && reader->apdu_buf_used)
+		sc_mem_clear(reader->apdu_buf, reader->apdu_buf_used);
+	reader->apdu_buf_used = 0;
+}
+
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len)
 {
@@ -576,6 +624,8 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		return r;
 	}
 
+	_sc_card_cache_apdu(card, apdu);
+
 	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
 		/* divide et impera: transmit APDU in chunks with Lc <= max_send_size
 		 * bytes using command chaining */
@@ -639,6 +689,8 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	} else
 		/* transmit single APDU */
 		r = sc_transmit(card, apdu);
+	if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED)
+		_sc_card_cache_invalidate(card);
 	/* all done => release lock */
 	if (sc_unlock(card) != SC_SUCCESS)
 		sc_log(card->ctx, "sc_unlock failed");
@@ -1246,7 +1246,7 @@ static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15
 }
 
 static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
-			     const u8 *obj, size_t objlen, int depth)
+			     const u8 *tlv, const u8 *obj, size_t objlen, int depth)
 {
 	void *parm = entry->parm;
 	int (*callback_func)(sc_context_t *nctx, void *arg, const u8 *nobj,
@@ -1314,7 +1314,19 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 			r = decode_bit_field(obj, objlen, (u8 *) parm, *len);
 		break;
 	case SC_ASN1_OCTET_STRING:
-		if (parm != NULL) {
+		if (parm != NULL && (entry->flags & SC_ASN1_BORROW)) {
+			assert(len != NULL);
+			if (entry->flags & SC_ASN1_TLV) {
+				objlen += obj - tlv;
+				obj = tlv;
+			} else if ((entry->flags & SC_ASN1_UNSIGNED)
+			 && objlen > 1 && obj[0] == 0x00) {
+				objlen--;
+				obj++;
+			}
+			*((const u8 **) parm) = objlen ? obj : NULL;
+			*len = objlen;
+		} else if (parm != NULL) {
 			size_t c;
 			assert(len != NULL);
 
@@ -1433,7 +1445,7 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 		       int choice, int depth)
 {
 	int r, idx = 0;
-	const u8 *p = in, *obj;
+	const u8 *p = in, *obj, *tlv;
 	struct sc_asn1_entry *entry = asn1;
 	size_t left = len, objlen;
 
@@ -1476,6 +1488,7 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 			goto decode_ok;
 		}
 
+		tlv = p;
 		obj = sc_asn1_skip_tag(ctx, &p, &left, entry->tag, &objlen);
 		if (obj == NULL) {
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "not present\n");
@@ -1497,7 +1510,7 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 			}
 			SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_ASN1_OBJECT_NOT_FOUND);
 		}
-		r = asn1_decode_entry(ctx, entry, obj, objlen, depth);
+		r = asn1_decode_entry(ctx, entry, tlv, obj, objlen, depth);
 
 decode_ok:
 		if (r)
@@ -141,6 +141,11 @@ int sc_asn1_sig_value_sequence_to_rs(struct sc_context *ctx,
 #define SC_ASN1_ALLOC			0x00000004
 #define SC_ASN1_UNSIGNED		0x00000008
 #define SC_ASN1_EMPTY_ALLOWED           0x00000010
+/* Decode OCTET STRING without copying: parm is a 'const u8 **' set to the
+ * value within the decoded buffer, that has to outlive the value */
+#define SC_ASN1_BORROW			0x00000020
+/* With SC_ASN1_BORROW: the value includes the tag and length octets */
+#define SC_ASN1_TLV			0x00000040
 
 #define SC_ASN1_BOOLEAN                 1
 #define SC_ASN1_INTEGER                 2
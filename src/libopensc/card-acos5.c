@@ -41,7 +41,7 @@ static struct sc_card_driver acos5_drv = {
 	"ACS ACOS5 card",
 	"acos5",
 	&acos5_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static int acos5_match_card(sc_card_t * card)
@@ -232,6 +232,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	acos5_ops.card_ctl = acos5_card_ctl;
 	acos5_ops.list_files = acos5_list_files;
 
+	acos5_drv.match_atrs = acos5_atrs;
 	return &acos5_drv;
 }
 
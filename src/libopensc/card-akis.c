@@ -40,7 +40,7 @@ static struct sc_card_driver akis_drv = {
 	"TUBITAK UEKAE AKIS",
 	"akis",
 	&akis_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct sc_atr_table akis_atrs[] = {
@@ -555,6 +555,7 @@ sc_get_driver(void)
 	/* put_data: Not implemented */
 	/* delete_record: Not implemented */
 
+	akis_drv.match_atrs = akis_atrs;
 	return &akis_drv;
 }
 
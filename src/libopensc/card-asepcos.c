@@ -34,7 +34,7 @@ static struct sc_card_driver asepcos_drv = {
 	"Athena ASEPCOS",
 	"asepcos",
 	&asepcos_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct sc_atr_table asepcos_atrs[] = {
@@ -1047,6 +1047,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	asepcos_ops.card_ctl          = asepcos_card_ctl;
 	asepcos_ops.pin_cmd           = asepcos_pin_cmd;
 
+	asepcos_drv.match_atrs = asepcos_atrs;
 	return &asepcos_drv;
 }
 
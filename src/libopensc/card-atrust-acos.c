@@ -60,7 +60,7 @@ static struct sc_card_driver atrust_acos_drv = {
 	"A-Trust ACOS cards",
 	"atrust-acos",
 	&atrust_acos_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 /* internal structure to save the current security environment */
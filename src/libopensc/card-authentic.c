@@ -66,7 +66,7 @@ static struct sc_card_operations authentic_ops;
 
 static struct sc_card_driver authentic_drv = {
 	"Oberthur AuthentIC v3.1", "authentic", &authentic_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 /*
@@ -2353,6 +2353,7 @@ sc_get_driver(void)
 	authentic_ops.process_fci = authentic_process_fci;
 	authentic_ops.pin_cmd = authentic_pin_cmd;
 
+	authentic_drv.match_atrs = authentic_known_atrs;
 	return &authentic_drv;
 }
 
@@ -201,7 +201,7 @@ static struct sc_card_driver belpic_drv = {
 	"Belpic cards",
 	"belpic",
 	&belpic_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 static const struct sc_card_operations *iso_ops = NULL;
 
@@ -1498,6 +1498,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	belpic_ops.get_response = iso_ops->get_response;
 	belpic_ops.check_sw = iso_ops->check_sw;
 
+	belpic_drv.match_atrs = belpic_atrs;
 	return &belpic_drv;
 }
 
@@ -39,7 +39,7 @@ static struct sc_card_driver cardos_drv = {
 	"Siemens CardOS",
 	"cardos",
 	&cardos_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct sc_atr_table cardos_atrs[] = {
@@ -1268,6 +1268,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	cardos_ops.logout  = cardos_logout;
 	cardos_ops.get_data = cardos_get_data;
 
+	cardos_drv.match_atrs = cardos_atrs;
 	return &cardos_drv;
 }
 
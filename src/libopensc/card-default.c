@@ -31,7 +31,7 @@ static struct sc_card_driver default_drv = {
 	"Default driver for unknown cards",
 	"default",
 	&default_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 
@@ -159,9 +159,10 @@ static sc_card_driver_t dnie_driver = {
 	DNIE_CHIP_NAME, /**< Full name for DNIe card driver */
 	DNIE_CHIP_SHORTNAME, /**< Short name for DNIe card driver */
 	&dnie_ops,	/**< pointer to dnie_ops (DNIe card driver operations) */
-	dnie_atrs,	/**< List of card ATR's handled by this driver */
+	NULL,		/**< (atr_map) ATR's added by the configuration */
 	0,		/**< (natrs) number of atr's to check for this driver */
-	NULL		/**< (dll) Card driver module (on DNIe is null) */
+	NULL,		/**< (dll) Card driver module (on DNIe is null) */
+	NULL		/**< (match_atrs) set in sc_get_dnie_driver() */
 };
 
 /************************** card-dnie.c internal functions ****************/
@@ -2070,6 +2071,7 @@ static sc_card_driver_t *get_dnie_driver(void)
 	dnie_ops.put_data	= NULL;
 	dnie_ops.delete_record	= NULL;
 
+	dnie_driver.match_atrs = dnie_atrs;
 	return &dnie_driver;
 }
 
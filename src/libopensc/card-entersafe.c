@@ -49,7 +49,7 @@ static struct sc_card_driver entersafe_drv = {
 	"entersafe",
 	"entersafe",
 	&entersafe_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static u8 trans_code_3k[] =
@@ -1581,6 +1581,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	entersafe_ops.pin_cmd = entersafe_pin_cmd;
 	entersafe_ops.card_ctl    = entersafe_card_ctl_2048;
 	entersafe_ops.process_fci = entersafe_process_fci;
+	entersafe_drv.match_atrs = entersafe_atrs;
 	return &entersafe_drv;
 }
 
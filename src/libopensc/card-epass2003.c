@@ -61,12 +61,11 @@ static struct sc_card_driver epass2003_drv = {
 	"epass2003",
 	"epass2003",
 	&epass2003_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 #define KEY_TYPE_AES	0x01	/* FIPS mode */
 #define KEY_TYPE_DES	0x02	/* Non-FIPS mode */
-static unsigned char g_smtype;	/* sm cryption algorithm type */
 
 #define KEY_LEN_AES	16
 #define KEY_LEN_DES	8
@@ -78,7 +77,6 @@ static unsigned char PIN_ID[2] = { ENTERSAFE_USER_PIN_ID, ENTERSAFE_SO_PIN_ID };
 /*0x00:plain; 0x01:scp01 sm*/
 #define SM_PLAIN				0x00
 #define SM_SCP01				0x01
-static unsigned char g_sm;	/* if perform sm or not */
 
 static unsigned char g_init_key_enc[16] = {
 	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C,
@@ -94,9 +92,26 @@ static unsigned char g_random[8] = {
 	0xBF, 0xC3, 0x29, 0x11, 0xC7, 0x18, 0xC3, 0x40
 };
 
-static unsigned char g_sk_enc[16] = { 0 };	/* encrypt session key */
-static unsigned char g_sk_mac[16] = { 0 };	/* mac session key */
-static unsigned char g_icv_mac[16] = { 0 };	/* instruction counter vector(for sm) */
+/* Cipher context kept for one session key, see openssl_cipher() */
+typedef struct epass2003_cipher_st {
+	EVP_CIPHER_CTX *evp;
+	const EVP_CIPHER *cipher;
+	int enc;
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+} epass2003_cipher;
+
+/* Secure messaging state of a card, kept in card->drv_data */
+typedef struct epass2003_exdata_st {
+	unsigned char sm;		/* if perform sm or not */
+	unsigned char smtype;		/* sm cryption algorithm type */
+	unsigned char sk_enc[16];	/* encrypt session key */
+	unsigned char sk_mac[16];	/* mac session key */
+	unsigned char icv_mac[16];	/* instruction counter vector(for sm) */
+	epass2003_cipher enc_ctx;	/* command data encryption */
+	epass2003_cipher dec_ctx;	/* response data decryption */
+	epass2003_cipher mac_ctx;	/* mac, first key of the DES mac */
+	epass2003_cipher mac2_ctx;	/* second key of the DES mac */
+} epass2003_exdata;
 
 #define REVERSE_ORDER4(x)	(			  \
 		((unsigned long)x & 0xFF000000)>> 24	| \
@@ -107,92 +122,116 @@ static unsigned char g_icv_mac[16] = { 0 };	/* instruction counter vector(for sm
 static int epass2003_transmit_apdu(struct sc_card *card, struct sc_apdu *apdu);
 static int epass2003_select_file(struct sc_card *card, const sc_path_t * in_path, sc_file_t ** file_out);
 
+/* Run 'cipher' without padding over 'input'.
+ * With 'cc' the cipher context is kept between the calls and, as long as
+ * the cipher and the key stay the same, only the IV is reset: the key
+ * schedule is expanded once per session key and not for every APDU. */
 static int
-openssl_enc(const EVP_CIPHER * cipher, const unsigned char *key, const unsigned char *iv,
+openssl_cipher(epass2003_cipher *cc, const EVP_CIPHER * cipher, int enc,
+		const unsigned char *key, const unsigned char *iv,
 		const unsigned char *input, size_t length, unsigned char *output)
 {
 	int r = SC_ERROR_INTERNAL;
-	EVP_CIPHER_CTX ctx;
+	EVP_CIPHER_CTX *ctx = cc ? cc->evp : NULL;
+	int key_len = EVP_CIPHER_key_length(cipher);
 	int outl = 0;
 	int outl_tmp = 0;
 	unsigned char iv_tmp[EVP_MAX_IV_LENGTH] = { 0 };
 
 	memcpy(iv_tmp, iv, EVP_MAX_IV_LENGTH);
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_EncryptInit_ex(&ctx, cipher, NULL, key, iv_tmp);
-	EVP_CIPHER_CTX_set_padding(&ctx, 0);
+	if (ctx == NULL) {
+		ctx = EVP_CIPHER_CTX_new();
+		if (ctx == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		if (cc)
+			cc->evp = ctx;
+	}
 
-	if (!EVP_EncryptUpdate(&ctx, output, &outl, input, length))
-		goto out;
+	if (cc && cc->cipher == cipher && cc->enc == enc && !memcmp(cc->key, key, key_len)) {
+		if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv_tmp, enc))
+			goto out;
+	}
+	else {
+		if (cc)
+			cc->cipher = NULL;
+		if (!EVP_CipherInit_ex(ctx, cipher, NULL, key, iv_tmp, enc))
+			goto out;
+		if (cc) {
+			cc->cipher = cipher;
+			cc->enc = enc;
+			memcpy(cc->key, key, key_len);
+		}
+	}
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
 
-	if (!EVP_EncryptFinal_ex(&ctx, output + outl, &outl_tmp))
+	if (!EVP_CipherUpdate(ctx, output, &outl, input, length))
 		goto out;
 
-	if (!EVP_CIPHER_CTX_cleanup(&ctx))
+	if (!EVP_CipherFinal_ex(ctx, output + outl, &outl_tmp))
 		goto out;
 
 	r = SC_SUCCESS;
 out:
+	if (!cc)
+		EVP_CIPHER_CTX_free(ctx);
+	else if (r != SC_SUCCESS)
+		cc->cipher = NULL;
 	return r;
 }
 
-static int
-openssl_dec(const EVP_CIPHER * cipher, const unsigned char *key, const unsigned char *iv,
-		const unsigned char *input, size_t length, unsigned char *output)
-{
-	int r = SC_ERROR_INTERNAL;
-	EVP_CIPHER_CTX ctx;
-	int outl = 0;
-	int outl_tmp = 0;
-	unsigned char iv_tmp[EVP_MAX_IV_LENGTH] = { 0 };
 
-	memcpy(iv_tmp, iv, EVP_MAX_IV_LENGTH);
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_DecryptInit_ex(&ctx, cipher, NULL, key, iv_tmp);
-	EVP_CIPHER_CTX_set_padding(&ctx, 0);
+static void
+openssl_cipher_free(epass2003_cipher *cc)
+{
+	if (cc->evp)
+		EVP_CIPHER_CTX_free(cc->evp);
+	memset(cc, 0, sizeof(*cc));
+}
 
-	if (!EVP_DecryptUpdate(&ctx, output, &outl, input, length))
-		goto out;
 
-	if (!EVP_DecryptFinal_ex(&ctx, output + outl, &outl_tmp))
-		goto out;
+static int
+openssl_enc(epass2003_cipher *cc, const EVP_CIPHER * cipher, const unsigned char *key,
+		const unsigned char *iv, const unsigned char *input, size_t length, unsigned char *output)
+{
+	return openssl_cipher(cc, cipher, 1, key, iv, input, length, output);
+}
 
-	if (!EVP_CIPHER_CTX_cleanup(&ctx))
-		goto out;
 
-	r = SC_SUCCESS;
-out:
-	return r;
+static int
+openssl_dec(epass2003_cipher *cc, const EVP_CIPHER * cipher, const unsigned char *key,
+		const unsigned char *iv, const unsigned char *input, size_t length, unsigned char *output)
+{
+	return openssl_cipher(cc, cipher, 0, key, iv, input, length, output);
 }
 
 
 static int
-aes128_encrypt_ecb(const unsigned char *key, int keysize,
+aes128_encrypt_ecb(epass2003_cipher *cc, const unsigned char *key, int keysize,
 		const unsigned char *input, size_t length, unsigned char *output)
 {
 	unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
-	return openssl_enc(EVP_aes_128_ecb(), key, iv, input, length, output);
+	return openssl_enc(cc, EVP_aes_128_ecb(), key, iv, input, length, output);
 }
 
 
 static int
-aes128_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[16],
+aes128_encrypt_cbc(epass2003_cipher *cc, const unsigned char *key, int keysize, unsigned char iv[16],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_enc(EVP_aes_128_cbc(), key, iv, input, length, output);
+	return openssl_enc(cc, EVP_aes_128_cbc(), key, iv, input, length, output);
 }
 
 
 static int
-aes128_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[16],
+aes128_decrypt_cbc(epass2003_cipher *cc, const unsigned char *key, int keysize, unsigned char iv[16],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_dec(EVP_aes_128_cbc(), key, iv, input, length, output);
+	return openssl_dec(cc, EVP_aes_128_cbc(), key, iv, input, length, output);
 }
 
 
 static int
-des3_encrypt_ecb(const unsigned char *key, int keysize,
+des3_encrypt_ecb(epass2003_cipher *cc, const unsigned char *key, int keysize,
 		const unsigned char *input, int length, unsigned char *output)
 {
 	unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
@@ -206,12 +245,12 @@ des3_encrypt_ecb(const unsigned char *key, int keysize,
 		memcpy(&bKey[0], key, 24);
 	}
 
-	return openssl_enc(EVP_des_ede3(), bKey, iv, input, length, output);
+	return openssl_enc(cc, EVP_des_ede3(), bKey, iv, input, length, output);
 }
 
 
 static int
-des3_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
+des3_encrypt_cbc(epass2003_cipher *cc, const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
 	unsigned char bKey[24] = { 0 };
@@ -224,12 +263,12 @@ des3_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX
 		memcpy(&bKey[0], key, 24);
 	}
 
-	return openssl_enc(EVP_des_ede3_cbc(), bKey, iv, input, length, output);
+	return openssl_enc(cc, EVP_des_ede3_cbc(), bKey, iv, input, length, output);
 }
 
 
 static int
-des3_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
+des3_decrypt_cbc(epass2003_cipher *cc, const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
 	unsigned char bKey[24] = { 0 };
@@ -241,23 +280,23 @@ des3_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX
 		memcpy(&bKey[0], key, 24);
 	}
 
-	return openssl_dec(EVP_des_ede3_cbc(), bKey, iv, input, length, output);
+	return openssl_dec(cc, EVP_des_ede3_cbc(), bKey, iv, input, length, output);
 }
 
 
 static int
-des_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
+des_encrypt_cbc(epass2003_cipher *cc, const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_enc(EVP_des_cbc(), key, iv, input, length, output);
+	return openssl_enc(cc, EVP_des_cbc(), key, iv, input, length, output);
 }
 
 
 static int
-des_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
+des_decrypt_cbc(epass2003_cipher *cc, const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_dec(EVP_des_cbc(), key, iv, input, length, output);
+	return openssl_dec(cc, EVP_des_cbc(), key, iv, input, length, output);
 }
 
 
@@ -301,6 +340,7 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 	unsigned long blocksize = 0;
 	unsigned char cryptogram[256] = { 0 };	/* host cryptogram */
 	unsigned char iv[16] = { 0 };
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 
 	LOG_FUNC_CALLED(card->ctx);
 
@@ -311,10 +351,10 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 	apdu.le = apdu.resplen = 28;
 	apdu.resp = result;	/* card random is result[12~19] */
 
-	tmp_sm = g_sm;
-	g_sm = SM_PLAIN;
+	tmp_sm = exdata->sm;
+	exdata->sm = SM_PLAIN;
 	r = epass2003_transmit_apdu(card, &apdu);
-	g_sm = tmp_sm;
+	exdata->sm = tmp_sm;
 	LOG_TEST_RET(card->ctx, r, "APDU gen_init_key failed");
 
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
@@ -328,12 +368,12 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 
 	/* Step 2,3 - Create S-ENC/S-MAC Session Key */
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_ecb(key_enc, 16, data, 16, g_sk_enc);
-		aes128_encrypt_ecb(key_mac, 16, data, 16, g_sk_mac);
+		aes128_encrypt_ecb(NULL, key_enc, 16, data, 16, exdata->sk_enc);
+		aes128_encrypt_ecb(NULL, key_mac, 16, data, 16, exdata->sk_mac);
 	}
 	else {
-		des3_encrypt_ecb(key_enc, 16, data, 16, g_sk_enc);
-		des3_encrypt_ecb(key_mac, 16, data, 16, g_sk_mac);
+		des3_encrypt_ecb(NULL, key_enc, 16, data, 16, exdata->sk_enc);
+		des3_encrypt_ecb(NULL, key_mac, 16, data, 16, exdata->sk_mac);
 	}
 
 	memcpy(data, g_random, 8);
@@ -344,9 +384,9 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 
 	/* calculate host cryptogram */
 	if (KEY_TYPE_AES == key_type)
-		aes128_encrypt_cbc(g_sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
+		aes128_encrypt_cbc(NULL, exdata->sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
 	else
-		des3_encrypt_cbc(g_sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
+		des3_encrypt_cbc(NULL, exdata->sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
 
 	/* verify card cryptogram */
 	if (0 != memcmp(&cryptogram[16], &result[20], 8))
@@ -368,6 +408,7 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 	unsigned char mac[256] = { 0 };
 	unsigned long i;
 	unsigned char tmp_sm;
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 
 	LOG_FUNC_CALLED(card->ctx);
 
@@ -379,10 +420,10 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 
 	/* calculate host cryptogram */
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(g_sk_enc, 16, iv, data, 16 + blocksize,
+		aes128_encrypt_cbc(NULL, exdata->sk_enc, 16, iv, data, 16 + blocksize,
 				   cryptogram);
 	} else {
-		des3_encrypt_cbc(g_sk_enc, 16, iv, data, 16 + blocksize,
+		des3_encrypt_cbc(NULL, exdata->sk_enc, 16, iv, data, 16 + blocksize,
 				 cryptogram);
 	}
 
@@ -394,15 +435,15 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 	/* calculate mac icv */
 	memset(iv, 0x00, 16);
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(g_sk_mac, 16, iv, data, 16, mac);
+		aes128_encrypt_cbc(NULL, exdata->sk_mac, 16, iv, data, 16, mac);
 		i = 0;
 	} else {
-		des3_encrypt_cbc(g_sk_mac, 16, iv, data, 16, mac);
+		des3_encrypt_cbc(NULL, exdata->sk_mac, 16, iv, data, 16, mac);
 		i = 8;
 	}
 	/* save mac icv */
-	memset(g_icv_mac, 0x00, 16);
-	memcpy(g_icv_mac, &mac[i], 8);
+	memset(exdata->icv_mac, 0x00, 16);
+	memcpy(exdata->icv_mac, &mac[i], 8);
 
 	/* verify host cryptogram */
 	memcpy(data, &cryptogram[16], 8);
@@ -411,10 +452,10 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 	apdu.cla = 0x84;
 	apdu.lc = apdu.datalen = 16;
 	apdu.data = data;
-	tmp_sm = g_sm;
-	g_sm = SM_PLAIN;
+	tmp_sm = exdata->sm;
+	exdata->sm = SM_PLAIN;
 	r = epass2003_transmit_apdu(card, &apdu);
-	g_sm = tmp_sm;
+	exdata->sm = tmp_sm;
 	LOG_TEST_RET(card->ctx, r,
 		    "APDU verify_init_key failed");
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
@@ -432,14 +473,15 @@ mutual_auth(struct sc_card *card, unsigned char *key_enc,
 	int r;
 	unsigned char result[256] = { 0 };
 	unsigned char ran_key[8] = { 0 };
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 
 	LOG_FUNC_CALLED(ctx);
 
-	r = gen_init_key(card, key_enc, key_mac, result, g_smtype);
+	r = gen_init_key(card, key_enc, key_mac, result, exdata->smtype);
 	LOG_TEST_RET(ctx, r, "gen_init_key failed");
 	memcpy(ran_key, &result[12], 8);
 
-	r = verify_init_key(card, ran_key, g_smtype);
+	r = verify_init_key(card, ran_key, exdata->smtype);
 	LOG_TEST_RET(ctx, r, "verify_init_key failed");
 
 	LOG_FUNC_RETURN(ctx, r);
@@ -450,8 +492,9 @@ int
 epass2003_refresh(struct sc_card *card)
 {
 	int r = SC_SUCCESS;
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 
-	if (g_sm) {
+	if (exdata->sm) {
 		card->sm_ctx.sm_mode = 0;
 		r = mutual_auth(card, g_init_key_enc, g_init_key_mac);
 		card->sm_ctx.sm_mode = SM_MODE_TRANSMIT;
@@ -464,9 +507,10 @@ epass2003_refresh(struct sc_card *card)
 
 /* Data(TLV)=0x87|L|0x01+Cipher */
 static int
-construct_data_tlv(struct sc_apdu *apdu, unsigned char *apdu_buf,
+construct_data_tlv(struct sc_card *card, struct sc_apdu *apdu, unsigned char *apdu_buf,
 		unsigned char *data_tlv, size_t * data_tlv_len, const unsigned char key_type)
 {
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 	size_t block_size = (KEY_TYPE_AES == key_type ? 16 : 8);
 	unsigned char pad[4096] = { 0 };
 	size_t pad_len;
@@ -500,9 +544,9 @@ construct_data_tlv(struct sc_apdu *apdu, unsigned char *apdu_buf,
 
 	/* encrypt Data */
 	if (KEY_TYPE_AES == key_type)
-		aes128_encrypt_cbc(g_sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
+		aes128_encrypt_cbc(&exdata->enc_ctx, exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
 	else
-		des3_encrypt_cbc(g_sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
+		des3_encrypt_cbc(&exdata->enc_ctx, exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
 
 	memcpy(data_tlv + tlv_more, apdu_buf + block_size + tlv_more, pad_len);
 	*data_tlv_len = tlv_more + pad_len;
@@ -538,9 +582,10 @@ construct_le_tlv(struct sc_apdu *apdu, unsigned char *apdu_buf, size_t data_tlv_
 
 /* MAC(TLV)=0x8e|0x08|MAC */
 static int
-construct_mac_tlv(unsigned char *apdu_buf, size_t data_tlv_len, size_t le_tlv_len,
+construct_mac_tlv(struct sc_card *card, unsigned char *apdu_buf, size_t data_tlv_len, size_t le_tlv_len,
 		unsigned char *mac_tlv, size_t * mac_tlv_len, const unsigned char key_type)
 {
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 	size_t block_size = (KEY_TYPE_AES == key_type ? 16 : 8);
 	unsigned char mac[4096] = { 0 };
 	size_t mac_len;
@@ -566,29 +611,29 @@ construct_mac_tlv(unsigned char *apdu_buf, size_t data_tlv_len, size_t le_tlv_le
 
 	/* increase icv */
 	for (; i >= 0; i--) {
-		if (g_icv_mac[i] == 0xff) {
-			g_icv_mac[i] = 0;
+		if (exdata->icv_mac[i] == 0xff) {
+			exdata->icv_mac[i] = 0;
 		}
 		else {
-			g_icv_mac[i]++;
+			exdata->icv_mac[i]++;
 			break;
 		}
 	}
 
 	/* calculate MAC */
 	memset(icv, 0, sizeof(icv));
-	memcpy(icv, g_icv_mac, 16);
+	memcpy(icv, exdata->icv_mac, 16);
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(g_sk_mac, 16, icv, apdu_buf, mac_len, mac);
+		aes128_encrypt_cbc(&exdata->mac_ctx, exdata->sk_mac, 16, icv, apdu_buf, mac_len, mac);
 		memcpy(mac_tlv + 2, &mac[mac_len - 16], 8);
 	}
 	else {
 		unsigned char iv[8] = { 0 };
 		unsigned char tmp[8] = { 0 };
-		des_encrypt_cbc(g_sk_mac, 8, icv, apdu_buf, mac_len, mac);
-		des_decrypt_cbc(&g_sk_mac[8], 8, iv, &mac[mac_len - 8], 8, tmp);
+		des_encrypt_cbc(&exdata->mac_ctx, exdata->sk_mac, 8, icv, apdu_buf, mac_len, mac);
+		des_decrypt_cbc(&exdata->mac2_ctx, &exdata->sk_mac[8], 8, iv, &mac[mac_len - 8], 8, tmp);
 		memset(iv, 0x00, 8);
-		des_encrypt_cbc(g_sk_mac, 8, iv, tmp, 8, mac_tlv + 2);
+		des_encrypt_cbc(&exdata->mac_ctx, exdata->sk_mac, 8, iv, tmp, 8, mac_tlv + 2);
 	}
 
 	*mac_tlv_len = 2 + 8;
@@ -604,10 +649,11 @@ construct_mac_tlv(unsigned char *apdu_buf, size_t data_tlv_len, size_t le_tlv_le
  * where
  * Data'=Data(TLV)+Le(TLV)+MAC(TLV) */
 static int
-encode_apdu(struct sc_apdu *plain, struct sc_apdu *sm,
+encode_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_apdu *sm,
 		unsigned char *apdu_buf, size_t * apdu_buf_len)
 {
-	size_t block_size = (KEY_TYPE_DES == g_smtype ? 16 : 8);
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
+	size_t block_size = (KEY_TYPE_DES == exdata->smtype ? 16 : 8);
 	unsigned char dataTLV[4096] = { 0 };
 	size_t data_tlv_len = 0;
 	unsigned char le_tlv[256] = { 0 };
@@ -635,15 +681,15 @@ encode_apdu(struct sc_apdu *plain, struct sc_apdu *sm,
 
 	/* Data -> Data' */
 	if (plain->lc != 0)
-		if (0 != construct_data_tlv(plain, apdu_buf, dataTLV, &data_tlv_len, g_smtype))
+		if (0 != construct_data_tlv(card, plain, apdu_buf, dataTLV, &data_tlv_len, exdata->smtype))
 			return -1;
 
 	if (plain->le != 0 || (plain->le == 0 && plain->resplen != 0))
 		if (0 != construct_le_tlv(plain, apdu_buf, data_tlv_len, le_tlv,
-				     &le_tlv_len, g_smtype))
+				     &le_tlv_len, exdata->smtype))
 			return -1;
 
-	if (0 != construct_mac_tlv(apdu_buf, data_tlv_len, le_tlv_len, mac_tlv, &mac_tlv_len, g_smtype))
+	if (0 != construct_mac_tlv(card, apdu_buf, data_tlv_len, le_tlv_len, mac_tlv, &mac_tlv_len, exdata->smtype))
 		return -1;
 
 	memset(apdu_buf + 4, 0, *apdu_buf_len - 4);
@@ -688,10 +734,11 @@ epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_ap
 {
 	unsigned char buf[4096] = { 0 };	/* APDU buffer */
 	size_t buf_len = sizeof(buf);
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 
 	LOG_FUNC_CALLED(card->ctx);
 
-	if (g_sm)
+	if (exdata->sm)
 		plain->cla |= 0x0C;
 
 	sm->cse = plain->cse;
@@ -714,7 +761,7 @@ epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_ap
 		break;
 	case 0x0C:
 		memset(buf, 0, sizeof(buf));
-		if (0 != encode_apdu(plain, sm, buf, &buf_len))
+		if (0 != encode_apdu(card, plain, sm, buf, &buf_len))
 			return SC_ERROR_CARD_CMD_FAILED;
 		break;
 	default:
@@ -737,8 +784,9 @@ epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_ap
  * SW12(TLV)=0x99|0x02|SW1+SW2
  * MAC(TLV)=0x8e|0x08|MAC */
 static int
-decrypt_response(unsigned char *in, unsigned char *out, size_t * out_len)
+decrypt_response(struct sc_card *card, unsigned char *in, unsigned char *out, size_t * out_len)
 {
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 	size_t in_len;
 	size_t i;
 	unsigned char iv[16] = { 0 };
@@ -767,10 +815,10 @@ decrypt_response(unsigned char *in, unsigned char *out, size_t * out_len)
 	}
 
 	/* decrypt */
-	if (KEY_TYPE_AES == g_smtype)
-		aes128_decrypt_cbc(g_sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
+	if (KEY_TYPE_AES == exdata->smtype)
+		aes128_decrypt_cbc(&exdata->dec_ctx, exdata->sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
 	else
-		des3_decrypt_cbc(g_sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
+		des3_decrypt_cbc(&exdata->dec_ctx, exdata->sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
 
 	/* unpadding */
 	while (0x80 != plaintext[in_len - 2] && (in_len - 2 > 0))
@@ -790,13 +838,14 @@ epass2003_sm_unwrap_apdu(struct sc_card *card, struct sc_apdu *sm, struct sc_apd
 {
 	int r;
 	size_t len = 0;
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 
 	LOG_FUNC_CALLED(card->ctx);
 
 	r = sc_check_sw(card, sm->sw1, sm->sw2);
 	if (r == SC_SUCCESS) {
-		if (g_sm) {
-			if (0 != decrypt_response(sm->resp, plain->resp, &len))
+		if (exdata->sm) {
+			if (0 != decrypt_response(card, sm->resp, plain->resp, &len))
 				return SC_ERROR_CARD_CMD_FAILED;
 		}
 		else {
@@ -899,6 +948,7 @@ get_data(struct sc_card *card, unsigned char type, unsigned char *data, size_t d
 	struct sc_apdu apdu;
 	unsigned char resp[SC_MAX_APDU_BUFFER_SIZE] = { 0 };
 	size_t resplen = SC_MAX_APDU_BUFFER_SIZE;
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
 
 	LOG_FUNC_CALLED(card->ctx);
 
@@ -908,10 +958,10 @@ get_data(struct sc_card *card, unsigned char type, unsigned char *data, size_t d
 	apdu.resplen = resplen;
 	if (0x86 == type) {
 		/* No SM temporarily */
-		unsigned char tmp_sm = g_sm;
-		g_sm = SM_PLAIN;
+		unsigned char tmp_sm = exdata->sm;
+		exdata->sm = SM_PLAIN;
 		r = sc_transmit_apdu(card, &apdu);
-		g_sm = tmp_sm;
+		exdata->sm = tmp_sm;
 	}
 	else {
 		r = sc_transmit_apdu(card, &apdu);
@@ -945,24 +995,32 @@ epass2003_init(struct sc_card *card)
 	unsigned int flags;
 	unsigned char data[SC_MAX_APDU_BUFFER_SIZE] = { 0 };
 	size_t datalen = SC_MAX_APDU_BUFFER_SIZE;
+	epass2003_exdata *exdata = NULL;
 
 	LOG_FUNC_CALLED(card->ctx);
 
 	card->name = "epass2003";
 	card->cla = 0x00;
-	card->drv_data = NULL;
 
-	g_sm = SM_SCP01;
-	/* g_sm = SM_PLAIN; */
+	exdata = calloc(1, sizeof(epass2003_exdata));
+	if (!exdata)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	card->drv_data = exdata;
+
+	exdata->sm = SM_SCP01;
+	/* exdata->sm = SM_PLAIN; */
 
 	/* decide FIPS/Non-FIPS mode */
-	if (SC_SUCCESS != get_data(card, 0x86, data, datalen))
+	if (SC_SUCCESS != get_data(card, 0x86, data, datalen)) {
+		free(exdata);
+		card->drv_data = NULL;
 		return SC_ERROR_CARD_CMD_FAILED;
+	}
 
 	if (0x01 == data[2])
-		g_smtype = KEY_TYPE_AES;
+		exdata->smtype = KEY_TYPE_AES;
 	else
-		g_smtype = KEY_TYPE_DES;
+		exdata->smtype = KEY_TYPE_DES;
 
 	/* mutual authentication */
 	card->max_recv_size = 0xD8;
@@ -972,7 +1030,7 @@ epass2003_init(struct sc_card *card)
 	card->sm_ctx.ops.get_sm_apdu = epass2003_sm_get_wrapped_apdu;
 	card->sm_ctx.ops.free_sm_apdu = epass2003_sm_free_wrapped_apdu;
 
-	/* FIXME (VT): rather then set/unset 'g_sm', better to implement filter for APDUs to be wrapped */
+	/* FIXME (VT): rather then set/unset 'exdata->sm', better to implement filter for APDUs to be wrapped */
 	epass2003_refresh(card);
 
 	card->sm_ctx.sm_mode = SM_MODE_TRANSMIT;
@@ -990,6 +1048,24 @@ epass2003_init(struct sc_card *card)
 }
 
 
+static int
+epass2003_finish(struct sc_card *card)
+{
+	epass2003_exdata *exdata = (epass2003_exdata *) card->drv_data;
+
+	if (exdata) {
+		openssl_cipher_free(&exdata->enc_ctx);
+		openssl_cipher_free(&exdata->dec_ctx);
+		openssl_cipher_free(&exdata->mac_ctx);
+		openssl_cipher_free(&exdata->mac2_ctx);
+		sc_mem_clear(exdata, sizeof(*exdata));
+		free(exdata);
+	}
+	card->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+
 /* COS implement SFI as lower 5 bits of FID, and not allow same SFI at the
  * same DF, so use hook functions to increase/decrease FID by 0x20 */
 static int
@@ -2227,7 +2303,7 @@ external_key_auth(struct sc_card *card, unsigned char kid,
 	r = hash_data(data, datalen, hash);
 	LOG_TEST_RET(card->ctx, r, "hash data failed");
 
-	des3_encrypt_cbc(hash, HASH_LEN, iv, random, 8, tmp_data);
+	des3_encrypt_cbc(NULL, hash, HASH_LEN, iv, random, 8, tmp_data);
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x82, 0x01, 0x80 | kid);
 	apdu.lc = apdu.datalen = 8;
 	apdu.data = tmp_data;
@@ -2338,6 +2414,7 @@ static struct sc_card_driver *sc_get_driver(void)
 
 	epass2003_ops.match_card = epass2003_match_card;
 	epass2003_ops.init = epass2003_init;
+	epass2003_ops.finish = epass2003_finish;
 	epass2003_ops.write_binary = NULL;
 	epass2003_ops.write_record = NULL;
 	epass2003_ops.select_file = epass2003_select_file;
@@ -2353,6 +2430,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	epass2003_ops.process_fci = epass2003_process_fci;
 	epass2003_ops.construct_fci = epass2003_construct_fci;
 	epass2003_ops.pin_cmd = epass2003_pin_cmd;
+	epass2003_drv.match_atrs = epass2003_atrs;
 	return &epass2003_drv;
 }
 
@@ -115,13 +115,13 @@ static struct sc_card_driver cryptoflex_drv = {
 	"Schlumberger Multiflex/Cryptoflex",
 	"flex",
 	&cryptoflex_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 static struct sc_card_driver cyberflex_drv = {
 	"Schlumberger Cyberflex",
 	"cyberflex",
 	&cyberflex_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static int flex_finish(sc_card_t *card)
@@ -1317,6 +1317,7 @@ struct sc_card_driver * sc_get_cryptoflex_driver(void)
 	cryptoflex_ops.decipher = flex_decipher;
 	cryptoflex_ops.pin_cmd = flex_pin_cmd;
 	cryptoflex_ops.logout = flex_logout;
+	cryptoflex_drv.match_atrs = flex_atrs;
 	return &cryptoflex_drv;
 }
 
@@ -1342,5 +1343,6 @@ struct sc_card_driver * sc_get_cyberflex_driver(void)
 	cyberflex_ops.decipher = flex_decipher;
 	cyberflex_ops.pin_cmd = flex_pin_cmd;
 	cyberflex_ops.logout = flex_logout;
+	cyberflex_drv.match_atrs = flex_atrs;
 	return &cyberflex_drv;
 }
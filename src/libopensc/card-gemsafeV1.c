@@ -35,7 +35,7 @@ static struct sc_card_driver gemsafe_drv = {
 	"driver for the Gemplus GemSAFE V1 applet",
 	"gemsafeV1",
 	&gemsafe_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 /* Known ATRs */
@@ -692,6 +692,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	gemsafe_ops.process_fci	= gemsafe_process_fci;
 	gemsafe_ops.pin_cmd		 = gemsafe_pin_cmd;
 
+	gemsafe_drv.match_atrs = gemsafe_atrs;
 	return &gemsafe_drv;
 }
 
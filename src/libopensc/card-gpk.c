@@ -106,7 +106,7 @@ static struct sc_card_driver gpk_drv = {
 	"Gemplus GPK",
 	"gpk",
 	&gpk_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 /*
@@ -42,7 +42,7 @@ static struct sc_card_driver ias_drv = {
 		"IAS",
 		"ias",
 		&ias_ops,
-		NULL, 0, NULL
+		NULL, 0, NULL, NULL
 };
 
 /* Known ATRs */
@@ -524,6 +524,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	ias_ops.compute_signature = ias_compute_signature;
 	ias_ops.pin_cmd = ias_pin_cmd;
 
+	ias_drv.match_atrs = ias_atrs;
 	return &ias_drv;
 }
 
@@ -66,7 +66,7 @@ static struct sc_card_driver iasecc_drv = {
 	"IAS-ECC",
 	"iasecc",
 	&iasecc_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct sc_atr_table iasecc_known_atrs[] = {
@@ -3562,6 +3562,7 @@ sc_get_driver(void)
 
 	iasecc_ops.read_public_key = iasecc_read_public_key;
 
+	iasecc_drv.match_atrs = iasecc_known_atrs;
 	return &iasecc_drv;
 }
 
@@ -44,7 +44,7 @@ static struct sc_card_driver incrypto34_drv = {
 	"Incard Incripto34",
 	"incrypto34",
 	&incrypto34_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct sc_atr_table incrypto34_atrs[] = {
@@ -877,6 +877,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	incrypto34_ops.card_ctl = incrypto34_card_ctl;
 	incrypto34_ops.pin_cmd = incrypto34_pin_cmd;
 
+	incrypto34_drv.match_atrs = incrypto34_atrs;
 	return &incrypto34_drv;
 }
 
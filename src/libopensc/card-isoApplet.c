@@ -68,7 +68,7 @@ static struct sc_card_driver isoApplet_drv =
 	"Javacard with IsoApplet",
 	"isoApplet",
 	&isoApplet_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct isoapplet_supported_ec_curves {
@@ -42,7 +42,7 @@ static struct sc_card_driver itacns_drv = {
 	"Italian CNS",
 	"itacns",
 	&itacns_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 /*
@@ -38,7 +38,7 @@ static struct sc_card_driver jcop_drv = {
 	"JCOP cards with BlueZ PKCS#15 applet",
 	"jcop",
 	&jcop_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 #define SELECT_MF 0
@@ -926,6 +926,7 @@ static struct sc_card_driver * sc_get_driver(void)
      jcop_ops.process_fci = jcop_process_fci;
      jcop_ops.card_ctl = jcop_card_ctl;
      
+     jcop_drv.match_atrs = jcop_atrs;
      return &jcop_drv;
 }
 
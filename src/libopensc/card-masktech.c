@@ -49,7 +49,7 @@ static struct sc_card_driver masktech_drv = {
 	"MaskTech Smart Card",
 	"MaskTech",
 	&masktech_ops,
-	masktech_atrs, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 struct masktech_private_data {
@@ -366,6 +366,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	masktech_ops.decipher = masktech_decipher;
 	masktech_ops.pin_cmd = masktech_pin_cmd;
 	masktech_ops.card_ctl = masktech_card_ctl;
+	masktech_drv.match_atrs = masktech_atrs;
 	return &masktech_drv;
 }
 
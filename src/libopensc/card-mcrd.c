@@ -68,7 +68,7 @@ static struct sc_card_driver mcrd_drv = {
 	"MICARDO 2.1 / EstEID 1.0 - 3.0",
 	"mcrd",
 	&mcrd_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static const struct sc_card_operations *iso_ops = NULL;
@@ -42,7 +42,7 @@ static struct sc_card_driver miocos_drv = {
 	"MioCOS 1.1",
 	"miocos",
 	&miocos_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static int miocos_match_card(sc_card_t *card)
@@ -493,6 +493,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	miocos_ops.delete_file = miocos_delete_file;
 	miocos_ops.card_ctl = miocos_card_ctl;
 	
+        miocos_drv.match_atrs = miocos_atrs;
         return &miocos_drv;
 }
 
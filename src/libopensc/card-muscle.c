@@ -39,7 +39,7 @@ static struct sc_card_driver muscle_drv = {
 	"MuscleApplet",
 	"muscle",
 	&muscle_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct sc_atr_table muscle_atrs[] = {
@@ -55,7 +55,7 @@ static struct sc_card_driver myeid_drv = {
 	&myeid_ops,
 	NULL,
 	0,
-	NULL
+	NULL, NULL
 };
 
 static const char *myeid_atrs[] = {
@@ -121,7 +121,7 @@ static struct sc_card_driver auth_drv = {
 	"Oberthur AuthentIC.v2/CosmopolIC.v4",
 	"oberthur",
 	&auth_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static int auth_get_pin_reference (struct sc_card *card,
@@ -2292,6 +2292,7 @@ sc_get_driver(void)
 	auth_ops.pin_cmd = auth_pin_cmd;
 	auth_ops.logout = auth_logout;
 	auth_ops.check_sw = auth_check_sw;
+	auth_drv.match_atrs = oberthur_atrs;
 	return &auth_drv;
 }
 
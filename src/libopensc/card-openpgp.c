@@ -54,7 +54,7 @@ static struct sc_card_driver pgp_drv = {
 	"OpenPGP card",
 	"openpgp",
 	&pgp_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 /*
@@ -2292,6 +2292,7 @@ sc_get_driver(void)
 	pgp_ops.delete_file	= pgp_delete_file;
 	pgp_ops.update_binary	= pgp_update_binary;
 
+	pgp_drv.match_atrs = pgp_atrs;
 	return &pgp_drv;
 }
 
@@ -358,7 +358,7 @@ static struct sc_card_driver piv_drv = {
 	"PIV-II  for multiple cards",
 	"piv",
 	&piv_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static int piv_find_obj_by_containerid(sc_card_t *card, const u8 * str)
@@ -38,7 +38,7 @@ static struct sc_card_driver rtecp_drv = {
 	"Rutoken ECP driver",
 	"rutoken_ecp",
 	&rtecp_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct sc_atr_table rtecp_atrs[] = {
@@ -780,6 +780,7 @@ struct sc_card_driver * sc_get_rtecp_driver(void)
 	rtecp_ops.construct_fci = rtecp_construct_fci;
 	rtecp_ops.pin_cmd = NULL;
 
+	rtecp_drv.match_atrs = rtecp_atrs;
 	return &rtecp_drv;
 }
 
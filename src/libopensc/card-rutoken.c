@@ -81,7 +81,7 @@ static struct sc_card_driver rutoken_drv = {
 	"Rutoken driver",
 	"rutoken",
 	&rutoken_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static struct sc_atr_table rutoken_atrs[] = {
@@ -1284,6 +1284,7 @@ static struct sc_card_driver* get_rutoken_driver(void)
 	rutoken_ops.construct_fci = rutoken_construct_fci;
 	rutoken_ops.pin_cmd = NULL;
 
+	rutoken_drv.match_atrs = rutoken_atrs;
 	return &rutoken_drv;
 }
 
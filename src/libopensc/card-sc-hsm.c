@@ -49,7 +49,7 @@ static struct sc_card_driver sc_hsm_drv = {
 	&sc_hsm_ops,
 	NULL,
 	0,
-	NULL
+	NULL, NULL
 };
 
 
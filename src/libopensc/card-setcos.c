@@ -77,7 +77,7 @@ static struct sc_card_driver setcos_drv = {
 	"Setec cards",
 	"setcos",
 	&setcos_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static int match_hist_bytes(sc_card_t *card, const char *str, size_t len)
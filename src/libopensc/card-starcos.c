@@ -44,7 +44,7 @@ static struct sc_card_driver starcos_drv = {
 	"STARCOS SPK 2.3/2.4",
 	"starcos",
 	&starcos_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static const struct sc_card_error starcos_errors[] = 
@@ -1362,6 +1362,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	starcos_ops.card_ctl    = starcos_card_ctl;
 	starcos_ops.logout      = starcos_logout;
   
+	starcos_drv.match_atrs = starcos_atrs;
 	return &starcos_drv;
 }
 
@@ -54,7 +54,7 @@ static struct sc_card_driver tcos_drv = {
 	"TCOS 3.0",
 	"tcos",
 	&tcos_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 static const struct sc_card_operations *iso_ops = NULL;
@@ -770,5 +770,6 @@ struct sc_card_driver * sc_get_tcos_driver(void)
 	tcos_ops.restore_security_env = tcos_restore_security_env;
 	tcos_ops.card_ctl             = tcos_card_ctl;
 	
+	tcos_drv.match_atrs = tcos_atrs;
 	return &tcos_drv;
 }
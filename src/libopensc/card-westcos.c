@@ -81,7 +81,7 @@ static const struct sc_card_operations *iso_ops = NULL;
 static struct sc_card_operations westcos_ops;
 
 static struct sc_card_driver westcos_drv = {
-	"WESTCOS compatible cards", "westcos", &westcos_ops, NULL, 0, NULL
+	"WESTCOS compatible cards", "westcos", &westcos_ops, NULL, 0, NULL, NULL
 };
 
 static int westcos_get_default_key(sc_card_t * card,
@@ -1285,6 +1285,7 @@ struct sc_card_driver *sc_get_westcos_driver(void)
 	westcos_ops.construct_fci = NULL;
 	westcos_ops.pin_cmd = westcos_pin_cmd;
 
+	westcos_drv.match_atrs = westcos_atrs;
 	return &westcos_drv;
 }
 
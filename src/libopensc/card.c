@@ -31,12 +31,16 @@
 
 #include "internal.h"
 #include "asn1.h"
+#include "iso7816.h"
 #include "common/compat_strlcpy.h"
 
 /*
 #define INVALIDATE_CARD_CACHE_IN_UNLOCK
 */
 
+static struct sc_atr_table *atr_index_table(struct sc_card_driver *drv, int configured);
+static int match_atr_drivers(sc_card_t *card, int configured, int *idx);
+
 #ifdef ENABLE_SM
 static int sc_card_sm_load(sc_card_t *card, const char *path, const char *module);
 static int sc_card_sm_unload(sc_card_t *card);
@@ -126,6 +130,8 @@ static void sc_card_free(sc_card_t *card)
 	if (card->cache.current_df)
 		sc_file_free(card->cache.current_df);
 
+	_sc_card_cache_flush_fci(card);
+
 	if (card->mutex != NULL) {
 		int r = sc_mutex_destroy(card->ctx, card->mutex);
 		if (r != SC_SUCCESS)
@@ -135,12 +141,89 @@ static void sc_card_free(sc_card_t *card)
 	free(card);
 }
 
+/* Returns the third byte of the card capabilities found in the
+ * compact-TLV historical bytes, or -1 if there is none */
+static int sc_card_hist_capabilities(const sc_reader_t *reader)
+{
+	const u8 *p = reader->atr_info.hist_bytes;
+	size_t left = reader->atr_info.hist_bytes_len;
+
+	if (p == NULL || left < 1)
+		return -1;
+	if (*p == ISO7816_II_CATEGORY_NOT_TLV) {
+		/* the mandatory status indicator takes the last three bytes */
+		if (left < 4)
+			return -1;
+		left -= 3;
+	} else if (*p != ISO7816_II_CATEGORY_TLV) {
+		return -1;
+	}
+	p++;
+	left--;
+
+	while (left > 0) {
+		size_t tag = *p >> 4, len = *p & 0x0F;
+
+		p++;
+		left--;
+		if (len > left)
+			break;
+		if (tag == 0x07 && len >= 3)
+			return p[2];
+		p += len;
+		left -= len;
+	}
+	return -1;
+}
+
+/* Enables extended APDUs for cards using the ISO 7816 file access when
+ * both the card (ATR or EF.ATR) and the reader announce support for them.
+ * Drivers setting their own transfer sizes are left alone. */
+static void sc_card_detect_apdu_sizes(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	const sc_reader_t *reader = card->reader;
+	const struct sc_card_operations *iso_ops = sc_get_iso7816_driver()->ops;
+	size_t max_send = reader->max_send_size, max_recv = reader->max_recv_size;
+	int caps;
+
+	if ((card->caps & SC_CARD_CAP_APDU_EXT) || card->max_send_size || card->max_recv_size)
+		return;
+	if (card->ops->read_binary != iso_ops->read_binary || card->ops->update_binary != iso_ops->update_binary)
+		return;
+	/* T=0 would need ENVELOPE; the reader has to report its limits */
+	if (reader->active_protocol != SC_PROTO_T1 || max_recv <= 256)
+		return;
+
+	if (card->ef_atr && (card->ef_atr->card_capabilities & ISO7816_CAP_EXTENDED_LENGTH)) {
+		/* header, Lc and Le of an extended command APDU, SW1 SW2 */
+		if (card->ef_atr->max_command_apdu > 10 && card->ef_atr->max_command_apdu - 10 < max_send)
+			max_send = card->ef_atr->max_command_apdu - 10;
+		if (card->ef_atr->max_response_apdu > 2 && card->ef_atr->max_response_apdu - 2 < max_recv)
+			max_recv = card->ef_atr->max_response_apdu - 2;
+	} else {
+		caps = sc_card_hist_capabilities(reader);
+		if (caps < 0 || !(caps & ISO7816_CAP_EXTENDED_LENGTH))
+			return;
+	}
+	if (max_recv <= 256)
+		return;
+
+	card->caps |= SC_CARD_CAP_APDU_EXT;
+	card->max_send_size = max_send;
+	card->max_recv_size = max_recv;
+	sc_log(ctx, "card and reader support extended APDUs, max_send/recv_size:%i/%i",
+			card->max_send_size, card->max_recv_size);
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
 	sc_context_t *ctx;
 	struct sc_card_driver *driver;
-	int i, r = 0, idx, connected = 0;
+	int i, r = 0, count = 0, connected = 0;
+	int atr_idx[SC_MAX_CARD_DRIVERS], order[SC_MAX_CARD_DRIVERS], cached = -1;
+	char cached_name[64];
 
 	if (card_out == NULL || reader == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -167,6 +250,7 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
 		sc_log(ctx, "matching configured ATRs");
+		match_atr_drivers(card, 1, atr_idx);
 		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
 			driver = ctx->card_drivers[i];
 
@@ -175,10 +259,8 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 				driver = NULL;
 				continue;
 			}
-			sc_log(ctx, "trying driver '%s'", driver->short_name);
-			idx = _sc_match_atr(card, driver->atr_map, NULL);
-			if (idx >= 0) {
-				struct sc_atr_table *src = &driver->atr_map[idx];
+			if (atr_idx[i] >= 0) {
+				struct sc_atr_table *src = &driver->atr_map[atr_idx[i]];
 
 				sc_log(ctx, "matched driver '%s'", driver->name);
 				/* It's up to card driver to notice these correctly */
@@ -209,9 +291,29 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		}
 	}
 	else {
+		/* First the drivers that know the ATR, then the drivers
+		 * that have to talk to the card to recognise it. Drivers that
+		 * accept only their built-in ATRs are not asked at all when
+		 * the ATR is not one of them. The driver that recognised
+		 * this ATR the last time goes before all of them. */
 		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			struct sc_card_driver *drv = ctx->card_drivers[i];
+		match_atr_drivers(card, 0, atr_idx);
+		if (_sc_card_binding_get(card, "driver", cached_name, sizeof(cached_name)) == SC_SUCCESS)
+			for (i = 0; ctx->card_drivers[i] != NULL; i++)
+				if (!strcmp(ctx->card_drivers[i]->short_name, cached_name)) {
+					sc_log(ctx, "cached driver '%s'", cached_name);
+					order[count++] = cached = i;
+					break;
+				}
+		for (i = 0; ctx->card_drivers[i] != NULL; i++)
+			if (i != cached && atr_idx[i] >= 0)
+				order[count++] = i;
+		for (i = 0; ctx->card_drivers[i] != NULL; i++)
+			if (i != cached && atr_idx[i] < 0 && atr_index_table(ctx->card_drivers[i], 0) == NULL)
+				order[count++] = i;
+
+		for (i = 0; i < count; i++) {
+			struct sc_card_driver *drv = ctx->card_drivers[order[i]];
 			const struct sc_card_operations *ops = drv->ops;
 
 			sc_log(ctx, "trying driver '%s'", drv->short_name);
@@ -241,6 +343,9 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			}
 			break;
 		}
+		/* the catch-all driver is not worth remembering */
+		if (card->driver != NULL && strcmp(card->driver->short_name, "default"))
+			_sc_card_binding_set(card, "driver", card->driver->short_name);
 	}
 	if (card->driver == NULL) {
 		sc_log(ctx, "unable to find driver for inserted card");
@@ -250,9 +355,19 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	if (card->name == NULL)
 		card->name = card->driver->name;
 
+	sc_card_detect_apdu_sizes(card);
+
 	/*  Override card limitations with reader limitations.
 	 *  Note that zero means no limitations at all.
 	 */
+	if ((card->max_recv_size == 0) ||
+			((reader->max_recv_size != 0) && (reader->max_recv_size < card->max_recv_size)))
+		card->max_recv_size = reader->max_recv_size;
+
+	if ((card->max_send_size == 0) ||
+			((reader->max_send_size != 0) && (reader->max_send_size < card->max_send_size)))
+		card->max_send_size = reader->max_send_size;
+
 	if ((card->max_recv_size == 0) ||
 			((reader->driver->max_recv_size != 0) && (reader->driver->max_recv_size < card->max_recv_size)))
 		card->max_recv_size = reader->driver->max_recv_size;
@@ -261,6 +376,14 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			((reader->driver->max_send_size != 0) && (reader->driver->max_send_size < card->max_send_size)))
 		card->max_send_size = reader->driver->max_send_size;
 
+	/* The reader limits may be those of extended APDUs */
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT)) {
+		if (card->max_recv_size > 256)
+			card->max_recv_size = 256;
+		if (card->max_send_size > 255)
+			card->max_send_size = 255;
+	}
+
 	sc_log(ctx, "card info name:'%s', type:%i, flags:0x%X, max_send/recv_size:%i/%i",
 		card->name, card->type, card->flags, card->max_send_size, card->max_recv_size);
 
@@ -330,8 +453,7 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
 	/* invalidate cache */
-	memset(&card->cache, 0, sizeof(card->cache));
-	card->cache.valid = 0;
+	_sc_card_cache_invalidate(card);
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -359,8 +481,7 @@ int sc_lock(sc_card_t *card)
 			r = card->reader->ops->lock(card->reader);
 			if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
 				/* invalidate cache */
-				memset(&card->cache, 0, sizeof(card->cache));
-				card->cache.valid = 0;
+				_sc_card_cache_invalidate(card);
 #ifdef ENABLE_SM
 				if (card->sm_ctx.ops.open)
 					card->sm_ctx.ops.open(card);
@@ -368,8 +489,14 @@ int sc_lock(sc_card_t *card)
 				r = card->reader->ops->lock(card->reader);
 			}
 		}
-		if (r == 0)
+		if (r == 0) {
 			card->cache.valid = 1;
+			/* other applications may have selected files meanwhile */
+			if (!(card->reader->flags & SC_READER_TRANSACTION_KEPT)) {
+				card->cache.selected_valid = 0;
+				_sc_card_cache_forget_se(card);
+			}
+		}
 	}
 	if (r == 0)
 		card->lock_count++;
@@ -399,13 +526,17 @@ int sc_unlock(sc_card_t *card)
 	if (--card->lock_count == 0) {
 #ifdef INVALIDATE_CARD_CACHE_IN_UNLOCK
 		/* invalidate cache */
-		memset(&card->cache, 0, sizeof(card->cache));
-		card->cache.valid = 0;
+		_sc_card_cache_invalidate(card);
 		sc_log(card->ctx, "cache invalidated");
 #endif
 		/* release reader lock */
 		if (card->reader->ops->unlock != NULL)
 			r = card->reader->ops->unlock(card->reader);
+		/* other applications may select files until we lock again */
+		if (!(card->reader->flags & SC_READER_TRANSACTION_KEPT)) {
+			card->cache.selected_valid = 0;
+			_sc_card_cache_forget_se(card);
+		}
 	}
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -416,6 +547,169 @@ int sc_unlock(sc_card_t *card)
 	return r;
 }
 
+void _sc_card_cache_invalidate(struct sc_card *card)
+{
+	_sc_card_cache_flush_fci(card);
+	memset(&card->cache, 0, sizeof(card->cache));
+	card->cache.valid = 0;
+}
+
+void _sc_card_cache_flush_fci(struct sc_card *card)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_MAX_CACHED_FCI; i++) {
+		if (card->cache.fci[i].file)
+			sc_file_free(card->cache.fci[i].file);
+		card->cache.fci[i].file = NULL;
+	}
+	card->cache.fci_next = 0;
+	card->cache.selected_valid = 0;
+}
+
+void _sc_card_cache_apdu(struct sc_card *card, const struct sc_apdu *apdu)
+{
+	if (card->cache.se_valid) {
+		switch (apdu->ins) {
+		case 0xA4:	/* SELECT FILE */
+		case 0x22:	/* MANAGE SECURITY ENVIRONMENT */
+		case 0x82:	/* EXTERNAL AUTHENTICATE */
+		case 0x86:	/* GENERAL AUTHENTICATE */
+		case 0x87:
+		case 0x88:	/* INTERNAL AUTHENTICATE */
+			_sc_card_cache_forget_se(card);
+			break;
+		default:
+			if (apdu->cla & 0x80)
+				_sc_card_cache_forget_se(card);
+			break;
+		}
+	}
+
+	switch (apdu->ins) {
+	case 0xE0:	/* CREATE FILE */
+	case 0xE4:	/* DELETE FILE */
+	case 0xE6:	/* TERMINATE DF */
+	case 0xE8:	/* TERMINATE EF */
+	case 0x04:	/* DEACTIVATE FILE */
+	case 0x44:	/* ACTIVATE FILE */
+		_sc_card_cache_flush_fci(card);
+		return;
+	}
+
+	if (!card->cache.selected_valid || (apdu->cla & 0x80))
+		goto forget;
+
+	switch (apdu->ins) {
+	case 0xB0:	/* READ BINARY */
+	case 0xD6:	/* UPDATE BINARY */
+	case 0xD0:	/* WRITE BINARY */
+	case 0x0E:	/* ERASE BINARY */
+		/* short EF identifier in P1 selects another file */
+		if (apdu->p1 & 0x80)
+			goto forget;
+		return;
+	case 0xB2:	/* READ RECORD */
+	case 0xDC:	/* UPDATE RECORD */
+	case 0xD2:	/* WRITE RECORD */
+	case 0xE2:	/* APPEND RECORD */
+		if (apdu->p2 & 0xF8)
+			goto forget;
+		return;
+	case 0x20:	/* VERIFY */
+	case 0x21:
+	case 0x22:	/* MANAGE SECURITY ENVIRONMENT */
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x2A:	/* PERFORM SECURITY OPERATION */
+	case 0x2C:	/* RESET RETRY COUNTER */
+	case 0x82:	/* EXTERNAL AUTHENTICATE */
+	case 0x84:	/* GET CHALLENGE */
+	case 0x86:	/* GENERAL AUTHENTICATE */
+	case 0x87:
+	case 0x88:	/* INTERNAL AUTHENTICATE */
+	case 0xC0:	/* GET RESPONSE */
+	case 0xCA:	/* GET DATA */
+		return;
+	}
+forget:
+	card->cache.selected_valid = 0;
+}
+
+static int
+sc_card_cache_path_equal(const struct sc_path *a, const struct sc_path *b)
+{
+	return a->type == b->type
+		&& a->len == b->len && !memcmp(a->value, b->value, a->len)
+		&& a->aid.len == b->aid.len && !memcmp(a->aid.value, b->aid.value, a->aid.len);
+}
+
+int _sc_card_cache_is_selected(struct sc_card *card, const struct sc_path *path)
+{
+	return card->lock_count > 0 && card->cache.selected_valid
+		&& sc_card_cache_path_equal(&card->cache.selected_path, path);
+}
+
+const struct sc_file *_sc_card_cache_find_fci(struct sc_card *card, const struct sc_path *path)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_MAX_CACHED_FCI; i++)
+		if (card->cache.fci[i].file
+				&& sc_card_cache_path_equal(&card->cache.fci[i].path, path))
+			return card->cache.fci[i].file;
+	return NULL;
+}
+
+void _sc_card_cache_set_selected(struct sc_card *card, const struct sc_path *path,
+		const struct sc_file *file)
+{
+	struct sc_cached_fci *entry;
+
+	if (card->lock_count > 0) {
+		card->cache.selected_path = *path;
+		card->cache.selected_valid = 1;
+	}
+
+	if (file == NULL || _sc_card_cache_find_fci(card, path) != NULL)
+		return;
+
+	entry = &card->cache.fci[card->cache.fci_next];
+	card->cache.fci_next = (card->cache.fci_next + 1) % SC_MAX_CACHED_FCI;
+	if (entry->file)
+		sc_file_free(entry->file);
+	entry->file = NULL;
+	sc_file_dup(&entry->file, file);
+	entry->path = *path;
+}
+
+int _sc_card_cache_se_matches(struct sc_card *card, const struct sc_security_env *env,
+		int se_num)
+{
+	return card->lock_count > 0 && card->cache.se_valid
+		&& card->cache.se_num == se_num
+		&& !memcmp(&card->cache.se, env, sizeof(*env));
+}
+
+void _sc_card_cache_set_se(struct sc_card *card, const struct sc_security_env *env,
+		int se_num)
+{
+	if (card->lock_count == 0)
+		return;
+	if (!(card->caps & SC_CARD_CAP_CACHE_SE)
+			&& card->ops->set_security_env != sc_get_iso7816_driver()->ops->set_security_env)
+		return;
+
+	memcpy(&card->cache.se, env, sizeof(*env));
+	card->cache.se_num = se_num;
+	card->cache.se_valid = 1;
+}
+
+void _sc_card_cache_forget_se(struct sc_card *card)
+{
+	card->cache.se_valid = 0;
+	card->cache.se_skipped = 0;
+}
+
 int sc_list_files(sc_card_t *card, u8 *buf, size_t buflen)
 {
 	int r;
@@ -453,6 +747,7 @@ int sc_create_file(sc_card_t *card, sc_file_t *file)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
 	r = card->ops->create_file(card, file);
+	_sc_card_cache_flush_fci(card);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -471,6 +766,7 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	if (card->ops->delete_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->delete_file(card, path);
+	_sc_card_cache_flush_fci(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -1012,6 +1308,185 @@ scconf_block *_sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driv
 	return NULL;
 }
 
+/*
+ * Precompiled ATR tables.
+ *
+ * match_atr_table() converts every table entry from hex on each call, and
+ * sc_connect_card() used to call the match_card() of one driver after the
+ * other. The index keeps the binary ATR and mask of every entry of the
+ * configured ('card_atr') and the built-in ('match_atrs') tables, grouped by
+ * ATR length, so that the drivers recognising an ATR are found with a single
+ * lookup and drivers that cannot match are never asked.
+ */
+struct sc_atr_index_entry {
+	u8 atr[SC_MAX_ATR_SIZE];	/* ATR already reduced with the mask */
+	u8 mask[SC_MAX_ATR_SIZE];
+	int drv_idx;			/* index in ctx->card_drivers */
+	int atr_idx;			/* index in the driver's ATR table */
+	int configured;			/* entry of driver->atr_map */
+};
+
+struct sc_atr_index {
+	struct sc_atr_index_entry *entries;
+	/* entries with an ATR of 'len' bytes are first[len] .. first[len + 1] - 1 */
+	size_t first[SC_MAX_ATR_SIZE + 2];
+};
+
+static int
+atr_index_entry_parse(const struct sc_atr_table *src, struct sc_atr_index_entry *entry, size_t *len_out)
+{
+	size_t len = sizeof(entry->atr), mlen = sizeof(entry->mask), i;
+
+	if (src->atr == NULL || sc_hex_to_bin(src->atr, entry->atr, &len) || len == 0)
+		return -1;
+	/* match_atr_table() compares the hex strings in the 'xx:xx:..' form */
+	if (strlen(src->atr) != 3 * len - 1)
+		return -1;
+	if (src->atrmask != NULL) {
+		if (strlen(src->atrmask) != strlen(src->atr)
+				|| sc_hex_to_bin(src->atrmask, entry->mask, &mlen) || mlen != len)
+			return -1;
+	}
+	else {
+		memset(entry->mask, 0xFF, len);
+	}
+	for (i = 0; i < len; i++)
+		entry->atr[i] &= entry->mask[i];
+
+	*len_out = len;
+	return 0;
+}
+
+static struct sc_atr_table *
+atr_index_table(struct sc_card_driver *drv, int configured)
+{
+	if (configured)
+		return drv->atr_map;
+	/* external drivers may be built with a shorter struct sc_card_driver */
+	if (drv->dll != NULL)
+		return NULL;
+	return drv->match_atrs;
+}
+
+/* Walk all ATR tables: count the entries per ATR length, or,
+ * with 'index' set, store them using 'count' as fill level of each length */
+static size_t
+atr_index_fill(sc_context_t *ctx, struct sc_atr_index *index, size_t *count)
+{
+	struct sc_atr_index_entry entry;
+	size_t total = 0, len;
+	int configured, i, j;
+
+	for (configured = 1; configured >= 0; configured--) {
+		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+			struct sc_atr_table *table = atr_index_table(ctx->card_drivers[i], configured);
+
+			for (j = 0; table != NULL && table[j].atr != NULL; j++) {
+				if (atr_index_entry_parse(&table[j], &entry, &len))
+					continue;
+				total++;
+				if (index == NULL) {
+					count[len]++;
+					continue;
+				}
+				entry.drv_idx = i;
+				entry.atr_idx = j;
+				entry.configured = configured;
+				index->entries[index->first[len] + count[len]++] = entry;
+			}
+		}
+	}
+	return total;
+}
+
+int _sc_atr_index_build(sc_context_t *ctx)
+{
+	struct sc_atr_index *index;
+	size_t count[SC_MAX_ATR_SIZE + 1], total, len;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	_sc_atr_index_free(ctx);
+
+	index = calloc(1, sizeof(struct sc_atr_index));
+	if (index == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	memset(count, 0, sizeof(count));
+	total = atr_index_fill(ctx, NULL, count);
+	index->entries = calloc(total ? total : 1, sizeof(struct sc_atr_index_entry));
+	if (index->entries == NULL) {
+		free(index);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	for (len = 0; len <= SC_MAX_ATR_SIZE; len++)
+		index->first[len + 1] = index->first[len] + count[len];
+
+	/* entries keep the order of the drivers inside of each length */
+	memset(count, 0, sizeof(count));
+	atr_index_fill(ctx, index, count);
+
+	ctx->atr_index = index;
+	sc_log(ctx, "%i ATR(s) of the card drivers indexed", (int) total);
+	return SC_SUCCESS;
+}
+
+void _sc_atr_index_free(sc_context_t *ctx)
+{
+	struct sc_atr_index *index = ctx ? (struct sc_atr_index *) ctx->atr_index : NULL;
+
+	if (index == NULL)
+		return;
+	free(index->entries);
+	free(index);
+	ctx->atr_index = NULL;
+}
+
+/*
+ * For every driver in ctx->card_drivers, set 'idx' to the index of the entry
+ * of its configured (or built-in) ATR table that matches the card's ATR, or to -1.
+ * Returns the number of matching drivers.
+ */
+static int
+match_atr_drivers(sc_card_t *card, int configured, int *idx)
+{
+	sc_context_t *ctx = card->ctx;
+	struct sc_atr_index *index = (struct sc_atr_index *) ctx->atr_index;
+	size_t len = card->atr.len, e, i;
+	int matched = 0, d;
+
+	for (d = 0; d < SC_MAX_CARD_DRIVERS; d++)
+		idx[d] = -1;
+
+	if (index == NULL) {
+		for (d = 0; ctx->card_drivers[d] != NULL; d++) {
+			struct sc_atr_table *table = atr_index_table(ctx->card_drivers[d], configured);
+
+			if (table != NULL && (idx[d] = _sc_match_atr(card, table, NULL)) >= 0)
+				matched++;
+		}
+		return matched;
+	}
+
+	if (len == 0 || len > SC_MAX_ATR_SIZE)
+		return 0;
+	for (e = index->first[len]; e < index->first[len + 1]; e++) {
+		struct sc_atr_index_entry *entry = &index->entries[e];
+
+		if (entry->configured != configured || idx[entry->drv_idx] >= 0)
+			continue;
+		for (i = 0; i < len; i++)
+			if ((card->atr.value[i] & entry->mask[i]) != entry->atr[i])
+				break;
+		if (i < len)
+			continue;
+		idx[entry->drv_idx] = entry->atr_idx;
+		matched++;
+	}
+	return matched;
+}
+
+
 int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_table *src)
 {
 	struct sc_atr_table *map, *dst;
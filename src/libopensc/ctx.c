@@ -53,6 +53,10 @@ int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader)
 			reader->ops->release(reader);
 	if (reader->name)
 		free(reader->name);
+	if (reader->apdu_buf) {
+		sc_mem_clear(reader->apdu_buf, reader->apdu_buf_size);
+		free(reader->apdu_buf);
+	}
 	list_delete(&ctx->readers, reader);
 	free(reader);
 	return SC_SUCCESS;
@@ -122,6 +126,9 @@ struct _sc_ctx_options {
 	struct _sc_driver_entry cdrv[SC_MAX_CARD_DRIVERS];
 	int ccount;
 	char *forced_card_driver;
+	char *forced_reader_driver;
+	int debug_async;
+	int debug_async_buffer;
 };
 
 
@@ -188,6 +195,7 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->debug_file = stderr;
 	ctx->paranoid_memory = 0;
 	ctx->enable_default_driver = 0;
+	ctx->use_binding_cache = 0;
 
 #ifdef __APPLE__
 	/* Override the default debug log for OpenSC.tokend to be different from PKCS#11.
@@ -205,6 +213,11 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	int r = SC_SUCCESS;
+
+	/* Keep the async log writer off the handle while it is replaced */
+	_sc_log_async_lock(ctx);
+
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
 		fclose(ctx->debug_file);
@@ -219,9 +232,11 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 	else {
 		ctx->debug_file = fopen(filename, "a");
 		if (ctx->debug_file == NULL)
-			return SC_ERROR_INTERNAL;
+			r = SC_ERROR_INTERNAL;
 	}
-	return SC_SUCCESS;
+
+	_sc_log_async_unlock(ctx);
+	return r;
 }
 
 
@@ -258,12 +273,19 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 		sc_ctx_log_to_file(ctx, val);
 	}
 
+	opts->debug_async = scconf_get_bool(block, "debug_async", opts->debug_async);
+	opts->debug_async_buffer = scconf_get_int(block, "debug_async_buffer",
+			opts->debug_async_buffer);
+
 	ctx->paranoid_memory = scconf_get_bool (block, "paranoid-memory",
 		ctx->paranoid_memory);
 
 	ctx->enable_default_driver = scconf_get_bool (block, "enable_default_driver",
 			ctx->enable_default_driver);
 
+	ctx->use_binding_cache = scconf_get_bool (block, "use_binding_cache",
+			ctx->use_binding_cache);
+
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
 		if (opts->forced_card_driver)
@@ -271,6 +293,13 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 		opts->forced_card_driver = strdup(val);
 	}
 
+	val = scconf_get_str(block, "force_reader_driver", NULL);
+	if (val) {
+		if (opts->forced_reader_driver)
+			free(opts->forced_reader_driver);
+		opts->forced_reader_driver = strdup(val);
+	}
+
 	list = scconf_find_list(block, "card_drivers");
 	if (list != NULL)
 		del_drvs(opts);
@@ -680,6 +709,7 @@ int sc_context_repair(sc_context_t **ctx_out)
 	 * card drivers - so rebuild the ATR's
 	 */
 	load_card_atrs(*ctx_out);
+	_sc_atr_index_build(*ctx_out);
 
 	/* TODO: May need to re-open any card driver DLL's */
 
@@ -718,11 +748,18 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 		ctx->thread_ctx = parm->thread_ctx;
 	r = sc_mutex_create(ctx, &ctx->mutex);
 	if (r != SC_SUCCESS) {
+		del_drvs(&opts);
 		sc_release_context(ctx);
 		return r;
 	}
 
 	process_config_file(ctx, &opts);
+	if (opts.debug_async) {
+		r = _sc_log_async_start(ctx,
+				opts.debug_async_buffer > 0 ? opts.debug_async_buffer : 0);
+		if (r != SC_SUCCESS)
+			sc_log(ctx, "Asynchronous logging not available: %s", sc_strerror(r));
+	}
 	sc_log(ctx, "==================================="); /* first thing in the log */
 	sc_log(ctx, "opensc version: %s", sc_get_version());
 
@@ -737,17 +774,32 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	ctx->reader_driver = sc_get_ctapi_driver();
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
+#elif defined(ENABLE_VIRTUAL_READER)
+	ctx->reader_driver = sc_get_virtual_driver();
 #endif
+	if (opts.forced_reader_driver) {
+#ifdef ENABLE_VIRTUAL_READER
+		if (!strcmp(opts.forced_reader_driver, "virtual"))
+			ctx->reader_driver = sc_get_virtual_driver();
+		else
+#endif
+			sc_log(ctx, "Reader driver '%s' not available", opts.forced_reader_driver);
+		free(opts.forced_reader_driver);
+	}
 
 	load_reader_driver_options(ctx);
 	r = ctx->reader_driver->ops->init(ctx);
 	if (r != SC_SUCCESS)   {
+		if (opts.forced_card_driver)
+			free(opts.forced_card_driver);
+		del_drvs(&opts);
 		sc_release_context(ctx);
 		return r;
 	}
 
 	load_card_drivers(ctx, &opts);
 	load_card_atrs(ctx);
+	_sc_atr_index_build(ctx);
 	if (opts.forced_card_driver) {
 		/* FIXME: check return value? */
 		sc_set_card_driver(ctx, opts.forced_card_driver);
@@ -805,6 +857,9 @@ int sc_release_context(sc_context_t *ctx)
 	if (ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
+	_sc_atr_index_free(ctx);
+	if (ctx->profile_cache_free != NULL)
+		ctx->profile_cache_free(ctx->profile_cache);
 	for (i = 0; ctx->card_drivers[i]; i++) {
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
@@ -824,6 +879,7 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->conf != NULL)
 		scconf_free(ctx->conf);
+	_sc_log_async_stop(ctx);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
@@ -806,6 +806,16 @@ static int cwa_compute_session_keys(sc_card_t * card, cwa_sm_status_t * sm)
 	SHA1(data, 32 + 4, sha_data);
 	memcpy(sm->session.kmac, sha_data, 16);	/* kmac=16 fsb sha((kifd^kicc)||00000002) */
 
+	/* expand the session keys once for all the APDUs of the session */
+	DES_set_key_unchecked((const_DES_cblock *) & (sm->session.kenc[0]),
+			      &sm->session.kenc_ks[0]);
+	DES_set_key_unchecked((const_DES_cblock *) & (sm->session.kenc[8]),
+			      &sm->session.kenc_ks[1]);
+	DES_set_key_unchecked((const_DES_cblock *) & (sm->session.kmac[0]),
+			      &sm->session.kmac_ks[0]);
+	DES_set_key_unchecked((const_DES_cblock *) & (sm->session.kmac[8]),
+			      &sm->session.kmac_ks[1]);
+
 	/* evaluate send sequence counter  (cwa-14890-1 sect 8.9 & 9.6 */
 	memcpy(sm->session.ssc, sm->rndicc + 4, 4);	/* 4 least significant bytes of rndicc */
 	memcpy(sm->session.ssc + 4, sm->rndifd + 4, 4);	/* 4 least significant bytes of rndifd */
@@ -1435,8 +1445,8 @@ int cwa_encode_apdu(sc_card_t * card,
 	u8 *ccbuf = NULL;		/* where to store data to eval cryptographic checksum CC */
 	size_t cclen = 0;
 	u8 macbuf[8];		/* to store and compute CC */
-	DES_key_schedule k1;
-	DES_key_schedule k2;
+	DES_key_schedule *k1;
+	DES_key_schedule *k2;
 	char *msg = NULL;
 
 	size_t i, j;		/* for xor loops */
@@ -1518,12 +1528,7 @@ int cwa_encode_apdu(sc_card_t * card,
 	if (from->lc != 0) {
 		size_t dlen = from->lc;
 
-		/* prepare keys */
 		DES_cblock iv = { 0, 0, 0, 0, 0, 0, 0, 0 };
-		DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kenc[0]),
-				      &k1);
-		DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kenc[8]),
-				      &k2);
 
 		/* pad message */
 		memcpy(msgbuf, from->data, dlen);
@@ -1532,7 +1537,8 @@ int cwa_encode_apdu(sc_card_t * card,
 		/* start kriptbuff with iso padding indicator */
 		*cryptbuf = 0x01;
 		/* aply TDES + CBC with kenc and iv=(0,..,0) */
-		DES_ede3_cbc_encrypt(msgbuf, cryptbuf + 1, dlen, &k1, &k2, &k1,
+		DES_ede3_cbc_encrypt(msgbuf, cryptbuf + 1, dlen, &sm_session->kenc_ks[0],
+				     &sm_session->kenc_ks[1], &sm_session->kenc_ks[0],
 				     &iv, DES_ENCRYPT);
 		/* compose data TLV and add to result buffer */
 		res =
@@ -1569,22 +1575,22 @@ int cwa_encode_apdu(sc_card_t * card,
 		msg = "Error in computing SSC";
 		goto encode_end;
 	}
-	/* set up keys for mac computing */
-	DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kmac[0]),&k1);
-	DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kmac[8]),&k2);
+	/* keys for mac computing, expanded with the session keys */
+	k1 = &sm_session->kmac_ks[0];
+	k2 = &sm_session->kmac_ks[1];
 
 	memcpy(macbuf, sm_session->ssc, 8);	/* start with computed SSC */
 	for (i = 0; i < cclen; i += 8) {	/* divide data in 8 byte blocks */
 		/* compute DES */
 		DES_ecb_encrypt((const_DES_cblock *) macbuf,
-				(DES_cblock *) macbuf, &k1, DES_ENCRYPT);
+				(DES_cblock *) macbuf, k1, DES_ENCRYPT);
 		/* XOR with next data and repeat */
 		for (j = 0; j < 8; j++)
 			macbuf[j] ^= ccbuf[i + j];
 	}
 	/* and apply 3DES to result */
 	DES_ecb2_encrypt((const_DES_cblock *) macbuf, (DES_cblock *) macbuf,
-			 &k1, &k2, DES_ENCRYPT);
+			 k1, k2, DES_ENCRYPT);
 
 	/* compose and add computed MAC TLV to result buffer */
 	res = cwa_compose_tlv(card, 0x8E, 4, macbuf, &apdubuf, &apdulen);
@@ -1652,8 +1658,8 @@ int cwa_decode_response(sc_card_t * card,
 	size_t cclen = 0;	/* ccbuf len */
 	u8 macbuf[8];		/* where to calculate mac */
 	size_t resplen = 0;	/* respbuf length */
-	DES_key_schedule k1;
-	DES_key_schedule k2;
+	DES_key_schedule *k1;
+	DES_key_schedule *k2;
 	int res = SC_SUCCESS;
 	char *msg = NULL;	/* to store error messages */
 	sc_context_t *ctx = NULL;
@@ -1790,22 +1796,22 @@ int cwa_decode_response(sc_card_t * card,
 		msg = "Error in computing SSC";
 		goto response_decode_end;
 	}
-	/* set up keys for mac computing */
-	DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kmac[0]), &k1);
-	DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kmac[8]), &k2);
+	/* keys for mac computing, expanded with the session keys */
+	k1 = &sm_session->kmac_ks[0];
+	k2 = &sm_session->kmac_ks[1];
 
 	memcpy(macbuf, sm_session->ssc, 8);	/* start with computed SSC */
 	for (i = 0; i < cclen; i += 8) {	/* divide data in 8 byte blocks */
 		/* compute DES */
 		DES_ecb_encrypt((const_DES_cblock *) macbuf,
-				(DES_cblock *) macbuf, &k1, DES_ENCRYPT);
+				(DES_cblock *) macbuf, k1, DES_ENCRYPT);
 		/* XOR with data and repeat */
 		for (j = 0; j < 8; j++)
 			macbuf[j] ^= ccbuf[i + j];
 	}
 	/* finally apply 3DES to result */
 	DES_ecb2_encrypt((const_DES_cblock *) macbuf, (DES_cblock *) macbuf,
-			 &k1, &k2, DES_ENCRYPT);
+			 k1, k2, DES_ENCRYPT);
 
 	/* check evaluated mac with provided by apdu response */
 
@@ -1858,15 +1864,11 @@ int cwa_decode_response(sc_card_t * card,
 			res = SC_ERROR_INVALID_DATA;
 			goto response_decode_end;
 		}
-		/* prepare keys to decode */
-		DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kenc[0]),
-				      &k1);
-		DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kenc[8]),
-				      &k2);
 		/* decrypt into response buffer
 		 * by using 3DES CBC by mean of kenc and iv={0,...0} */
 		DES_ede3_cbc_encrypt(&e_tlv->data[1], to->resp, e_tlv->len - 1,
-				     &k1, &k2, &k1, &iv, DES_DECRYPT);
+				     &sm_session->kenc_ks[0], &sm_session->kenc_ks[1],
+				     &sm_session->kenc_ks[0], &iv, DES_DECRYPT);
 		to->resplen = e_tlv->len - 1;
 		/* remove iso padding from response length */
 		for (; (to->resplen > 0) && *(to->resp + to->resplen - 1) == 0x00; to->resplen--) ;	/* empty loop */
@@ -2072,7 +2074,9 @@ static cwa_provider_t default_cwa_provider = {
 	   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 	   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
 	  {			/* SSC Send Sequence counter */
-	   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+	   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+	  { { { { { 0 } } } } },	/* Kenc key schedules */
+	  { { { { { 0 } } } } }	/* Kmac key schedules */
 	  }
 	 },
 
@@ -61,6 +61,8 @@ typedef struct cwa_sm_session_st {
 	u8 kenc[16];	/** key used for data encoding */
 	u8 kmac[16];	/** key for mac checksum calculation */
 	u8 ssc[8];	/** send sequence counter */
+	DES_key_schedule kenc_ks[2];	/** kenc expanded by cwa_compute_session_keys() */
+	DES_key_schedule kmac_ks[2];	/** kmac expanded by cwa_compute_session_keys() */
 } cwa_sm_session_t;
 
 /**
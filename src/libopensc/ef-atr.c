@@ -105,6 +105,26 @@ sc_parse_ef_atr_content(struct sc_card *card, unsigned char *buf, size_t buflen)
 		}
 	}
 
+	tag = sc_asn1_find_tag(ctx, buf, buflen, ISO7816_TAG_II_EXTENDED_LENGTH, &taglen);
+	if (tag)   {
+		size_t *sizes[2], i, j, len;
+
+		sizes[0] = &ef_atr.max_command_apdu;
+		sizes[1] = &ef_atr.max_response_apdu;
+		for (i = 0; i < 2; i++)   {
+			const unsigned char *val = sc_asn1_find_tag(ctx, tag, taglen, SC_ASN1_TAG_INTEGER, &len);
+
+			if (!val || len > sizeof(size_t))
+				break;
+			for (j = 0, *sizes[i] = 0; j < len; j++)
+				*sizes[i] = (*sizes[i] << 8) | val[j];
+			taglen -= (val + len) - tag;
+			tag = val + len;
+		}
+		sc_log(ctx, "EF.ATR: max command/response APDU %lu/%lu",
+				(unsigned long)ef_atr.max_command_apdu, (unsigned long)ef_atr.max_response_apdu);
+	}
+
 	if (category == ISO7816_II_CATEGORY_TLV)   {
 		tag = sc_asn1_find_tag(ctx, buf, buflen, ISO7816_TAG_II_STATUS_SW, &taglen);
 		if (tag && taglen == 2)   {
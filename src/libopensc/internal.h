@@ -80,6 +80,16 @@ int _sc_parse_atr(struct sc_reader *reader);
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
 
+/* Precompile the ATR tables of all card drivers (built-in 'match_atrs' and
+ * the 'card_atr' blocks of the configuration) for sc_connect_card() */
+int _sc_atr_index_build(struct sc_context *ctx);
+void _sc_atr_index_free(struct sc_context *ctx);
+
+/* Binding cache: the card driver ("driver") and the PKCS#15 binding ("pkcs15")
+ * that recognised the cards with the same ATR */
+int _sc_card_binding_get(struct sc_card *card, const char *key, char *value, size_t size);
+int _sc_card_binding_set(struct sc_card *card, const char *key, const char *value);
+
 /**
  * Convert an unsigned long into 4 bytes in big endian order
  * @param  buf   the byte array for the result, should be 4 bytes long
@@ -123,6 +133,25 @@ int _sc_card_add_ec_alg(struct sc_card *card, unsigned int key_length,
 			 unsigned long flags, unsigned long ext_flags,
 			 struct sc_object_id *curve_oid);
 
+/* Card cache (see struct sc_card_cache) */
+void _sc_card_cache_invalidate(struct sc_card *card);
+void _sc_card_cache_flush_fci(struct sc_card *card);
+/* Called for every APDU sent to the card; forgets the selected file
+ * unless the command is known to keep it, and flushes the FCI cache
+ * when the command modifies the file system. */
+void _sc_card_cache_apdu(struct sc_card *card, const struct sc_apdu *apdu);
+int _sc_card_cache_is_selected(struct sc_card *card, const struct sc_path *path);
+const struct sc_file *_sc_card_cache_find_fci(struct sc_card *card, const struct sc_path *path);
+/* Records 'path' as selected; 'file' (if not NULL) is copied into the FCI cache */
+void _sc_card_cache_set_selected(struct sc_card *card, const struct sc_path *path,
+			 const struct sc_file *file);
+/* Returns non-zero if 'env' is known to be the active security environment */
+int _sc_card_cache_se_matches(struct sc_card *card, const struct sc_security_env *env,
+			 int se_num);
+void _sc_card_cache_set_se(struct sc_card *card, const struct sc_security_env *env,
+			 int se_num);
+void _sc_card_cache_forget_se(struct sc_card *card);
+
 /********************************************************************/
 /*                 pkcs1 padding/encoding functions                 */
 /********************************************************************/
@@ -221,6 +250,26 @@ unsigned long sc_thread_id(const sc_context_t *ctx);
  */
 int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	size_t *len, unsigned int proto);
+/**
+ * Returns the encoded APDU and room for the response in the transmit buffer
+ * of the reader. The buffer is reused by the following APDUs and only grows
+ * when needed; call sc_apdu_clear_reader_buffers() when done with it.
+ * @param  reader  sc_reader_t object the APDU is sent to
+ * @param  apdu    sc_apdu_t object with the APDU to encode
+ * @param  proto   protocol to be used
+ * @param  sbuf    the encoded APDU
+ * @param  slen    length of the encoded APDU
+ * @param  rbuf    buffer for the response
+ * @param  rlen    needed size of the response buffer
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_apdu_get_reader_buffers(sc_reader_t *reader, const sc_apdu_t *apdu,
+	unsigned int proto, u8 **sbuf, size_t *slen, u8 **rbuf, size_t rlen);
+/**
+ * Wipes the part of the transmit buffer of the reader used by the last APDU
+ * @param  reader  sc_reader_t object
+ */
+void sc_apdu_clear_reader_buffers(sc_reader_t *reader);
 /**
  * Sets the status bytes and return data in the APDU
  * @param  ctx     sc_context_t object
@@ -231,6 +280,18 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
  */
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len);
+/**
+ * Starts the asynchronous log backend: log lines are queued in per-thread
+ * ring buffers of ring_size bytes (0 for the default) and written to
+ * ctx->debug_file by a background thread.
+ */
+int _sc_log_async_start(sc_context_t *ctx, size_t ring_size);
+/** Flushes queued log lines and stops the log writer thread */
+void _sc_log_async_stop(sc_context_t *ctx);
+/** Flushes queued log lines and keeps the writer off ctx->debug_file until unlocked */
+void _sc_log_async_lock(sc_context_t *ctx);
+void _sc_log_async_unlock(sc_context_t *ctx);
+
 /**
  * Logs APDU
  * @param  ctx          sc_context_t object
@@ -246,6 +307,7 @@ extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_driver(void);
 
 #ifdef __cplusplus
 }
@@ -466,8 +466,9 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 	unsigned char buf[SC_MAX_APDU_BUFFER_SIZE];
 	unsigned char pathbuf[SC_MAX_PATH_SIZE], *path = pathbuf;
 	int r, pathlen, pathtype;
-	int select_mf = 0;
+	int select_mf = 0, cacheable;
 	struct sc_file *file = NULL;
+	const struct sc_file *cached = NULL;
 
 	assert(card != NULL && in_path != NULL);
 	ctx = card->ctx;
@@ -478,6 +479,27 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 	if (file_out != NULL) {
 		*file_out = NULL;
 	}
+
+	/* Only absolute selections identify the same file whatever
+	 * the card has currently selected. */
+	cacheable = pathtype == SC_PATH_TYPE_PATH || pathtype == SC_PATH_TYPE_DF_NAME
+		|| (pathtype == SC_PATH_TYPE_FILE_ID && pathlen == 2
+			&& !memcmp(path, "\x3F\x00", 2) && !in_path->aid.len)
+		|| (in_path->aid.len && !pathlen);
+	if (cacheable && file_out != NULL)
+		cached = _sc_card_cache_find_fci(card, in_path);
+	if (cacheable && _sc_card_cache_is_selected(card, in_path)
+			&& (file_out == NULL || cached != NULL)) {
+		sc_log(ctx, "file already selected, SELECT skipped");
+		if (file_out != NULL) {
+			sc_file_dup(file_out, cached);
+			if (*file_out == NULL)
+				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+			/* the cached path is the one of the first selection */
+			(*file_out)->path = *in_path;
+		}
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
 	if (in_path->aid.len) {
 		if (!pathlen) {
 			memcpy(path, in_path->aid.value, in_path->aid.len);
@@ -540,7 +562,7 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 	apdu.data = path;
 	apdu.datalen = pathlen;
 
-	if (file_out != NULL) {
+	if (file_out != NULL && cached == NULL) {
 		apdu.p2 = 0;		/* first record, return FCI */
 		apdu.resp = buf;
 		apdu.resplen = sizeof(buf);
@@ -553,7 +575,7 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 
 	r = sc_transmit_apdu(card, &apdu);
 	LOG_TEST_RET(ctx, r, "APDU transmit failed");
-	if (file_out == NULL) {
+	if (file_out == NULL || cached != NULL) {
 		/* For some cards 'SELECT' can be only with request to return FCI/FCP. */
 		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 		if (apdu.sw1 == 0x6A && apdu.sw2 == 0x86)   {
@@ -562,7 +584,17 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 				r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 		}
 		if (apdu.sw1 == 0x61)
-			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+			r = SC_SUCCESS;
+		if (r == SC_SUCCESS && cacheable)
+			_sc_card_cache_set_selected(card, in_path, NULL);
+		if (r == SC_SUCCESS && cached != NULL) {
+			/* file sizes and attributes from the FCI returned earlier */
+			sc_file_dup(file_out, cached);
+			if (*file_out == NULL)
+				r = SC_ERROR_OUT_OF_MEMORY;
+			else
+				(*file_out)->path = *in_path;
+		}
 		LOG_FUNC_RETURN(ctx, r);
 	}
 
@@ -578,6 +610,8 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 			file->path = *in_path;
 
+			if (cacheable)
+				_sc_card_cache_set_selected(card, in_path, file);
 			*file_out = file;
 			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 		}
@@ -598,6 +632,8 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 		}
 		if ((size_t)apdu.resp[1] + 2 <= apdu.resplen)
 			card->ops->process_fci(card, file, apdu.resp+2, apdu.resp[1]);
+		if (cacheable)
+			_sc_card_cache_set_selected(card, in_path, file);
 		*file_out = file;
 		break;
 	case 0x00: /* proprietary coding */
@@ -1185,7 +1221,7 @@ static struct sc_card_driver iso_driver = {
 	"ISO 7816 reference driver",
 	"iso7816",
 	&iso_ops,
-	NULL, 0, NULL
+	NULL, 0, NULL, NULL
 };
 
 struct sc_card_driver * sc_get_iso7816_driver(void)
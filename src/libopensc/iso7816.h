@@ -38,6 +38,10 @@ extern "C" {
 #define ISO7816_TAG_II_STATUS_LCS		0x81
 #define ISO7816_TAG_II_STATUS_SW		0x82
 #define ISO7816_TAG_II_STATUS_LCS_SW		0x83
+#define ISO7816_TAG_II_EXTENDED_LENGTH		0x7F66
+
+/* Third byte of the card capabilities: extended Lc and Le fields */
+#define ISO7816_CAP_EXTENDED_LENGTH		0x40
 
 /* Other interindustry data tags */
 #define IASECC_TAG_II_IO_BUFFER_SIZES		0xE0
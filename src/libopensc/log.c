@@ -44,6 +44,305 @@
 
 #include "internal.h"
 
+#ifdef HAVE_PTHREAD
+/* Asynchronous log backend: every logging thread appends formatted lines
+ * to its own ring buffer, a writer thread drains the rings to the debug
+ * file.  Producers only ever contend with the writer on their own ring. */
+#define SC_LOG_ASYNC_INTERVAL_MS	100
+#define SC_LOG_ASYNC_MIN_RING		8192
+#define SC_LOG_ASYNC_DEFAULT_RING	65536
+
+struct sc_log_ring {
+	pthread_mutex_t lock;
+	char *buf;
+	size_t size, head, used;
+	unsigned long dropped;
+	int orphaned;
+
+	/* Only accessed by the owning thread */
+	time_t ts_sec;
+	char ts_str[16];
+
+	struct sc_log_ring *next;
+};
+
+struct sc_log_async {
+	pthread_key_t key;
+	/* Protects the ring list, 'stop' and the use of ctx->debug_file */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t writer;
+	struct sc_log_ring *rings;
+	size_t ring_size;
+	char *scratch;
+	int stop;
+	sc_context_t *ctx;
+};
+
+static void sc_log_ring_release(void *arg)
+{
+	struct sc_log_ring *ring = (struct sc_log_ring *) arg;
+
+	/* The writer frees the ring once it has drained it */
+	pthread_mutex_lock(&ring->lock);
+	ring->orphaned = 1;
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void sc_log_ring_free(struct sc_log_ring *ring)
+{
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->buf);
+	free(ring);
+}
+
+static struct sc_log_ring *sc_log_async_ring(struct sc_log_async *la)
+{
+	struct sc_log_ring *ring;
+
+	ring = (struct sc_log_ring *) pthread_getspecific(la->key);
+	if (ring != NULL)
+		return ring;
+
+	ring = calloc(1, sizeof(struct sc_log_ring));
+	if (ring == NULL)
+		return NULL;
+	ring->buf = malloc(la->ring_size);
+	if (ring->buf == NULL) {
+		free(ring);
+		return NULL;
+	}
+	ring->size = la->ring_size;
+	ring->ts_sec = (time_t) -1;
+	pthread_mutex_init(&ring->lock, NULL);
+
+	if (pthread_setspecific(la->key, ring) != 0) {
+		sc_log_ring_free(ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&la->lock);
+	ring->next = la->rings;
+	la->rings = ring;
+	pthread_mutex_unlock(&la->lock);
+
+	return ring;
+}
+
+static void sc_log_ring_put(struct sc_log_async *la, struct sc_log_ring *ring,
+		const char *line, size_t len)
+{
+	size_t total = len, pos, chunk;
+	int wakeup;
+
+	if (len == 0 || line[len - 1] != '\n')
+		total++;
+
+	pthread_mutex_lock(&ring->lock);
+	if (ring->size - ring->used < total) {
+		ring->dropped++;
+		pthread_mutex_unlock(&ring->lock);
+		pthread_cond_signal(&la->cond);
+		return;
+	}
+
+	pos = (ring->head + ring->used) % ring->size;
+	chunk = ring->size - pos;
+	if (chunk > len)
+		chunk = len;
+	memcpy(ring->buf + pos, line, chunk);
+	memcpy(ring->buf, line + chunk, len - chunk);
+	if (total != len)
+		ring->buf[(pos + len) % ring->size] = '\n';
+	ring->used += total;
+	wakeup = ring->used >= ring->size / 2;
+	pthread_mutex_unlock(&ring->lock);
+
+	if (wakeup)
+		pthread_cond_signal(&la->cond);
+}
+
+/* Called with la->lock held */
+static void sc_log_async_drain(struct sc_log_async *la)
+{
+	struct sc_log_ring *ring, **prev;
+	FILE *outf = la->ctx->debug_file;
+
+	prev = &la->rings;
+	while ((ring = *prev) != NULL) {
+		size_t used, chunk;
+		unsigned long dropped;
+		int orphaned;
+
+		pthread_mutex_lock(&ring->lock);
+		used = ring->used;
+		chunk = ring->size - ring->head;
+		if (chunk > used)
+			chunk = used;
+		memcpy(la->scratch, ring->buf + ring->head, chunk);
+		memcpy(la->scratch + chunk, ring->buf, used - chunk);
+		ring->head = 0;
+		ring->used = 0;
+		dropped = ring->dropped;
+		ring->dropped = 0;
+		orphaned = ring->orphaned;
+		pthread_mutex_unlock(&ring->lock);
+
+		if (outf != NULL) {
+			fwrite(la->scratch, 1, used, outf);
+			if (dropped)
+				fprintf(outf, "[%s] %lu log messages dropped\n",
+					la->ctx->app_name, dropped);
+		}
+
+		if (orphaned) {
+			*prev = ring->next;
+			sc_log_ring_free(ring);
+		}
+		else {
+			prev = &ring->next;
+		}
+	}
+	if (outf != NULL)
+		fflush(outf);
+}
+
+static void *sc_log_async_writer(void *arg)
+{
+	struct sc_log_async *la = (struct sc_log_async *) arg;
+	struct timespec ts;
+	struct timeval tv;
+
+	pthread_mutex_lock(&la->lock);
+	for (;;) {
+		sc_log_async_drain(la);
+		if (la->stop)
+			break;
+
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = (tv.tv_usec + SC_LOG_ASYNC_INTERVAL_MS * 1000L) * 1000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&la->cond, &la->lock, &ts);
+	}
+	pthread_mutex_unlock(&la->lock);
+
+	return NULL;
+}
+
+int _sc_log_async_start(sc_context_t *ctx, size_t ring_size)
+{
+	struct sc_log_async *la;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (ctx->log_async != NULL)
+		return SC_SUCCESS;
+	if (ring_size == 0)
+		ring_size = SC_LOG_ASYNC_DEFAULT_RING;
+	else if (ring_size < SC_LOG_ASYNC_MIN_RING)
+		ring_size = SC_LOG_ASYNC_MIN_RING;
+
+	la = calloc(1, sizeof(struct sc_log_async));
+	if (la == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	la->scratch = malloc(ring_size);
+	if (la->scratch == NULL) {
+		free(la);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	la->ring_size = ring_size;
+	la->ctx = ctx;
+
+	if (pthread_key_create(&la->key, sc_log_ring_release) != 0) {
+		free(la->scratch);
+		free(la);
+		return SC_ERROR_INTERNAL;
+	}
+	pthread_mutex_init(&la->lock, NULL);
+	pthread_cond_init(&la->cond, NULL);
+
+	if (pthread_create(&la->writer, NULL, sc_log_async_writer, la) != 0) {
+		pthread_cond_destroy(&la->cond);
+		pthread_mutex_destroy(&la->lock);
+		pthread_key_delete(la->key);
+		free(la->scratch);
+		free(la);
+		return SC_ERROR_INTERNAL;
+	}
+
+	ctx->log_async = la;
+	return SC_SUCCESS;
+}
+
+void _sc_log_async_stop(sc_context_t *ctx)
+{
+	struct sc_log_async *la;
+	struct sc_log_ring *ring;
+
+	if (ctx == NULL || ctx->log_async == NULL)
+		return;
+	la = (struct sc_log_async *) ctx->log_async;
+	/* From here on messages are written synchronously */
+	ctx->log_async = NULL;
+
+	pthread_mutex_lock(&la->lock);
+	la->stop = 1;
+	pthread_cond_signal(&la->cond);
+	pthread_mutex_unlock(&la->lock);
+	pthread_join(la->writer, NULL);
+
+	pthread_key_delete(la->key);
+	while ((ring = la->rings) != NULL) {
+		la->rings = ring->next;
+		sc_log_ring_free(ring);
+	}
+	pthread_cond_destroy(&la->cond);
+	pthread_mutex_destroy(&la->lock);
+	free(la->scratch);
+	free(la);
+}
+
+void _sc_log_async_lock(sc_context_t *ctx)
+{
+	struct sc_log_async *la;
+
+	if (ctx == NULL || ctx->log_async == NULL)
+		return;
+	la = (struct sc_log_async *) ctx->log_async;
+	pthread_mutex_lock(&la->lock);
+	/* Pending messages still go to the current debug file */
+	sc_log_async_drain(la);
+}
+
+void _sc_log_async_unlock(sc_context_t *ctx)
+{
+	if (ctx == NULL || ctx->log_async == NULL)
+		return;
+	pthread_mutex_unlock(&((struct sc_log_async *) ctx->log_async)->lock);
+}
+#else
+int _sc_log_async_start(sc_context_t *ctx, size_t ring_size)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void _sc_log_async_stop(sc_context_t *ctx)
+{
+}
+
+void _sc_log_async_lock(sc_context_t *ctx)
+{
+}
+
+void _sc_log_async_unlock(sc_context_t *ctx)
+{
+}
+#endif
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
 
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
@@ -71,11 +370,15 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	struct tm *tm;
 	struct timeval tv;
 	char time_string[40];
+	const char *time_str;
+#endif
+#ifdef HAVE_PTHREAD
+	struct sc_log_ring *ring = NULL;
 #endif
 	FILE		*outf = NULL;
 	int		n;
 
-	if (!ctx || ctx->debug < level)
+	if (!sc_log_enabled(ctx, level))
 		return;
 
 	p = buf;
@@ -89,9 +392,28 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
 #else
 	gettimeofday (&tv, NULL);
-	tm = localtime (&tv.tv_sec);
-	strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
-	r = snprintf(p, left, "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_string, tv.tv_usec / 1000);
+#ifdef HAVE_PTHREAD
+	if (ctx->log_async != NULL)
+		ring = sc_log_async_ring((struct sc_log_async *) ctx->log_async);
+	if (ring != NULL) {
+		/* localtime() is only needed once a second */
+		if (ring->ts_sec != tv.tv_sec) {
+			struct tm tm_buf;
+
+			ring->ts_sec = tv.tv_sec;
+			localtime_r(&tv.tv_sec, &tm_buf);
+			strftime(ring->ts_str, sizeof(ring->ts_str), "%H:%M:%S", &tm_buf);
+		}
+		time_str = ring->ts_str;
+	}
+	else
+#endif
+	{
+		tm = localtime (&tv.tv_sec);
+		strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
+		time_str = time_string;
+	}
+	r = snprintf(p, left, "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_str, tv.tv_usec / 1000);
 #endif
 	p += r;
 	left -= r;
@@ -112,6 +434,13 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (r < 0)
 		return;
 
+#ifdef HAVE_PTHREAD
+	if (ring != NULL) {
+		sc_log_ring_put((struct sc_log_async *) ctx->log_async, ring, buf, strlen(buf));
+		return;
+	}
+#endif
+
 #ifdef _WIN32
 	if (ctx->debug_filename)   {
 		r = sc_ctx_log_to_file(ctx, ctx->debug_filename);
@@ -39,14 +39,29 @@ enum {
 	SC_LOG_DEBUG_MATCH,		/* card matching only */
 };
 
+/* Messages above this level are compiled out (see --with-max-log-level) */
+#ifndef SC_LOG_MAX_LEVEL
+#define SC_LOG_MAX_LEVEL	SC_LOG_DEBUG_MATCH
+#endif
+
+/* Evaluated before any of the message arguments */
+#define sc_log_enabled(ctx, level) \
+	((level) <= SC_LOG_MAX_LEVEL && (ctx) != NULL && (ctx)->debug >= (level))
+
 /* You can't do #ifndef __FUNCTION__ */
 #if !defined(__GNUC__) && !defined(__IBMC__) && !(defined(_MSC_VER) && (_MSC_VER >= 1300))
 #define __FUNCTION__ NULL
 #endif
 
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) do { \
+	if (sc_log_enabled(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
+#define sc_log(ctx, format, args...) do { \
+	if (sc_log_enabled(ctx, SC_LOG_DEBUG_NORMAL)) \
+		sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -62,13 +77,16 @@ void sc_hex_dump(struct sc_context *ctx, int level, const u8 * buf, size_t len,
 char * sc_dump_hex(const u8 * in, size_t count);
 char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+	if (sc_log_enabled(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
 } while (0)
 #define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
-	if (_ret <= 0) { \
+	if (!sc_log_enabled(ctx, level)) { \
+		/* nothing to log */ \
+	} else if (_ret <= 0) { \
 		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
 			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
 	} else { \
@@ -82,8 +100,9 @@ char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (sc_log_enabled(ctx, level)) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
@@ -92,8 +111,9 @@ char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_GOTO_ERR(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (sc_log_enabled(ctx, level)) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		goto err; \
 	} \
 } while(0)
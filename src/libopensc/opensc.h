@@ -254,6 +254,17 @@ struct sc_ef_atr {
 	struct sc_object_id allocation_oid;
 
 	unsigned status;
+
+	/* Extended length information, zero if not present */
+	size_t max_command_apdu;
+	size_t max_response_apdu;
+};
+
+#define SC_MAX_CACHED_FCI	16
+
+struct sc_cached_fci {
+	struct sc_path path;
+	struct sc_file *file;
 };
 
 struct sc_card_cache {
@@ -263,6 +274,25 @@ struct sc_card_cache {
         struct sc_file *current_df;
 
 	int valid;
+
+	/* FCI of the files selected by absolute path or DF name.
+	 * Kept across sc_lock()/sc_unlock() until the card is reset or
+	 * removed, or the file system is modified. */
+	struct sc_cached_fci fci[SC_MAX_CACHED_FCI];
+	unsigned int fci_next;
+
+	/* File known to be selected on the card; only trusted while
+	 * the card lock is held. */
+	struct sc_path selected_path;
+	int selected_valid;
+
+	/* Security environment last set with sc_set_security_env(); only
+	 * trusted while the card lock is held and until the next SELECT. */
+	struct sc_security_env se;
+	int se_num;
+	int se_valid;
+	/* The last sc_set_security_env() call was served from the cache */
+	int se_skipped;
 };
 
 #define SC_PROTO_T0		0x00000001
@@ -287,6 +317,8 @@ struct sc_reader_driver {
 #define SC_READER_CARD_EXCLUSIVE	0x00000008
 #define SC_READER_HAS_WAITING_AREA	0x00000010
 #define SC_READER_REMOVED			0x00000020
+/* The last unlock kept the transaction: the card state was not changed by others */
+#define SC_READER_TRANSACTION_KEPT	0x00000040
 
 /* reader capabilities */
 #define SC_READER_CAP_DISPLAY	0x00000001
@@ -313,6 +345,14 @@ typedef struct sc_reader {
 		int Fi, f, Di, N;
 		u8 FI, DI;
 	} atr_info;
+
+	/* Max Lc/Le reported by the reader itself, zero if unknown */
+	size_t max_send_size;
+	size_t max_recv_size;
+
+	/* Transmit buffer kept between the APDUs, see sc_apdu_get_reader_buffers() */
+	u8 *apdu_buf;
+	size_t apdu_buf_size, apdu_buf_used;
 } sc_reader_t;
 
 /* This will be the new interface for handling PIN commands.
@@ -447,6 +487,11 @@ struct sc_reader_operations {
 #define SC_CARD_CAP_ONLY_RAW_HASH		0x00000040
 #define SC_CARD_CAP_ONLY_RAW_HASH_STRIPPED	0x00000080
 
+/* The environment set by set_security_env() stays in effect on the card
+ * until another MSE, SELECT or reset, so that sc_set_security_env() may
+ * skip identical requests.  Assumed for drivers using the ISO operation. */
+#define SC_CARD_CAP_CACHE_SE		0x00000100
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -617,6 +662,10 @@ typedef struct sc_card_driver {
 	struct sc_atr_table *atr_map;
 	unsigned int natrs;
 	void *dll;
+	/** built-in ATRs, if match_card() accepts no card with another ATR;
+	 *  NULL if match_card() may have to talk to the card to decide.
+	 *  Only used for internal drivers. */
+	struct sc_atr_table *match_atrs;
 } sc_card_driver_t;
 
 /**
@@ -646,9 +695,12 @@ typedef struct sc_context {
 	int debug;
 	int paranoid_memory;
 	int enable_default_driver;
+	int use_binding_cache;
 
 	FILE *debug_file;
 	char *debug_filename;
+	/** asynchronous log backend state (NULL when logging synchronously) */
+	void *log_async;
 	char *preferred_language;
 
 	list_t readers;
@@ -657,7 +709,12 @@ typedef struct sc_context {
 	void *reader_drv_data;
 
 	struct sc_card_driver *card_drivers[SC_MAX_CARD_DRIVERS];
+	/** precompiled ATR tables of the card drivers, see _sc_atr_index_build() */
+	void *atr_index;
 	struct sc_card_driver *forced_driver;
+	/** parsed pkcs15init profile files and the function releasing them */
+	void *profile_cache;
+	void (*profile_cache_free)(void *);
 
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
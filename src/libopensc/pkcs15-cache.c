@@ -28,111 +28,420 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
 
+#include "common/compat_strlcpy.h"
 #include "internal.h"
 #include "pkcs15.h"
 
+/*
+ * All the cached files of a token are kept in one container file, named
+ * after the token serial number and the last update time:
+ *
+ *	header:	magic "OSC15CCH", version, number of entries,
+ *		length of the data area, checksum of the index and data
+ *	index:	one entry per file: path length, path, data offset, data length
+ *	data:	the file contents
+ *
+ * Numbers are 4-byte big-endian. The container is never modified in place:
+ * a new version is written to a temporary file and renamed over the old
+ * one, so the readers, that map the file read-only, always see a complete
+ * container. The mapping is kept in the PKCS#15 card and is only checked
+ * against the file on disk when a file is not found in it.
+ */
+#define CACHE_MAGIC		"OSC15CCH"
+#define CACHE_VERSION		1
+#define CACHE_HEADER_SIZE	24
+#define CACHE_ENTRY_SIZE	28
+#define CACHE_MAX_ENTRIES	1024
+
+struct sc_pkcs15_file_cache {
+	char name[PATH_MAX];
+
+	u8 *map;
+	size_t map_len;
+	int mapped;
+
+	/* identity of the mapped file */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+
+	unsigned int count;
+	const u8 *index;
+	const u8 *data;
+	size_t data_len;
+};
+
+static unsigned long cache_checksum(const u8 *data, size_t len)
+{
+	unsigned long h = 2166136261UL;
+
+	while (len--) {
+		h ^= *data++;
+		h = (h * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return h;
+}
+
 static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
 				   char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
-        char pathname[SC_MAX_PATH_SIZE*2+1];
+	char *last_update;
 	int  r;
-        const u8 *pathptr;
-        size_t i, pathlen;
 
-	if (path->type != SC_PATH_TYPE_PATH)
-                return SC_ERROR_INVALID_ARGUMENTS;
-	assert(path->len <= SC_MAX_PATH_SIZE);
+	if (p15card->tokeninfo == NULL || p15card->tokeninfo->serial_number == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
 	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
 	if (r)
 		return r;
-	pathptr = path->value;
-	pathlen = path->len;
-	if (pathlen > 2 && memcmp(pathptr, "\x3F\x00", 2) == 0) {
-                pathptr += 2;
-		pathlen -= 2;
-	}
-	for (i = 0; i < pathlen; i++)
-		sprintf(pathname + 2*i, "%02X", pathptr[i]);
-	if (p15card->tokeninfo->serial_number != NULL) {
-		char *last_update = sc_pkcs15_get_lastupdate(p15card);
-		if (last_update != NULL)
-			r = snprintf(buf, bufsize, "%s/%s_%s_%s", dir, p15card->tokeninfo->serial_number,
-					last_update, pathname);
+
+	last_update = sc_pkcs15_get_lastupdate(p15card);
+	if (last_update != NULL)
+		r = snprintf(buf, bufsize, "%s/%s_%s.cache", dir,
+				p15card->tokeninfo->serial_number, last_update);
+	else
+		r = snprintf(buf, bufsize, "%s/%s_DATE.cache", dir,
+				p15card->tokeninfo->serial_number);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static void cache_unmap(struct sc_pkcs15_file_cache *cache)
+{
+	if (cache->map != NULL) {
+#ifdef HAVE_SYS_MMAN_H
+		if (cache->mapped)
+			munmap(cache->map, cache->map_len);
 		else
-			r = snprintf(buf, bufsize, "%s/%s_DATE_%s", dir,
-					p15card->tokeninfo->serial_number, pathname);
-		if (r < 0)
-			return SC_ERROR_BUFFER_TOO_SMALL;
-	} else
+#endif
+			free(cache->map);
+	}
+	cache->map = NULL;
+	cache->map_len = 0;
+	cache->mapped = 0;
+	cache->count = 0;
+	cache->index = NULL;
+	cache->data = NULL;
+	cache->data_len = 0;
+	cache->ino = 0;
+	cache->size = 0;
+}
+
+/* Check the header, the index and the checksum of the mapped container */
+static int cache_validate(struct sc_pkcs15_file_cache *cache)
+{
+	const u8 *p = cache->map;
+	unsigned long count, data_len;
+	unsigned int i;
+
+	if (cache->map_len < CACHE_HEADER_SIZE || memcmp(p, CACHE_MAGIC, 8) != 0)
+		return SC_ERROR_CORRUPTED_DATA;
+	if (bebytes2ulong(p + 8) != CACHE_VERSION)
+		return SC_ERROR_CORRUPTED_DATA;
+
+	count = bebytes2ulong(p + 12);
+	data_len = bebytes2ulong(p + 16);
+	if (count > CACHE_MAX_ENTRIES
+			|| CACHE_HEADER_SIZE + count * CACHE_ENTRY_SIZE + data_len != cache->map_len)
+		return SC_ERROR_CORRUPTED_DATA;
+	if (cache_checksum(p + CACHE_HEADER_SIZE, cache->map_len - CACHE_HEADER_SIZE) != bebytes2ulong(p + 20))
+		return SC_ERROR_CORRUPTED_DATA;
+
+	cache->count = count;
+	cache->index = p + CACHE_HEADER_SIZE;
+	cache->data = cache->index + count * CACHE_ENTRY_SIZE;
+	cache->data_len = data_len;
+
+	for (i = 0; i < count; i++) {
+		const u8 *entry = cache->index + i * CACHE_ENTRY_SIZE;
+		unsigned long offset = bebytes2ulong(entry + 20);
+		unsigned long len = bebytes2ulong(entry + 24);
+
+		if (entry[0] > SC_MAX_PATH_SIZE || offset > data_len || len > data_len - offset)
+			return SC_ERROR_CORRUPTED_DATA;
+	}
+
+	return SC_SUCCESS;
+}
+
+static int cache_map(struct sc_pkcs15_file_cache *cache)
+{
+	struct stat stbuf;
+	int fd, r;
+
+	cache_unmap(cache);
+
+	fd = open(cache->name, O_RDONLY
+#ifdef O_BINARY
+			| O_BINARY
+#endif
+			);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	if (fstat(fd, &stbuf) != 0 || stbuf.st_size < CACHE_HEADER_SIZE) {
+		close(fd);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	cache->map_len = (size_t)stbuf.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+	cache->map = mmap(NULL, cache->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	if (cache->map == MAP_FAILED) {
+		cache->map = NULL;
+	}
+	else   {
+		cache->mapped = 1;
+	}
+#endif
+	if (cache->map == NULL) {
+		size_t got = 0;
+
+		cache->map = malloc(cache->map_len);
+		if (cache->map == NULL) {
+			close(fd);
+			cache->map_len = 0;
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		while (got < cache->map_len) {
+			r = read(fd, cache->map + got, cache->map_len - got);
+			if (r <= 0)
+				break;
+			got += r;
+		}
+		if (got != cache->map_len) {
+			close(fd);
+			cache_unmap(cache);
+			return SC_ERROR_FILE_NOT_FOUND;
+		}
+	}
+	close(fd);
+
+	r = cache_validate(cache);
+	if (r != SC_SUCCESS) {
+		cache_unmap(cache);
+		return r;
+	}
+
+	cache->dev = stbuf.st_dev;
+	cache->ino = stbuf.st_ino;
+	cache->size = stbuf.st_size;
+	cache->mtime = stbuf.st_mtime;
+	return SC_SUCCESS;
+}
+
+/* Get the cache of the current token; with 'refresh' check that the mapped
+ * container is still the one on disk and map the new one if it is not */
+static int cache_open(struct sc_pkcs15_card *p15card, int refresh,
+		struct sc_pkcs15_file_cache **out)
+{
+	struct sc_pkcs15_file_cache *cache = p15card->file_cache;
+	char name[PATH_MAX];
+	struct stat stbuf;
+	int r;
+
+	r = generate_cache_filename(p15card, name, sizeof(name));
+	if (r != SC_SUCCESS)
+		return r;
+
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct sc_pkcs15_file_cache));
+		if (cache == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		p15card->file_cache = cache;
+		refresh = 1;
+	}
+
+	if (strcmp(cache->name, name) != 0) {
+		/* Token updated, or other application */
+		cache_unmap(cache);
+		strlcpy(cache->name, name, sizeof(cache->name));
+		refresh = 1;
+	}
+
+	if (refresh) {
+		if (stat(cache->name, &stbuf) != 0) {
+			cache_unmap(cache);
+		}
+		else if (cache->map == NULL || stbuf.st_dev != cache->dev || stbuf.st_ino != cache->ino
+				|| stbuf.st_size != cache->size || stbuf.st_mtime != cache->mtime) {
+			r = cache_map(cache);
+			if (r != SC_SUCCESS)
+				sc_log(p15card->card->ctx, "Cannot use cache container %s: %s",
+						cache->name, sc_strerror(r));
+		}
+	}
+
+	*out = cache;
+	return SC_SUCCESS;
+}
+
+static const u8 *cache_lookup(struct sc_pkcs15_file_cache *cache,
+		const u8 *pathptr, size_t pathlen, size_t *len)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->count; i++) {
+		const u8 *entry = cache->index + i * CACHE_ENTRY_SIZE;
+
+		if (entry[0] == pathlen && memcmp(entry + 1, pathptr, pathlen) == 0) {
+			*len = bebytes2ulong(entry + 24);
+			return cache->data + bebytes2ulong(entry + 20);
+		}
+	}
+	return NULL;
+}
+
+/* Files are cached by their path without the leading MF */
+static int cache_path(const sc_path_t *path, const u8 **pathptr, size_t *pathlen)
+{
+	if (path->type != SC_PATH_TYPE_PATH)
 		return SC_ERROR_INVALID_ARGUMENTS;
-        return SC_SUCCESS;
+	assert(path->len <= SC_MAX_PATH_SIZE);
+
+	*pathptr = path->value;
+	*pathlen = path->len;
+	if (*pathlen > 2 && memcmp(*pathptr, "\x3F\x00", 2) == 0) {
+		*pathptr += 2;
+		*pathlen -= 2;
+	}
+	return SC_SUCCESS;
+}
+
+void sc_pkcs15_free_file_cache(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->file_cache == NULL)
+		return;
+	cache_unmap(p15card->file_cache);
+	free(p15card->file_cache);
+	p15card->file_cache = NULL;
 }
 
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 			       const sc_path_t *path,
 			       u8 **buf, size_t *bufsize)
 {
-	char fname[PATH_MAX];
+	struct sc_pkcs15_file_cache *cache;
+	const u8 *pathptr, *content;
+	size_t pathlen, len, count, offset;
 	int r;
-	FILE *f;
-	size_t count, offset, got;
-	struct stat stbuf;
-	u8 *data = NULL;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	r = cache_path(path, &pathptr, &pathlen);
 	if (r != 0)
 		return r;
-	r = stat(fname, &stbuf);
-	if (r)
-		return SC_ERROR_FILE_NOT_FOUND;
+	r = cache_open(p15card, 0, &cache);
+	if (r != 0)
+		return r;
+
+	content = cache_lookup(cache, pathptr, pathlen, &len);
+	if (content == NULL) {
+		/* Maybe cached by another process since we mapped the container */
+		r = cache_open(p15card, 1, &cache);
+		if (r != 0)
+			return r;
+		content = cache_lookup(cache, pathptr, pathlen, &len);
+		if (content == NULL)
+			return SC_ERROR_FILE_NOT_FOUND;
+	}
+
 	if (path->count < 0) {
-		count = stbuf.st_size;
+		count = len;
 		offset = 0;
 	} else {
 		count = path->count;
 		offset = path->index;
-		if (offset + count > (size_t)stbuf.st_size)
+		if (offset + count > len)
 			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
 	}
+
 	if (*buf == NULL) {
-		data = malloc((size_t)stbuf.st_size);
-		if (data == NULL)
+		*buf = malloc(count ? count : 1);
+		if (*buf == NULL)
 			return SC_ERROR_OUT_OF_MEMORY;
 	} else
 		if (count > *bufsize)
 			return SC_ERROR_BUFFER_TOO_SMALL;
-	f = fopen(fname, "rb");
-	if (f == NULL) {
-		if (data)
-			free(data);
-		return SC_ERROR_FILE_NOT_FOUND;
+
+	memcpy(*buf, content + offset, count);
+	*bufsize = count;
+	return 0;
+}
+
+static int cache_mkstemp(char *tmpname, size_t tmpsize, const char *name)
+{
+	int r;
+
+	r = snprintf(tmpname, tmpsize, "%s.XXXXXX", name);
+	if (r < 0 || (size_t)r >= tmpsize)
+		return -1;
+#ifdef _WIN32
+	if (_mktemp(tmpname) == NULL)
+		return -1;
+	return open(tmpname, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600);
+#else
+	return mkstemp(tmpname);
+#endif
+}
+
+/* Write the new container into a temporary file of the cache directory
+ * and move it in place */
+static int cache_write(struct sc_context *ctx, const char *name,
+		const u8 *content, size_t len)
+{
+	char tmpname[PATH_MAX];
+	size_t written = 0;
+	int fd, r;
+
+	fd = cache_mkstemp(tmpname, sizeof(tmpname), name);
+	/* If the open failed because the cache directory does
+	 * not exist, create it and a re-try.
+	 */
+	if (fd < 0 && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			return r;
+		fd = cache_mkstemp(tmpname, sizeof(tmpname), name);
 	}
-	if (offset) {
-		if (0 != fseek(f, (long)offset, SEEK_SET)) {
-			fclose(f);
-			free(data);
-			return SC_ERROR_FILE_NOT_FOUND;
-		}
+	if (fd < 0)
+		return 0;
+
+	while (written < len) {
+		r = write(fd, content + written, len - written);
+		if (r <= 0)
+			break;
+		written += r;
 	}
-	if (data)
-		*buf = data;
-	got = fread(*buf, 1, count, f);
-	fclose(f);
-	if (got != count) {
-		if (data)
-			free(data);
-		return SC_ERROR_BUFFER_TOO_SMALL;
+	r = close(fd);
+	if (written != len || r != 0) {
+		sc_log(ctx, "write() wrote only %lu bytes", (unsigned long)written);
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+
+#ifdef _WIN32
+	if (!MoveFileExA(tmpname, name, MOVEFILE_REPLACE_EXISTING)) {
+#else
+	if (rename(tmpname, name) != 0) {
+#endif
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
 	}
-	*bufsize = count;
-	if (data)
-		*buf = data;
 	return 0;
 }
 
@@ -140,33 +449,170 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const sc_path_t *path,
 			 const u8 *buf, size_t bufsize)
 {
-	char fname[PATH_MAX];
+	struct sc_pkcs15_file_cache *cache;
+	const u8 *pathptr;
+	size_t pathlen, data_len, total;
+	unsigned int i, count;
+	u8 *content, *entry, *data_area, *data;
 	int r;
-        FILE *f;
-        size_t c;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	r = cache_path(path, &pathptr, &pathlen);
+	if (r != 0)
+		return r;
+	r = cache_open(p15card, 1, &cache);
 	if (r != 0)
 		return r;
 
-	f = fopen(fname, "wb");
-	/* If the open failed because the cache directory does
-	 * not exist, create it and a re-try the fopen() call.
-	 */
-	if (f == NULL && errno == ENOENT) {
-		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
-			return r;
-		f = fopen(fname, "wb");
+	/* Keep the other files of the current container */
+	count = 1;
+	data_len = bufsize;
+	for (i = 0; i < cache->count; i++) {
+		const u8 *old = cache->index + i * CACHE_ENTRY_SIZE;
+
+		if (old[0] == pathlen && memcmp(old + 1, pathptr, pathlen) == 0)
+			continue;
+		count++;
+		data_len += bebytes2ulong(old + 24);
+	}
+	if (count > CACHE_MAX_ENTRIES || data_len > 0xFFFFFFFFUL - CACHE_HEADER_SIZE - count * CACHE_ENTRY_SIZE)
+		return SC_ERROR_NOT_ENOUGH_MEMORY;
+
+	total = CACHE_HEADER_SIZE + count * CACHE_ENTRY_SIZE + data_len;
+	content = calloc(1, total);
+	if (content == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	entry = content + CACHE_HEADER_SIZE;
+	data_area = data = entry + count * CACHE_ENTRY_SIZE;
+	for (i = 0; i < cache->count; i++) {
+		const u8 *old = cache->index + i * CACHE_ENTRY_SIZE;
+		unsigned long len = bebytes2ulong(old + 24);
+
+		if (old[0] == pathlen && memcmp(old + 1, pathptr, pathlen) == 0)
+			continue;
+		memcpy(entry, old, 20);
+		ulong2bebytes(entry + 20, data - data_area);
+		ulong2bebytes(entry + 24, len);
+		memcpy(data, cache->data + bebytes2ulong(old + 20), len);
+		entry += CACHE_ENTRY_SIZE;
+		data += len;
 	}
+	entry[0] = (u8)pathlen;
+	memcpy(entry + 1, pathptr, pathlen);
+	ulong2bebytes(entry + 20, data - data_area);
+	ulong2bebytes(entry + 24, bufsize);
+	memcpy(data, buf, bufsize);
+
+	memcpy(content, CACHE_MAGIC, 8);
+	ulong2bebytes(content + 8, CACHE_VERSION);
+	ulong2bebytes(content + 12, count);
+	ulong2bebytes(content + 16, data_len);
+	ulong2bebytes(content + 20, cache_checksum(content + CACHE_HEADER_SIZE, total - CACHE_HEADER_SIZE));
+
+	r = cache_write(p15card->card->ctx, cache->name, content, total);
+	free(content);
+	if (r != 0)
+		return r;
+
+	/* Map the new container */
+	return cache_open(p15card, 1, &cache);
+}
+
+
+/*
+ * Binding cache.
+ *
+ * The card driver and the PKCS#15 binding (the name of the builtin emulator,
+ * or "internal") that recognised a card are remembered in the cache directory,
+ * in one file per ATR holding a "key value" line per entry. The next connection
+ * of a card with the same ATR tries them first.
+ */
+#define BINDING_LINE_MAX	128
+
+static int binding_filename(struct sc_card *card, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX], atr[SC_MAX_ATR_SIZE * 2 + 1];
+	int r;
+
+	if (card->atr.len == 0)
+		return SC_ERROR_INVALID_CARD;
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	r = snprintf(buf, bufsize, "%s/atr-%s", dir, atr);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+int _sc_card_binding_get(struct sc_card *card, const char *key,
+		char *value, size_t size)
+{
+	char name[PATH_MAX], line[BINDING_LINE_MAX];
+	size_t keylen = strlen(key);
+	FILE *f;
+	int r = SC_ERROR_OBJECT_NOT_FOUND;
+
+	if (!card->ctx->use_binding_cache)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	if (binding_filename(card, name, sizeof(name)) != SC_SUCCESS)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	f = fopen(name, "r");
 	if (f == NULL)
-		return 0;
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, key, keylen) != 0 || line[keylen] != ' ')
+			continue;
+		strlcpy(value, line + keylen + 1, size);
+		r = SC_SUCCESS;
+		break;
+	}
+	fclose(f);
+	return r;
+}
 
-	c = fwrite(buf, 1, bufsize, f);
-        fclose(f);
-	if (c != bufsize) {
-		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "fwrite() wrote only %d bytes", c);
-		unlink(fname);
-		return SC_ERROR_INTERNAL;
+int _sc_card_binding_set(struct sc_card *card, const char *key,
+		const char *value)
+{
+	char name[PATH_MAX], line[BINDING_LINE_MAX];
+	char content[BINDING_LINE_MAX * 4];
+	size_t keylen = strlen(key), len = 0, n;
+	FILE *f;
+	int r;
+
+	if (!card->ctx->use_binding_cache)
+		return SC_SUCCESS;
+	if (_sc_card_binding_get(card, key, line, sizeof(line)) == SC_SUCCESS
+			&& strcmp(line, value) == 0)
+		return SC_SUCCESS;
+	r = binding_filename(card, name, sizeof(name));
+	if (r != SC_SUCCESS)
+		return r;
+
+	/* keep the entries of the other keys */
+	f = fopen(name, "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] == '\0' || (strncmp(line, key, keylen) == 0 && line[keylen] == ' '))
+				continue;
+			n = strlen(line);
+			if (len + n + 1 > sizeof(content))
+				break;
+			memcpy(content + len, line, n);
+			content[len + n] = '\n';
+			len += n + 1;
+		}
+		fclose(f);
 	}
-        return 0;
+
+	r = snprintf(content + len, sizeof(content) - len, "%s %s\n", key, value);
+	if (r < 0 || (size_t)r >= sizeof(content) - len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	len += r;
+
+	sc_log(card->ctx, "binding cache: %s '%s'", key, value);
+	return cache_write(card->ctx, name, (const u8 *)content, len);
 }
@@ -35,14 +35,17 @@
 #include "asn1.h"
 #include "pkcs15.h"
 
+/* The serial number, issuer, subject and CRL distribution points are
+ * not copied: they point into der->value, that the caller keeps as long
+ * as the certificate. der->len is set to the length of the certificate. */
 static int
 parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert)
 {
 	int r;
 	struct sc_algorithm_id sig_alg;
 	struct sc_pkcs15_pubkey *pubkey = NULL;
-	unsigned char *serial = NULL, *issuer = NULL, *subject = NULL, *buf =  der->value;
-	size_t serial_len = 0, issuer_len = 0, subject_len = 0, data_len = 0, buflen = der->len;
+	unsigned char *buf =  der->value;
+	size_t buflen = der->len;
 	struct sc_asn1_entry asn1_version[] = {
 		{ "version", SC_ASN1_INTEGER, SC_ASN1_TAG_INTEGER, 0, &cert->version, NULL },
 		{ NULL, 0, 0, 0, NULL, NULL }
@@ -50,7 +53,7 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	struct sc_asn1_entry asn1_x509v3[] = {
 		{ "certificatePolicies",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, NULL, NULL },
 		{ "subjectKeyIdentifier",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, NULL, NULL },
-		{ "crlDistributionPoints",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL | SC_ASN1_ALLOC, &cert->crl, &cert->crl_len },
+		{ "crlDistributionPoints",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL | SC_ASN1_BORROW, &cert->crl, &cert->crl_len },
 		{ "authorityKeyIdentifier",	SC_ASN1_OCTET_STRING, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, NULL, NULL },
 		{ "keyUsage",			SC_ASN1_BOOLEAN, SC_ASN1_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL, NULL, NULL },
 		{ NULL, 0, 0, 0, NULL, NULL }
@@ -61,11 +64,11 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	};
 	struct sc_asn1_entry asn1_tbscert[] = {
 		{ "version",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 0 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_version, NULL },
-		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC, &serial, &serial_len },
+		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_BORROW | SC_ASN1_TLV, &cert->serial, &cert->serial_len },
 		{ "signature",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &issuer, &issuer_len },
+		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_BORROW | SC_ASN1_TLV, &cert->issuer, &cert->issuer_len },
 		{ "validity",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &subject, &subject_len },
+		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_BORROW | SC_ASN1_TLV, &cert->subject, &cert->subject_len },
 		/* Use a callback to get the algorithm, parameters and pubkey into sc_pkcs15_pubkey */
 		{ "subjectPublicKeyInfo",SC_ASN1_CALLBACK, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, sc_pkcs15_pubkey_from_spki_fields,  &pubkey },
 		{ "extensions",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 3 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_extensions, NULL },
@@ -77,66 +80,27 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 		{ "signatureValue",	SC_ASN1_BIT_STRING, SC_ASN1_TAG_BIT_STRING, 0, NULL, NULL },
 		{ NULL, 0, 0, 0, NULL, NULL }
 	};
-	struct sc_asn1_entry asn1_serial_number[] = {
-		{ "serialNumber", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC, NULL, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_subject[] = {
-		{ "subject", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, NULL, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
-	struct sc_asn1_entry asn1_issuer[] = {
-		{ "issuer", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, NULL, NULL },
-		{ NULL, 0, 0, 0, NULL, NULL }
-	};
 
 	const u8 *obj;
 	size_t objlen;
 
-	memset(cert, 0, sizeof(*cert));
 	obj = sc_asn1_verify_tag(ctx, buf, buflen, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
 	if (obj == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "X.509 certificate not found");
-
-	data_len = objlen + (obj - buf);
-	cert->data.value = malloc(data_len);
-	if (!cert->data.value)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(cert->data.value, buf, data_len);
-	cert->data.len = data_len;
+	der->len = objlen + (obj - buf);
 
 	r = sc_asn1_decode(ctx, asn1_cert, obj, objlen, NULL, NULL);
+	if (pubkey)
+		cert->key = pubkey;
 	LOG_TEST_RET(ctx, r, "ASN.1 parsing of certificate failed");
 
 	cert->version++;
 
 	if (!pubkey)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Unable to decode subjectPublicKeyInfo from cert");
-	cert->key = pubkey;
 
 	sc_asn1_clear_algorithm_id(&sig_alg);
 
-	if (serial && serial_len)   {
-		sc_format_asn1_entry(asn1_serial_number + 0, serial, &serial_len, 1);
-		r = sc_asn1_encode(ctx, asn1_serial_number, &cert->serial, &cert->serial_len);
-		free(serial);
-		LOG_TEST_RET(ctx, r, "ASN.1 encoding of serial failed");
-	}
-
-	if (subject && subject_len)   {
-		sc_format_asn1_entry(asn1_subject + 0, subject, &subject_len, 1);
-		r = sc_asn1_encode(ctx, asn1_subject, &cert->subject, &cert->subject_len);
-		free(subject);
-		LOG_TEST_RET(ctx, r, "ASN.1 encoding of subject");
-	}
-
-	if (issuer && issuer_len)   {
-		sc_format_asn1_entry(asn1_issuer + 0, issuer, &issuer_len, 1);
-		r = sc_asn1_encode(ctx, asn1_issuer, &cert->issuer, &cert->issuer_len);
-		free(issuer);
-		LOG_TEST_RET(ctx, r, "ASN.1 encoding of issuer");
-	}
-
 	return SC_SUCCESS;
 }
 
@@ -147,15 +111,20 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 {
 	int rv;
 	struct sc_pkcs15_cert * cert;
+	struct sc_pkcs15_der der;
 
 	cert =  calloc(1, sizeof(struct sc_pkcs15_cert));
 	if (cert == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	rv = parse_x509_cert(ctx, cert_blob, cert);
+	/* only the key is kept, that does not refer to the blob */
+	der = *cert_blob;
+	rv = parse_x509_cert(ctx, &der, cert);
 
-	*out = cert->key;
-	cert->key = NULL;
+	if (rv == SC_SUCCESS)   {
+		*out = cert->key;
+		cert->key = NULL;
+	}
 	sc_pkcs15_free_certificate(cert);
 
 	LOG_FUNC_RETURN(ctx, rv);
@@ -176,7 +145,8 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 	LOG_FUNC_CALLED(ctx);
 
 	if (info->value.len && info->value.value)   {
-		sc_der_copy(&der, &info->value);
+		r = sc_der_copy(&der, &info->value);
+		LOG_TEST_RET(ctx, r, "Cannot copy certificate value");
 	}
 	else if (info->path.len) {
 		r = sc_pkcs15_read_file(p15card, &info->path, &der.value, &der.len);
@@ -192,12 +162,12 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
 	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
-	if (parse_x509_cert(ctx, &der, cert)) {
-		free(der.value);
+	/* the certificate keeps the buffer its fields point into */
+	cert->data = der;
+	if (parse_x509_cert(ctx, &cert->data, cert)) {
 		sc_pkcs15_free_certificate(cert);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ASN1_OBJECT);
 	}
-	free(der.value);
 
 	*cert_out = cert;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
@@ -269,6 +239,11 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 	sc_format_asn1_entry(asn1_x509_cert_value_choice + 1, &der->value, &der->len, 0);
 	sc_format_asn1_entry(asn1_type_cert_attr + 0, asn1_x509_cert_attr, NULL, 0);
 	sc_format_asn1_entry(asn1_cert + 0, &cert_obj, NULL, 0);
+	if (obj->df && obj->df->buf)   {
+		/* The direct value refers to the DF content that stays allocated */
+		asn1_x509_cert_value_choice[1].flags &= ~SC_ASN1_ALLOC;
+		asn1_x509_cert_value_choice[1].flags |= SC_ASN1_BORROW;
+	}
 
         /* Fill in defaults */
         memset(&info, 0, sizeof(info));
@@ -276,7 +251,7 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 
 	r = sc_asn1_decode(ctx, asn1_cert, *buf, *buflen, buf, buflen);
 	/* In case of error, trash the cert value (direct coding) */
-	if (r < 0 && der->value)
+	if (r < 0 && der->value && !(asn1_x509_cert_value_choice[1].flags & SC_ASN1_BORROW))
 		free(der->value);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
@@ -344,13 +319,10 @@ sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert)
 {
 	assert(cert != NULL);
 
+	/* serial, issuer, subject and crl point into data */
 	if (cert->key)
 		sc_pkcs15_free_pubkey(cert->key);
-	free(cert->subject);
-	free(cert->issuer);
-	free(cert->serial);
 	free(cert->data.value);
-	free(cert->crl);
 	free(cert);
 }
 
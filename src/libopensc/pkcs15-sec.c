@@ -371,10 +371,21 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	}
 
 	/* Probably never happens, but better make sure */
-	if (inlen > sizeof(buf) || outlen < modlen)
+	if (outlen < modlen)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
 
-	memcpy(buf, in, inlen);
+	if (inlen <= sizeof(buf)) {
+		memcpy(buf, in, inlen);
+		tmp = buf;
+	}
+	else if (obj->type != SC_PKCS15_TYPE_PRKEY_GOSTR3410) {
+		/* Only a message hashed by the card can be that long; it is
+		 * handed to the card as is and never modified below. */
+		tmp = (u8 *) in;
+	}
+	else {
+		LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
+	}
 
 	/* revert data to sign when signing with the GOST key.
 	 * TODO: can it be confirmed by the GOST standard?
@@ -382,8 +393,6 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	if (obj->type == SC_PKCS15_TYPE_PRKEY_GOSTR3410)
 		sc_mem_reverse(buf, inlen);
 
-	tmp = buf;
-
 	/* flags: the requested algo
 	 * algo_info->flags: what is supported by the card
 	 * senv.algorithm_flags: what the card will have to do */
@@ -425,6 +434,9 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 		unsigned int algo;
 		size_t tmplen = sizeof(buf);
 
+		if (tmp != buf)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_DATA);
+
 		r = sc_pkcs1_strip_digest_info_prefix(&algo, tmp, inlen, tmp, &tmplen);
 		if (r != SC_SUCCESS || algo == SC_ALGORITHM_RSA_HASH_NONE) {
 			sc_mem_clear(buf, sizeof(buf));
@@ -449,6 +461,9 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	if (pad_flags != 0) {
 		size_t tmplen = sizeof(buf);
 
+		/* padding is only ever applied to a hash */
+		if (tmp != buf)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_DATA);
 		r = sc_pkcs1_encode(ctx, pad_flags, tmp, inlen, tmp, &tmplen, modlen);
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, r, "Unable to add padding");
 
@@ -129,13 +129,32 @@ int sc_pkcs15_is_emulation_only(sc_card_t *card)
 	}
 }
 
+/* Is the builtin emulator enabled by the 'framework pkcs15' configuration? */
+static int builtin_emulator_enabled(scconf_block *conf_block, const char *name)
+{
+	const scconf_list *item;
+
+	if (!conf_block)
+		return 1;
+	if (!scconf_get_bool(conf_block, "enable_builtin_emulation", 1))
+		return 0;
+	item = scconf_find_list(conf_block, "builtin_emulators");
+	if (!item)
+		return 1;
+	for (; item; item = item->next)
+		if (!strcmp(item->data, name))
+			return 1;
+	return 0;
+}
+
 int
 sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 {
 	sc_context_t		*ctx = p15card->card->ctx;
 	scconf_block		*conf_block, **blocks, *blk;
 	sc_pkcs15emu_opt_t	opts;
-	int			i, r = SC_ERROR_WRONG_CARD;
+	char			cached[64];
+	int			i, r = SC_ERROR_WRONG_CARD, hit = -1;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
 	memset(&opts, 0, sizeof(opts));
@@ -143,15 +162,34 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
+	/* the emulator that recognised this ATR the last time goes first */
+	if (_sc_card_binding_get(p15card->card, "pkcs15", cached, sizeof(cached)) != SC_SUCCESS
+			|| !builtin_emulator_enabled(conf_block, cached))
+		cached[0] = '\0';
+	for (i = 0; cached[0] && builtin_emulators[i].name; i++)
+		if (!strcmp(builtin_emulators[i].name, cached)) {
+			sc_log(ctx, "trying cached emulator %s", cached);
+			r = builtin_emulators[i].handler(p15card, &opts);
+			if (r == SC_SUCCESS) {
+				hit = i;
+				goto out;
+			}
+			break;
+		}
+
 	if (!conf_block) {
 		/* no conf file found => try bultin drivers  */
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no conf file (or section), trying all builtin emulators\n");
 		for (i = 0; builtin_emulators[i].name; i++) {
+			if (!strcmp(builtin_emulators[i].name, cached))
+				continue;
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", builtin_emulators[i].name);
 			r = builtin_emulators[i].handler(p15card, &opts);
-			if (r == SC_SUCCESS)
+			if (r == SC_SUCCESS) {
 				/* we got a hit */
+				hit = i;
 				goto out;
+			}
 		}
 	} else {
 		/* we have a conf file => let's use it */
@@ -167,24 +205,32 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 				/* go through the list of builtin drivers */
 				const char *name = item->data;
 
+				if (!strcmp(name, cached))
+					continue;
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", name);
 				for (i = 0; builtin_emulators[i].name; i++)
 					if (!strcmp(builtin_emulators[i].name, name)) {
 						r = builtin_emulators[i].handler(p15card, &opts);
-						if (r == SC_SUCCESS)
+						if (r == SC_SUCCESS) {
 							/* we got a hit */
+							hit = i;
 							goto out;
+						}
 					}
 			}
 		}
 		else if (builtin_enabled) {
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no emulator list in config file, trying all builtin emulators\n");
 			for (i = 0; builtin_emulators[i].name; i++) {
+				if (!strcmp(builtin_emulators[i].name, cached))
+					continue;
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", builtin_emulators[i].name);
 				r = builtin_emulators[i].handler(p15card, &opts);
-				if (r == SC_SUCCESS)
+				if (r == SC_SUCCESS) {
 					/* we got a hit */
+					hit = i;
 					goto out;
+				}
 			}
 		}
 
@@ -209,6 +255,8 @@ out:
 	if (r == SC_SUCCESS) {
 		p15card->magic  = SC_PKCS15_CARD_MAGIC;
 		p15card->flags |= SC_PKCS15_CARD_FLAG_EMULATED;
+		if (hit >= 0)
+			_sc_card_binding_set(p15card->card, "pkcs15", builtin_emulators[hit].name);
 	} else {
 		if (r != SC_ERROR_WRONG_CARD)
 			sc_log(ctx, "Failed to load card emulator: %s", sc_strerror(r));
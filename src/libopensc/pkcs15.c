@@ -114,6 +114,7 @@ static const struct sc_asn1_entry c_asn1_tokeninfo[] = {
 static void sc_pkcs15_free_unusedspace(struct sc_pkcs15_card *p15card);
 static void sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card);
 static void sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card);
+static void obj_index_free(struct sc_pkcs15_obj_index *idx);
 
 int sc_pkcs15_parse_tokeninfo(sc_context_t *ctx,
 	sc_pkcs15_tokeninfo_t *ti, const u8 *buf, size_t blen)
@@ -789,6 +790,9 @@ sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 		free(p15card->md_data);
 
 	sc_pkcs15_remove_objects(p15card);
+	obj_index_free(p15card->obj_index);
+	p15card->obj_index = NULL;
+	sc_pkcs15_free_file_cache(p15card);
 	sc_pkcs15_remove_dfs(p15card);
 	sc_pkcs15_free_unusedspace(p15card);
 	p15card->unusedspace_read = 0;
@@ -1181,6 +1185,7 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 	struct sc_pkcs15_card *p15card = NULL;
 	struct sc_context *ctx = card->ctx;
 	scconf_block *conf_block = NULL;
+	char cached[64];
 	int r, emu_first, enable_emu;
 
 	LOG_FUNC_CALLED(ctx);
@@ -1196,6 +1201,7 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
 	p15card->opts.pin_cache_ignore_user_consent = 0;
+	p15card->opts.share_df_buffers = 0;
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
@@ -1205,10 +1211,12 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
 		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
 				p15card->opts.pin_cache_ignore_user_consent);
+		p15card->opts.share_df_buffers = scconf_get_bool(conf_block, "share_df_buffers", p15card->opts.share_df_buffers);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d share_df_buffers=%d",
 	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache,
-		 p15card->opts.pin_cache_counter, p15card->opts.pin_cache_ignore_user_consent);
+		 p15card->opts.pin_cache_counter, p15card->opts.pin_cache_ignore_user_consent,
+		 p15card->opts.share_df_buffers);
 
 	r = sc_lock(card);
 	if (r) {
@@ -1221,6 +1229,9 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 	if (enable_emu) {
 		sc_log(ctx, "PKCS#15 emulation enabled");
 		emu_first = scconf_get_bool(conf_block, "try_emulation_first", 0);
+		/* start with the binding that worked for this ATR the last time */
+		if (_sc_card_binding_get(card, "pkcs15", cached, sizeof(cached)) == SC_SUCCESS)
+			emu_first = strcmp(cached, "internal") != 0;
 		if (emu_first || sc_pkcs15_is_emulation_only(card)) {
 			r = sc_pkcs15_bind_synthetic(p15card);
 			if (r == SC_SUCCESS)
@@ -1243,6 +1254,8 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 			goto error;
 	}
 done:
+	if (!(p15card->flags & SC_PKCS15_CARD_FLAG_EMULATED))
+		_sc_card_binding_set(card, "pkcs15", "internal");
 	fix_starcos_pkcs15_card(p15card);
 
 	*p15card_out = p15card;
@@ -1269,6 +1282,247 @@ sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 }
 
 
+/*
+ * Object lookup index.
+ *
+ * The objects of the card are kept in the 'obj_list' linked list.
+ * To avoid scanning the whole list for every lookup, the objects are also
+ * registered in per-class vectors and in two hash tables, one keyed on the object ID
+ * (the 'auth_id' for the AUTH objects) and another one on the object path.
+ * The vectors and the hash chains preserve the order of 'obj_list'.
+ *
+ * Appended objects are indexed incrementally; removed objects invalidate the index,
+ * which is rebuilt on the next lookup.
+ */
+#define SC_PKCS15_OBJ_CLASS_COUNT	16
+#define SC_PKCS15_OBJ_INDEX_MIN_SIZE	32
+
+struct sc_pkcs15_obj_index_node {
+	struct sc_pkcs15_object *obj;
+	struct sc_pkcs15_obj_index_node *next;
+};
+
+struct sc_pkcs15_obj_index {
+	struct sc_pkcs15_object *tail;
+
+	int valid;
+	size_t size, count;
+
+	struct sc_pkcs15_obj_index_node **by_id;
+	struct sc_pkcs15_obj_index_node **by_path;
+	struct sc_pkcs15_obj_index_node *nodes;
+	size_t nodes_used;
+
+	struct sc_pkcs15_object **by_class[SC_PKCS15_OBJ_CLASS_COUNT];
+	size_t class_count[SC_PKCS15_OBJ_CLASS_COUNT];
+	size_t class_size[SC_PKCS15_OBJ_CLASS_COUNT];
+};
+
+
+static const struct sc_pkcs15_id *
+get_obj_id_ref(const struct sc_pkcs15_object *obj)
+{
+	const void *data = obj->data;
+
+	switch (obj->type) {
+	case SC_PKCS15_TYPE_CERT_X509:
+		return &((const struct sc_pkcs15_cert_info *) data)->id;
+	case SC_PKCS15_TYPE_PRKEY_RSA:
+	case SC_PKCS15_TYPE_PRKEY_DSA:
+	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
+	case SC_PKCS15_TYPE_PRKEY_EC:
+		return &((const struct sc_pkcs15_prkey_info *) data)->id;
+	case SC_PKCS15_TYPE_PUBKEY_RSA:
+	case SC_PKCS15_TYPE_PUBKEY_DSA:
+	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
+	case SC_PKCS15_TYPE_PUBKEY_EC:
+		return &((const struct sc_pkcs15_pubkey_info *) data)->id;
+	case SC_PKCS15_TYPE_SKEY_DES:
+	case SC_PKCS15_TYPE_SKEY_2DES:
+	case SC_PKCS15_TYPE_SKEY_3DES:
+		return &((const struct sc_pkcs15_skey_info *) data)->id;
+	case SC_PKCS15_TYPE_AUTH_PIN:
+	case SC_PKCS15_TYPE_AUTH_BIO:
+	case SC_PKCS15_TYPE_AUTH_AUTHKEY:
+		return &((const struct sc_pkcs15_auth_info *) data)->auth_id;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return &((const struct sc_pkcs15_data_info *) data)->id;
+	}
+	return NULL;
+}
+
+
+static const struct sc_path *
+get_obj_path_ref(const struct sc_pkcs15_object *obj)
+{
+	const void *data = obj->data;
+
+	switch (obj->type) {
+	case SC_PKCS15_TYPE_CERT_X509:
+		return &((const struct sc_pkcs15_cert_info *) data)->path;
+	case SC_PKCS15_TYPE_PRKEY_RSA:
+	case SC_PKCS15_TYPE_PRKEY_DSA:
+	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
+	case SC_PKCS15_TYPE_PRKEY_EC:
+		return &((const struct sc_pkcs15_prkey_info *) data)->path;
+	case SC_PKCS15_TYPE_PUBKEY_RSA:
+	case SC_PKCS15_TYPE_PUBKEY_DSA:
+	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
+	case SC_PKCS15_TYPE_PUBKEY_EC:
+		return &((const struct sc_pkcs15_pubkey_info *) data)->path;
+	case SC_PKCS15_TYPE_AUTH_PIN:
+		return &((const struct sc_pkcs15_auth_info *) data)->path;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return &((const struct sc_pkcs15_data_info *) data)->path;
+	}
+	return NULL;
+}
+
+
+static unsigned int
+obj_index_hash(const unsigned char *value, size_t len)
+{
+	unsigned int hash = 2166136261U;
+	size_t ii;
+
+	/* FNV-1a */
+	for (ii = 0; ii < len; ii++)
+		hash = (hash ^ value[ii]) * 16777619U;
+	return hash ^ (unsigned int)len;
+}
+
+
+static void
+obj_index_chain_append(struct sc_pkcs15_obj_index *idx, struct sc_pkcs15_obj_index_node **table,
+		unsigned int hash, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_obj_index_node *node = &idx->nodes[idx->nodes_used++];
+	struct sc_pkcs15_obj_index_node **pp = &table[hash & (idx->size - 1)];
+
+	/* Append to the end of chain to keep the order of 'obj_list' */
+	while (*pp)
+		pp = &(*pp)->next;
+	node->obj = obj;
+	node->next = NULL;
+	*pp = node;
+}
+
+
+static int
+obj_index_insert(struct sc_pkcs15_obj_index *idx, struct sc_pkcs15_object *obj)
+{
+	const struct sc_pkcs15_id *id = get_obj_id_ref(obj);
+	const struct sc_path *path = get_obj_path_ref(obj);
+	unsigned int cls = (obj->type >> 8) & (SC_PKCS15_OBJ_CLASS_COUNT - 1);
+
+	if (idx->count >= idx->size)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	if (idx->class_count[cls] >= idx->class_size[cls])   {
+		size_t size = idx->class_size[cls] ? idx->class_size[cls] * 2 : 8;
+		struct sc_pkcs15_object **vec = realloc(idx->by_class[cls], size * sizeof(*vec));
+
+		if (!vec)
+			return SC_ERROR_OUT_OF_MEMORY;
+		idx->by_class[cls] = vec;
+		idx->class_size[cls] = size;
+	}
+	idx->by_class[cls][idx->class_count[cls]++] = obj;
+
+	if (id)
+		obj_index_chain_append(idx, idx->by_id, obj_index_hash(id->value, id->len), obj);
+	if (path)
+		obj_index_chain_append(idx, idx->by_path, obj_index_hash(path->value, path->len), obj);
+
+	idx->count++;
+	return SC_SUCCESS;
+}
+
+
+static void
+obj_index_reset(struct sc_pkcs15_obj_index *idx)
+{
+	int ii;
+
+	free(idx->by_id);
+	free(idx->by_path);
+	free(idx->nodes);
+	idx->by_id = idx->by_path = NULL;
+	idx->nodes = NULL;
+	idx->nodes_used = 0;
+	idx->size = idx->count = 0;
+
+	for (ii = 0; ii < SC_PKCS15_OBJ_CLASS_COUNT; ii++)
+		idx->class_count[ii] = 0;
+	idx->valid = 0;
+}
+
+
+static void
+obj_index_free(struct sc_pkcs15_obj_index *idx)
+{
+	int ii;
+
+	if (!idx)
+		return;
+	obj_index_reset(idx);
+	for (ii = 0; ii < SC_PKCS15_OBJ_CLASS_COUNT; ii++)
+		free(idx->by_class[ii]);
+	free(idx);
+}
+
+
+static int
+obj_index_build(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_obj_index *idx = p15card->obj_index;
+	struct sc_pkcs15_object *obj;
+	size_t num = 0, size = SC_PKCS15_OBJ_INDEX_MIN_SIZE;
+
+	if (!idx)
+		return SC_ERROR_OBJECT_NOT_VALID;
+	if (idx->valid)
+		return SC_SUCCESS;
+
+	obj_index_reset(idx);
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		num++;
+	while (size < num * 2)
+		size *= 2;
+
+	idx->by_id = calloc(size, sizeof(struct sc_pkcs15_obj_index_node *));
+	idx->by_path = calloc(size, sizeof(struct sc_pkcs15_obj_index_node *));
+	idx->nodes = calloc(size * 2, sizeof(struct sc_pkcs15_obj_index_node));
+	if (!idx->by_id || !idx->by_path || !idx->nodes)   {
+		obj_index_reset(idx);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	idx->size = size;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)   {
+		if (obj_index_insert(idx, obj))   {
+			obj_index_reset(idx);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		idx->tail = obj;
+	}
+
+	idx->valid = 1;
+	return SC_SUCCESS;
+}
+
+
+void
+sc_pkcs15_invalidate_object_index(struct sc_pkcs15_card *p15card)
+{
+	if (p15card && p15card->obj_index)
+		p15card->obj_index->valid = 0;
+}
+
+
+static int compare_obj_key(struct sc_pkcs15_object *, void *);
+
+
 static int
 __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
 			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
@@ -1276,8 +1530,13 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 {
 	struct sc_pkcs15_object *obj = NULL;
 	struct sc_pkcs15_df	*df = NULL;
+	struct sc_pkcs15_obj_index *idx = NULL;
+	struct sc_pkcs15_obj_index_node *node = NULL;
+	struct sc_pkcs15_object **vec = NULL;
+	size_t		vec_len = 0, ii = 0;
 	unsigned int	df_mask = 0;
 	size_t		match_count = 0;
+	int		use_chain = 0;
 
 	if (type)
 		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
@@ -1320,8 +1579,50 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 			continue;
 	}
 
-	/* And now loop over all objects */
-	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+	/* Select the candidates from the index:
+	 * the hash chain of the searched ID or path, or else the vector of the object class.
+	 * Without usable index all objects are looped over. */
+	if (obj_index_build(p15card) == SC_SUCCESS)   {
+		struct sc_pkcs15_search_key *sk = (struct sc_pkcs15_search_key *)func_arg;
+
+		idx = p15card->obj_index;
+		if (func == compare_obj_key && sk->id)   {
+			node = idx->by_id[obj_index_hash(sk->id->value, sk->id->len) & (idx->size - 1)];
+			use_chain = 1;
+		}
+		else if (func == compare_obj_key && sk->path)   {
+			node = idx->by_path[obj_index_hash(sk->path->value, sk->path->len) & (idx->size - 1)];
+			use_chain = 1;
+		}
+		else if (!(class_mask & (class_mask - 1)))   {
+			for (ii = 0; ii < SC_PKCS15_OBJ_CLASS_COUNT; ii++)
+				if (class_mask == (1U << ii))
+					break;
+			vec = idx->by_class[ii];
+			vec_len = idx->class_count[ii];
+			ii = 0;
+		}
+	}
+
+	/* And now loop over the candidates */
+	for (;;)   {
+		if (use_chain)   {
+			if (!node)
+				break;
+			obj = node->obj;
+			node = node->next;
+		}
+		else if (vec)   {
+			if (ii >= vec_len)
+				break;
+			obj = vec[ii++];
+		}
+		else   {
+			obj = obj ? obj->next : p15card->obj_list;
+			if (!obj)
+				break;
+		}
+
 		/* Check object type */
 		if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
 			continue;
@@ -1357,33 +1658,9 @@ sc_pkcs15_get_objects(struct sc_pkcs15_card *p15card, unsigned int type,
 static int
 compare_obj_id(struct sc_pkcs15_object *obj, const struct sc_pkcs15_id *id)
 {
-	void *data = obj->data;
+	const struct sc_pkcs15_id *obj_id = get_obj_id_ref(obj);
 
-	switch (obj->type) {
-	case SC_PKCS15_TYPE_CERT_X509:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_cert_info *) data)->id, id);
-	case SC_PKCS15_TYPE_PRKEY_RSA:
-	case SC_PKCS15_TYPE_PRKEY_DSA:
-	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
-	case SC_PKCS15_TYPE_PRKEY_EC:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_prkey_info *) data)->id, id);
-	case SC_PKCS15_TYPE_PUBKEY_RSA:
-	case SC_PKCS15_TYPE_PUBKEY_DSA:
-	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
-	case SC_PKCS15_TYPE_PUBKEY_EC:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_pubkey_info *) data)->id, id);
-	case SC_PKCS15_TYPE_SKEY_DES:
-	case SC_PKCS15_TYPE_SKEY_2DES:
-	case SC_PKCS15_TYPE_SKEY_3DES:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_skey_info *) data)->id, id);
-	case SC_PKCS15_TYPE_AUTH_PIN:
-	case SC_PKCS15_TYPE_AUTH_BIO:
-	case SC_PKCS15_TYPE_AUTH_AUTHKEY:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_auth_info *) data)->auth_id, id);
-	case SC_PKCS15_TYPE_DATA_OBJECT:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_data_info *) data)->id, id);
-	}
-	return 0;
+	return obj_id ? sc_pkcs15_compare_id(obj_id, id) : 0;
 }
 
 
@@ -1472,27 +1749,9 @@ compare_obj_reference(struct sc_pkcs15_object *obj, int value)
 static int
 compare_obj_path(struct sc_pkcs15_object *obj, const struct sc_path *path)
 {
-	void *data = obj->data;
+	const struct sc_path *obj_path = get_obj_path_ref(obj);
 
-	switch (obj->type) {
-	case SC_PKCS15_TYPE_CERT_X509:
-		return sc_compare_path(&((struct sc_pkcs15_cert_info *) data)->path, path);
-	case SC_PKCS15_TYPE_PRKEY_RSA:
-	case SC_PKCS15_TYPE_PRKEY_DSA:
-	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
-	case SC_PKCS15_TYPE_PRKEY_EC:
-		return sc_compare_path(&((struct sc_pkcs15_prkey_info *) data)->path, path);
-	case SC_PKCS15_TYPE_PUBKEY_RSA:
-	case SC_PKCS15_TYPE_PUBKEY_DSA:
-	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
-	case SC_PKCS15_TYPE_PUBKEY_EC:
-		return sc_compare_path(&((struct sc_pkcs15_pubkey_info *) data)->path, path);
-	case SC_PKCS15_TYPE_AUTH_PIN:
-		return sc_compare_path(&((struct sc_pkcs15_auth_info *) data)->path, path);
-	case SC_PKCS15_TYPE_DATA_OBJECT:
-		return sc_compare_path(&((struct sc_pkcs15_data_info *) data)->path, path);
-	}
-	return 0;
+	return obj_path ? sc_compare_path(obj_path, path) : 0;
 }
 
 
@@ -1822,19 +2081,33 @@ sc_pkcs15_find_prkey_by_reference(struct sc_pkcs15_card *p15card, const struct s
 int
 sc_pkcs15_add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
 {
+	struct sc_pkcs15_obj_index *idx;
 	struct sc_pkcs15_object *p = p15card->obj_list;
 
 	if (!obj)
 		return 0;
+	if (!p15card->obj_index)
+		p15card->obj_index = calloc(1, sizeof(struct sc_pkcs15_obj_index));
+	idx = p15card->obj_index;
+
 	obj->next = obj->prev = NULL;
 	if (p15card->obj_list == NULL) {
 		p15card->obj_list = obj;
-		return 0;
 	}
-	while (p->next != NULL)
-		p = p->next;
-	p->next = obj;
-	obj->prev = p;
+	else {
+		if (idx && idx->tail)
+			p = idx->tail;
+		while (p->next != NULL)
+			p = p->next;
+		p->next = obj;
+		obj->prev = p;
+	}
+
+	if (idx)   {
+		idx->tail = obj;
+		if (idx->valid && obj_index_insert(idx, obj))
+			idx->valid = 0;
+	}
 
 	return 0;
 }
@@ -1851,6 +2124,12 @@ sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object
 		obj->prev->next = obj->next;
 	if (obj->next != NULL)
 		obj->next->prev = obj->prev;
+
+	if (p15card->obj_index)   {
+		if (p15card->obj_index->tail == obj)
+			p15card->obj_index->tail = obj->prev;
+		p15card->obj_index->valid = 0;
+	}
 }
 
 
@@ -1859,6 +2138,11 @@ sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
 {
 	struct sc_pkcs15_object *cur = NULL, *next = NULL;
 
+	if (p15card && p15card->obj_index)   {
+		obj_index_reset(p15card->obj_index);
+		p15card->obj_index->tail = NULL;
+	}
+
 	if (!p15card || !p15card->obj_list)
 		return;
 	for (cur = p15card->obj_list; cur; cur = next)   {
@@ -1883,6 +2167,13 @@ sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 		sc_pkcs15_free_pubkey_info((sc_pkcs15_pubkey_info_t *)obj->data);
 		break;
 	case SC_PKCS15_TYPE_CERT:
+		if (obj->data && obj->df && obj->df->buf)   {
+			/* The direct value can be a part of the DF content */
+			struct sc_pkcs15_cert_info *info = (struct sc_pkcs15_cert_info *)obj->data;
+
+			if (info->value.value >= obj->df->buf && info->value.value < obj->df->buf + obj->df->buflen)
+				info->value.value = NULL;
+		}
 		sc_pkcs15_free_cert_info((sc_pkcs15_cert_info_t *)obj->data);
 		break;
 	case SC_PKCS15_TYPE_DATA_OBJECT:
@@ -1937,6 +2228,7 @@ sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card)
 
 	for (cur = p15card->df_list; cur; cur = next)   {
 		next = cur->next;
+		free(cur->buf);
 		free(cur);
 	}
 
@@ -2060,6 +2352,12 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
 	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
 
+	/* Decoders are allowed to refer to the DF content instead of copying it */
+	if (p15card->opts.share_df_buffers)   {
+		df->buf = buf;
+		df->buflen = bufsize;
+	}
+
 	p = buf;
 	while (bufsize && *p != 0x00) {
 
@@ -2068,6 +2366,7 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 			r = SC_ERROR_OUT_OF_MEMORY;
 			goto ret;
 		}
+		obj->df = df;
 		r = func(p15card, obj, &p, &bufsize);
 		if (r) {
 			free(obj);
@@ -2079,12 +2378,9 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 			goto ret;
 		}
 
-		obj->df = df;
 		r = sc_pkcs15_add_object(p15card, obj);
 		if (r) {
-			if (obj->data)
-				free(obj->data);
-			free(obj);
+			sc_pkcs15_free_object(obj);
 			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
 			goto ret;
 		}
@@ -2094,7 +2390,8 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		r = 0;
 ret:
 	df->enumerated = 1;
-	free(buf);
+	if (df->buf != buf)
+		free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -563,6 +563,9 @@ struct sc_pkcs15_df {
 	int record_length;
 	unsigned int type;
 	int enumerated;
+	/* DF content, kept when the decoded objects refer to it */
+	unsigned char *buf;
+	size_t buflen;
 
 	struct sc_pkcs15_df *next, *prev;
 };
@@ -612,6 +615,9 @@ typedef struct sc_pkcs15_tokeninfo {
 	struct sc_supported_algo_info supported_algos[SC_MAX_SUPPORTED_ALGORITHMS];
 } sc_pkcs15_tokeninfo_t;
 
+struct sc_pkcs15_obj_index;
+struct sc_pkcs15_file_cache;
+
 struct sc_pkcs15_operations   {
 	int (*parse_df)(struct sc_pkcs15_card *, struct sc_pkcs15_df *);
 	void (*clear)(struct sc_pkcs15_card *);
@@ -639,6 +645,7 @@ typedef struct sc_pkcs15_card {
 		int use_pin_cache;
 		int pin_cache_counter;
 		int pin_cache_ignore_user_consent;
+		int share_df_buffers;
 	} opts;
 
 	unsigned int magic;
@@ -648,6 +655,10 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	/* lookup index over obj_list, used only internally */
+	struct sc_pkcs15_obj_index *obj_index;
+	/* mapped file cache container of the token, used only internally */
+	struct sc_pkcs15_file_cache *file_cache;
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -721,7 +732,7 @@ int sc_pkcs15_decode_pubkey(struct sc_context *,
 		struct sc_pkcs15_pubkey *, const u8 *, size_t);
 int sc_pkcs15_encode_pubkey(struct sc_context *,
 		struct sc_pkcs15_pubkey *, u8 **, size_t *);
-int sc_pkcs15_encode_pubkey_as_spki(struct sc_context *,
+int sc_pkcs15_encode_pubkey_as_spki(struct sc_context *,
 		struct sc_pkcs15_pubkey *, u8 **, size_t *);
 void sc_pkcs15_erase_pubkey(struct sc_pkcs15_pubkey *);
 void sc_pkcs15_free_pubkey(struct sc_pkcs15_pubkey *);
@@ -886,6 +897,9 @@ int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *obj);
 void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 			     struct sc_pkcs15_object *obj);
+/* Has to be called when the ID or path of an object,
+ * that is already attached to the card, has been changed */
+void sc_pkcs15_invalidate_object_index(struct sc_pkcs15_card *p15card);
 int sc_pkcs15_add_df(struct sc_pkcs15_card *, unsigned int, const sc_path_t *);
 
 int sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card,
@@ -919,6 +933,7 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+void sc_pkcs15_free_file_cache(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -278,18 +278,14 @@ openct_reader_internal_transmit(sc_reader_t *reader,
 
 static int openct_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t       ssize, rsize, rbuflen = 0;
+	size_t       ssize, rsize;
 	u8           *sbuf = NULL, *rbuf = NULL;
 	int          r;
 
-	rsize = rbuflen = apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
-	}
+	rsize = apdu->resplen + 2;
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	r = sc_apdu_get_reader_buffers(reader, apdu, SC_PROTO_RAW,
+			&sbuf, &ssize, &rbuf, rsize);
 	if (r != SC_SUCCESS)
 		goto out;
 	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
@@ -304,14 +300,7 @@ static int openct_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	/* set response */
 	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
+	sc_apdu_clear_reader_buffers(reader);
 	
 	return r;
 }
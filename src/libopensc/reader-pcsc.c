@@ -34,6 +34,10 @@
 #else
 #include <arpa/inet.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <sys/time.h>
+#include <pthread.h>
+#endif
 
 #include "common/libscdl.h"
 #include "internal.h"
@@ -59,6 +63,7 @@ struct pcsc_global_private_data {
 	DWORD disconnect_action;
 	DWORD transaction_end_action;
 	DWORD reconnect_action;
+	unsigned int transaction_linger;
 	const char *provider_library;
 	void *dlhandle;
 	SCardEstablishContext_t SCardEstablishContext;
@@ -76,6 +81,14 @@ struct pcsc_global_private_data {
 	SCardTransmit_t SCardTransmit;
 	SCardListReaders_t SCardListReaders;
 	SCardGetAttrib_t SCardGetAttrib;
+#ifdef HAVE_PTHREAD
+	/* Ends the transactions kept open after pcsc_unlock() */
+	pthread_mutex_t linger_lock;
+	pthread_cond_t linger_cond;
+	pthread_t linger_thread;
+	int linger_running, linger_stop;
+	struct pcsc_private_data *lingering;
+#endif
 };
 
 struct pcsc_private_data {
@@ -97,6 +110,12 @@ struct pcsc_private_data {
 	DWORD get_tlv_properties;
 
 	int locked;
+#ifdef HAVE_PTHREAD
+	/* transaction still open after pcsc_unlock(), until linger_until */
+	int lingering;
+	struct timespec linger_until;
+	struct pcsc_private_data *linger_next;
+#endif
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
@@ -228,7 +247,7 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t       ssize, rsize, rbuflen = 0;
+	size_t       ssize, rsize;
 	u8           *sbuf = NULL, *rbuf = NULL;
 	int          r;
 
@@ -237,14 +256,10 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	 * seems to require a larger than necessary return buffer).
 	 * The buffer for the returned data needs to be at least 2 bytes
 	 * larger than the expected data length to store SW1 and SW2. */
-	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
-	}
+	rsize = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	r = sc_apdu_get_reader_buffers(reader, apdu, reader->active_protocol,
+			&sbuf, &ssize, &rbuf, rsize);
 	if (r != SC_SUCCESS)
 		goto out;
 	if (reader->name)
@@ -262,14 +277,7 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	/* set response */
 	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
+	sc_apdu_clear_reader_buffers(reader);
 
 	return r;
 }
@@ -404,6 +412,88 @@ static int check_forced_protocol(sc_context_t *ctx, struct sc_atr *atr, DWORD *p
 }
 
 
+#ifdef HAVE_PTHREAD
+static void pcsc_linger_unlink(struct pcsc_private_data *priv)
+{
+	struct pcsc_private_data **pp;
+
+	for (pp = &priv->gpriv->lingering; *pp != NULL; pp = &(*pp)->linger_next) {
+		if (*pp == priv) {
+			*pp = priv->linger_next;
+			break;
+		}
+	}
+	priv->linger_next = NULL;
+	priv->lingering = 0;
+}
+
+/* Ends a lingering transaction, with linger_lock held */
+static void pcsc_linger_end(struct pcsc_private_data *priv)
+{
+	pcsc_linger_unlink(priv);
+	priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
+	priv->locked = 0;
+}
+
+static void *pcsc_linger_run(void *arg)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) arg;
+	struct pcsc_private_data *priv, *next;
+	struct timespec ts;
+	struct timeval tv;
+
+	pthread_mutex_lock(&gpriv->linger_lock);
+	while (!gpriv->linger_stop) {
+		gettimeofday(&tv, NULL);
+		next = NULL;
+		for (priv = gpriv->lingering; priv != NULL; priv = priv->linger_next) {
+			if (priv->linger_until.tv_sec < tv.tv_sec
+					|| (priv->linger_until.tv_sec == tv.tv_sec
+						&& priv->linger_until.tv_nsec <= tv.tv_usec * 1000L))
+				break;
+			if (next == NULL || priv->linger_until.tv_sec < next->linger_until.tv_sec
+					|| (priv->linger_until.tv_sec == next->linger_until.tv_sec
+						&& priv->linger_until.tv_nsec < next->linger_until.tv_nsec))
+				next = priv;
+		}
+		if (priv != NULL) {
+			/* expired: end it and look again */
+			pcsc_linger_end(priv);
+			continue;
+		}
+		if (next != NULL) {
+			ts = next->linger_until;
+			pthread_cond_timedwait(&gpriv->linger_cond, &gpriv->linger_lock, &ts);
+		}
+		else {
+			pthread_cond_wait(&gpriv->linger_cond, &gpriv->linger_lock);
+		}
+	}
+	pthread_mutex_unlock(&gpriv->linger_lock);
+
+	return NULL;
+}
+#endif
+
+/* Ends the transaction kept open after pcsc_unlock(), if any */
+static void pcsc_linger_flush(sc_reader_t *reader)
+{
+#ifdef HAVE_PTHREAD
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+
+	if (!gpriv->linger_running)
+		return;
+	pthread_mutex_lock(&gpriv->linger_lock);
+	if (priv->lingering) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "ending lingering transaction");
+		pcsc_linger_end(priv);
+	}
+	pthread_mutex_unlock(&gpriv->linger_lock);
+#endif
+	reader->flags &= ~SC_READER_TRANSACTION_KEPT;
+}
+
 static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 {
 	DWORD active_proto = opensc_proto_to_pcsc(reader->active_protocol),
@@ -426,6 +516,7 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 		protocol = tmp;
 
 	/* reconnect always unlocks transaction */
+	pcsc_linger_flush(reader);
 	priv->locked = 0;
 
 	rv = priv->gpriv->SCardReconnect(priv->pcsc_card,
@@ -505,6 +596,7 @@ static int pcsc_disconnect(sc_reader_t * reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+	pcsc_linger_flush(reader);
 	priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
 	reader->flags = 0;
 	return SC_SUCCESS;
@@ -518,6 +610,24 @@ static int pcsc_lock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	if (priv->gpriv->linger_running) {
+		int resumed;
+
+		pthread_mutex_lock(&priv->gpriv->linger_lock);
+		resumed = priv->lingering;
+		if (resumed)
+			pcsc_linger_unlink(priv);
+		pthread_mutex_unlock(&priv->gpriv->linger_lock);
+		if (resumed) {
+			/* still in the transaction: nobody else used the card */
+			sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "lingering transaction resumed");
+			return SC_SUCCESS;
+		}
+	}
+#endif
+	reader->flags &= ~SC_READER_TRANSACTION_KEPT;
+
 	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
 
 	switch (rv) {
@@ -555,6 +665,30 @@ static int pcsc_unlock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	if (priv->gpriv->linger_running && priv->locked) {
+		struct pcsc_global_private_data *gpriv = priv->gpriv;
+		struct timeval tv;
+
+		/* keep the transaction for the next pcsc_lock() */
+		gettimeofday(&tv, NULL);
+		pthread_mutex_lock(&gpriv->linger_lock);
+		priv->linger_until.tv_sec = tv.tv_sec + gpriv->transaction_linger / 1000;
+		priv->linger_until.tv_nsec = (tv.tv_usec + (gpriv->transaction_linger % 1000) * 1000L) * 1000L;
+		if (priv->linger_until.tv_nsec >= 1000000000L) {
+			priv->linger_until.tv_sec++;
+			priv->linger_until.tv_nsec -= 1000000000L;
+		}
+		priv->lingering = 1;
+		priv->linger_next = gpriv->lingering;
+		gpriv->lingering = priv;
+		pthread_cond_signal(&gpriv->linger_cond);
+		pthread_mutex_unlock(&gpriv->linger_lock);
+		reader->flags |= SC_READER_TRANSACTION_KEPT;
+		return SC_SUCCESS;
+	}
+#endif
+
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
 
 	priv->locked = 0;
@@ -569,6 +703,7 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+	pcsc_linger_flush(reader);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -577,7 +712,11 @@ static int pcsc_reset(sc_reader_t *reader, int do_cold_reset)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 	int r;
-	int old_locked = priv->locked;
+	int old_locked;
+
+	/* a lingering transaction is not held by anybody */
+	pcsc_linger_flush(reader);
+	old_locked = priv->locked;
 
 	r = pcsc_reconnect(reader, do_cold_reset ? SCARD_UNPOWER_CARD : SCARD_RESET_CARD);
 	if(r != SC_SUCCESS)
@@ -600,9 +739,11 @@ static int pcsc_cancel(sc_context_t *ctx)
 #ifndef _WIN32
 	if (gpriv->pcsc_wait_ctx != -1) {
 		rv = gpriv->SCardCancel(gpriv->pcsc_wait_ctx);
-		if (rv == SCARD_S_SUCCESS)
-			 /* Also close and clear the waiting context */
-			 rv = gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
+		if (rv == SCARD_S_SUCCESS) {
+			/* Also close and clear the waiting context */
+			rv = gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
+			gpriv->pcsc_wait_ctx = -1;
+		}
 	}
 #else
 	rv = gpriv->SCardCancel(gpriv->pcsc_ctx);
@@ -663,9 +804,12 @@ static int pcsc_init(sc_context_t *ctx)
 		    scconf_get_bool(conf_block, "enable_pace", gpriv->enable_pace);
 		gpriv->provider_library =
 		    scconf_get_str(conf_block, "provider_library", gpriv->provider_library);
+		gpriv->transaction_linger =
+		    scconf_get_int(conf_block, "transaction_linger", gpriv->transaction_linger);
 	}
-	sc_log(ctx, "PC/SC options: connect_exclusive=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d enable_pace=%d",
-		gpriv->connect_exclusive, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad, gpriv->enable_pace);
+	sc_log(ctx, "PC/SC options: connect_exclusive=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d enable_pace=%d transaction_linger=%u",
+		gpriv->connect_exclusive, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad, gpriv->enable_pace,
+		gpriv->transaction_linger);
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
@@ -726,6 +870,24 @@ static int pcsc_init(sc_context_t *ctx)
 		goto out;
 	}
 
+#ifdef HAVE_PTHREAD
+	if (gpriv->transaction_linger) {
+		pthread_mutex_init(&gpriv->linger_lock, NULL);
+		pthread_cond_init(&gpriv->linger_cond, NULL);
+		if (pthread_create(&gpriv->linger_thread, NULL, pcsc_linger_run, gpriv) == 0) {
+			gpriv->linger_running = 1;
+		}
+		else {
+			sc_log(ctx, "cannot start the transaction linger thread");
+			pthread_cond_destroy(&gpriv->linger_cond);
+			pthread_mutex_destroy(&gpriv->linger_lock);
+		}
+	}
+#else
+	if (gpriv->transaction_linger)
+		sc_log(ctx, "transaction_linger needs thread support, ignored");
+#endif
+
 	ctx->reader_drv_data = gpriv;
 	gpriv = NULL;
 	ret = SC_SUCCESS;
@@ -747,6 +909,19 @@ static int pcsc_finish(sc_context_t *ctx)
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
 	if (gpriv) {
+#ifdef HAVE_PTHREAD
+		if (gpriv->linger_running) {
+			pthread_mutex_lock(&gpriv->linger_lock);
+			while (gpriv->lingering)
+				pcsc_linger_end(gpriv->lingering);
+			gpriv->linger_stop = 1;
+			pthread_cond_signal(&gpriv->linger_cond);
+			pthread_mutex_unlock(&gpriv->linger_lock);
+			pthread_join(gpriv->linger_thread, NULL);
+			pthread_cond_destroy(&gpriv->linger_cond);
+			pthread_mutex_destroy(&gpriv->linger_lock);
+		}
+#endif
 		if (gpriv->pcsc_ctx != -1)
 			gpriv->SCardReleaseContext(gpriv->pcsc_ctx);
 		if (gpriv->dlhandle != NULL)
@@ -817,6 +992,8 @@ err:
     return flags;
 }
 
+static int part10_find_property_by_tag(unsigned char buffer[], int length, int tag_searched);
+
 static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle) {
 	sc_context_t *ctx = reader->ctx;
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
@@ -929,6 +1106,26 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 		}
 	}
 
+	/* Detect the largest APDU the reader can pass to the card */
+	if (priv->get_tlv_properties) {
+		rcount = sizeof(rbuf);
+		rv = gpriv->SCardControl(card_handle, priv->get_tlv_properties, NULL, 0, rbuf, sizeof(rbuf), &rcount);
+		if (rv == SCARD_S_SUCCESS) {
+			int max_apdu = part10_find_property_by_tag(rbuf, rcount,
+					PCSCv2_PART10_PROPERTY_dwMaxAPDUDataSize);
+
+			if (max_apdu > 0) {
+				sc_log(ctx, "Reader supports extended APDUs of up to %i bytes", max_apdu);
+				reader->max_send_size = max_apdu < 65535 ? max_apdu : 65535;
+				reader->max_recv_size = max_apdu < 65536 ? max_apdu : 65536;
+			} else if (max_apdu == 0) {
+				sc_log(ctx, "Reader supports short APDUs only");
+				reader->max_send_size = 255;
+				reader->max_recv_size = 256;
+			}
+		}
+	}
+
 	if (priv->pace_ioctl) {
 		const char *log_text = "Reader supports PACE";
 		if (priv->gpriv->enable_pace) {
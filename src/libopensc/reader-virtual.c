@@ -0,0 +1,971 @@
+/*
+ * reader-virtual.c: Reader driver serving APDUs from a simulated card
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The simulated card is an ISO 7816-4 file system loaded from a directory
+ * (the card image) when the driver is initialized:
+ *
+ *   <image>/atr		ATR in hex (optional, defaults to a T=1 ATR)
+ *   <image>/.pinXX		value of the PIN with reference XX, in hex
+ *   <image>/3F00/		the MF; every DF is a directory and every EF
+ *				a regular file named after its file ID
+ *   <dir>/.name		DF name (AID) of that DF, in hex
+ *
+ * or from a text file scripting the same card, one statement per line
+ * ('#' starts a comment):
+ *
+ *   atr <hex>			ATR
+ *   pin <ref> <hex>		value of the PIN with reference <ref>
+ *   df <path> [<hex>]		DF, with its DF name (AID) if given
+ *   ef <path> [<hex>]		EF and its contents
+ *
+ * <path> lists the file IDs from the MF on, e.g. 3F0050155031, and the
+ * parent DF has to be declared first. Indented lines continue the
+ * contents of the last EF. Hex bytes may be separated by blanks or ':'.
+ *
+ * SELECT, READ BINARY, UPDATE BINARY, VERIFY and GET CHALLENGE are
+ * understood. Updates are kept in memory only, so every context starts
+ * from the same image. Access conditions are not enforced.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef ENABLE_VIRTUAL_READER	/* empty file without the virtual reader */
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "internal.h"
+
+#define GET_PRIV_DATA(r) ((struct virtual_private_data *) (r)->drv_data)
+
+/* 3B 80 80 01 01: T=1, no historical bytes */
+#define VIRTUAL_DEFAULT_ATR	"3B:80:80:01:01"
+#define VIRTUAL_PIN_TRIES	3
+
+struct virtual_file {
+	unsigned int id;
+	int is_df;
+	u8 name[SC_MAX_AID_SIZE];
+	size_t namelen;
+
+	u8 *data;
+	size_t size;
+
+	struct virtual_file *parent;
+	struct virtual_file *children;
+	struct virtual_file *next;
+};
+
+struct virtual_pin {
+	unsigned int ref;
+	u8 value[SC_MAX_PIN_SIZE];
+	size_t len;
+	int tries_left;
+	int verified;
+	struct virtual_pin *next;
+};
+
+struct virtual_global_private_data {
+	char *image;
+	unsigned int latency;	/* milliseconds per APDU */
+	struct sc_atr atr;
+	struct virtual_file *mf;
+	struct virtual_pin *pins;
+};
+
+struct virtual_private_data {
+	struct virtual_global_private_data *gpriv;
+	struct virtual_file *current_df;
+	struct virtual_file *current_ef;
+	unsigned int rnd;
+	int presented;
+};
+
+static struct sc_reader_operations virtual_ops;
+
+static struct virtual_file *virtual_find_child(struct virtual_file *df, unsigned int id);
+
+static struct sc_reader_driver virtual_reader_driver = {
+	"Virtual reader",
+	"virtual",
+	&virtual_ops,
+	0, 0, NULL
+};
+
+static void virtual_free_file(struct virtual_file *file)
+{
+	while (file != NULL) {
+		struct virtual_file *next = file->next;
+
+		virtual_free_file(file->children);
+		free(file->data);
+		free(file);
+		file = next;
+	}
+}
+
+static int virtual_read_whole_file(const char *path, u8 **data, size_t *len)
+{
+	FILE *f;
+	long size;
+	u8 *buf;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) {
+		fclose(f);
+		return SC_ERROR_INTERNAL;
+	}
+	buf = malloc(size + 1);
+	if (buf == NULL) {
+		fclose(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (fread(buf, 1, size, f) != (size_t)size) {
+		free(buf);
+		fclose(f);
+		return SC_ERROR_INTERNAL;
+	}
+	fclose(f);
+	buf[size] = '\0';
+	*data = buf;
+	*len = size;
+	return SC_SUCCESS;
+}
+
+/* Reads a file holding a hex string, ignoring surrounding white space */
+static int virtual_read_hex_file(const char *path, u8 *out, size_t *outlen)
+{
+	u8 *text = NULL;
+	char *p;
+	size_t size, len;
+	int r;
+
+	r = virtual_read_whole_file(path, &text, &size);
+	if (r != SC_SUCCESS)
+		return r;
+	len = size;
+	p = (char *)text;
+	while (len > 0 && strchr(" \t\r\n", p[len - 1]))
+		p[--len] = '\0';
+	while (*p && strchr(" \t\r\n", *p))
+		p++;
+	r = sc_hex_to_bin(p, out, outlen);
+	sc_mem_clear(text, size);
+	free(text);
+	return r;
+}
+
+static int virtual_is_fid(const char *name, unsigned int *fid)
+{
+	u8 bin[2];
+	size_t len = sizeof(bin);
+
+	if (strlen(name) != 4 || sc_hex_to_bin(name, bin, &len) != SC_SUCCESS || len != 2)
+		return 0;
+	*fid = (bin[0] << 8) | bin[1];
+	return 1;
+}
+
+static struct virtual_file *virtual_add_file(struct virtual_file *df, unsigned int fid)
+{
+	struct virtual_file *file;
+
+	file = calloc(1, sizeof(*file));
+	if (file == NULL)
+		return NULL;
+	file->id = fid;
+	file->parent = df;
+	file->next = df->children;
+	df->children = file;
+	return file;
+}
+
+static struct virtual_pin *virtual_add_pin(struct virtual_global_private_data *gpriv, unsigned int ref)
+{
+	struct virtual_pin *pin;
+
+	pin = calloc(1, sizeof(*pin));
+	if (pin == NULL)
+		return NULL;
+	pin->ref = ref;
+	pin->len = sizeof(pin->value);
+	pin->tries_left = VIRTUAL_PIN_TRIES;
+	pin->next = gpriv->pins;
+	gpriv->pins = pin;
+	return pin;
+}
+
+static int virtual_load_df(sc_context_t *ctx, const char *dir, struct virtual_file *df)
+{
+	DIR *d;
+	struct dirent *ent;
+	char path[PATH_MAX];
+	struct stat st;
+	int r = SC_SUCCESS;
+
+	d = opendir(dir);
+	if (d == NULL) {
+		sc_log(ctx, "cannot open card image directory '%s'", dir);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	while (r == SC_SUCCESS && (ent = readdir(d)) != NULL) {
+		struct virtual_file *file;
+		unsigned int fid;
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+
+		if (!strcmp(ent->d_name, ".name")) {
+			df->namelen = sizeof(df->name);
+			r = virtual_read_hex_file(path, df->name, &df->namelen);
+			continue;
+		}
+		if (!virtual_is_fid(ent->d_name, &fid) || stat(path, &st)) {
+			sc_log(ctx, "ignoring '%s' in card image", path);
+			continue;
+		}
+
+		file = virtual_add_file(df, fid);
+		if (file == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			file->is_df = 1;
+			r = virtual_load_df(ctx, path, file);
+		} else {
+			r = virtual_read_whole_file(path, &file->data, &file->size);
+			if (r == SC_SUCCESS && file->size > 0xFFFF) {
+				sc_log(ctx, "'%s' is too large for an EF", path);
+				r = SC_ERROR_INVALID_DATA;
+			}
+		}
+	}
+	closedir(d);
+	return r;
+}
+
+static int virtual_load_pins(sc_context_t *ctx, struct virtual_global_private_data *gpriv)
+{
+	DIR *d;
+	struct dirent *ent;
+	char path[PATH_MAX];
+	int r = SC_SUCCESS;
+
+	d = opendir(gpriv->image);
+	if (d == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	while (r == SC_SUCCESS && (ent = readdir(d)) != NULL) {
+		struct virtual_pin *pin;
+		u8 ref;
+		size_t reflen = 1;
+
+		if (strncmp(ent->d_name, ".pin", 4) || strlen(ent->d_name) != 6
+				|| sc_hex_to_bin(ent->d_name + 4, &ref, &reflen) != SC_SUCCESS)
+			continue;
+
+		pin = virtual_add_pin(gpriv, ref);
+		if (pin == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		snprintf(path, sizeof(path), "%s/%s", gpriv->image, ent->d_name);
+		r = virtual_read_hex_file(path, pin->value, &pin->len);
+		sc_log(ctx, "PIN 0x%02X loaded from card image", ref);
+	}
+	closedir(d);
+	return r;
+}
+
+/* Appends hex bytes, separated by blanks or ':' or not at all */
+static int virtual_append_hex(const char *text, u8 **data, size_t *len, size_t max)
+{
+	u8 *buf;
+	size_t n = *len;
+	int nibbles = 0, byte = 0;
+
+	buf = realloc(*data, n + strlen(text) / 2 + 1);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	*data = buf;
+
+	for (; *text; text++) {
+		if (isspace((unsigned char)*text) || *text == ':') {
+			if (nibbles)
+				return SC_ERROR_INVALID_DATA;
+			continue;
+		}
+		if (!isxdigit((unsigned char)*text))
+			return SC_ERROR_INVALID_DATA;
+		byte = (byte << 4) | (isdigit((unsigned char)*text) ? *text - '0'
+				: tolower((unsigned char)*text) - 'a' + 10);
+		if (++nibbles == 2) {
+			if (n == max)
+				return SC_ERROR_BUFFER_TOO_SMALL;
+			buf[n++] = byte;
+			nibbles = byte = 0;
+		}
+	}
+	*len = n;
+	return nibbles ? SC_ERROR_INVALID_DATA : SC_SUCCESS;
+}
+
+/* Same as virtual_append_hex(), into a fixed size buffer */
+static int virtual_parse_hex(const char *text, u8 *out, size_t *outlen)
+{
+	u8 *data = NULL;
+	size_t len = 0;
+	int r;
+
+	r = virtual_append_hex(text, &data, &len, *outlen);
+	if (r == SC_SUCCESS) {
+		memcpy(out, data, len);
+		*outlen = len;
+	}
+	if (data != NULL) {
+		sc_mem_clear(data, len);
+		free(data);
+	}
+	return r;
+}
+
+static char *virtual_next_word(char **line)
+{
+	char *word = *line + strspn(*line, " \t\r\n");
+	char *end = word + strcspn(word, " \t\r\n");
+
+	*line = *end ? end + 1 : end;
+	*end = '\0';
+	return word;
+}
+
+/* Creates the file named by the last file ID of a path from the MF on */
+static int virtual_script_file(struct virtual_file *mf, const char *text, int is_df,
+		struct virtual_file **out)
+{
+	struct virtual_file *df = mf, *file;
+	u8 path[SC_MAX_PATH_SIZE];
+	size_t pathlen = sizeof(path), i;
+
+	if (sc_hex_to_bin(text, path, &pathlen) != SC_SUCCESS || pathlen < 2 || pathlen % 2
+			|| path[0] != 0x3F || path[1] != 0x00)
+		return SC_ERROR_INVALID_DATA;
+	if (pathlen == 2) {
+		if (!is_df)
+			return SC_ERROR_INVALID_DATA;
+		*out = mf;
+		return SC_SUCCESS;
+	}
+	for (i = 2; i + 2 < pathlen; i += 2) {
+		df = virtual_find_child(df, (path[i] << 8) | path[i + 1]);
+		if (df == NULL || !df->is_df)
+			return SC_ERROR_FILE_NOT_FOUND;
+	}
+	if (virtual_find_child(df, (path[i] << 8) | path[i + 1]) != NULL)
+		return SC_ERROR_FILE_ALREADY_EXISTS;
+	file = virtual_add_file(df, (path[i] << 8) | path[i + 1]);
+	if (file == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	file->is_df = is_df;
+	*out = file;
+	return SC_SUCCESS;
+}
+
+static int virtual_load_script(sc_context_t *ctx, struct virtual_global_private_data *gpriv)
+{
+	FILE *f;
+	char line[1024];
+	struct virtual_file *ef = NULL;
+	unsigned int lineno = 0;
+	int r = SC_SUCCESS;
+
+	f = fopen(gpriv->image, "r");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	while (r == SC_SUCCESS && fgets(line, sizeof(line), f) != NULL) {
+		char *p = line, *keyword, *arg;
+
+		lineno++;
+		if (strchr(line, '\n') == NULL && !feof(f)) {
+			r = SC_ERROR_INVALID_DATA;
+			break;
+		}
+		line[strcspn(line, "#")] = '\0';
+
+		if (ef != NULL && (line[0] == ' ' || line[0] == '\t')) {
+			r = virtual_append_hex(line, &ef->data, &ef->size, 0xFFFF);
+			continue;
+		}
+		ef = NULL;
+
+		keyword = virtual_next_word(&p);
+		if (*keyword == '\0')
+			continue;
+		arg = virtual_next_word(&p);
+
+		if (!strcmp(keyword, "atr")) {
+			gpriv->atr.len = sizeof(gpriv->atr.value);
+			r = virtual_parse_hex(arg, gpriv->atr.value, &gpriv->atr.len);
+		} else if (!strcmp(keyword, "pin")) {
+			struct virtual_pin *pin;
+			u8 ref;
+			size_t reflen = 1;
+
+			if (sc_hex_to_bin(arg, &ref, &reflen) != SC_SUCCESS || reflen != 1) {
+				r = SC_ERROR_INVALID_DATA;
+				break;
+			}
+			pin = virtual_add_pin(gpriv, ref);
+			if (pin == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+			r = virtual_parse_hex(p, pin->value, &pin->len);
+		} else if (!strcmp(keyword, "df")) {
+			struct virtual_file *df;
+
+			r = virtual_script_file(gpriv->mf, arg, 1, &df);
+			if (r == SC_SUCCESS) {
+				df->namelen = sizeof(df->name);
+				r = virtual_parse_hex(p, df->name, &df->namelen);
+			}
+		} else if (!strcmp(keyword, "ef")) {
+			r = virtual_script_file(gpriv->mf, arg, 0, &ef);
+			if (r == SC_SUCCESS)
+				r = virtual_append_hex(p, &ef->data, &ef->size, 0xFFFF);
+		} else {
+			r = SC_ERROR_INVALID_DATA;
+		}
+	}
+	fclose(f);
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "%s:%u: invalid statement", gpriv->image, lineno);
+	return r;
+}
+
+static int virtual_load_image(sc_context_t *ctx, struct virtual_global_private_data *gpriv)
+{
+	char path[PATH_MAX];
+	struct sc_atr atr;
+	struct stat st;
+	int r;
+
+	gpriv->atr.len = sizeof(gpriv->atr.value);
+	r = sc_hex_to_bin(VIRTUAL_DEFAULT_ATR, gpriv->atr.value, &gpriv->atr.len);
+	LOG_TEST_RET(ctx, r, "Invalid default ATR");
+
+	gpriv->mf = calloc(1, sizeof(*gpriv->mf));
+	if (gpriv->mf == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	gpriv->mf->id = 0x3F00;
+	gpriv->mf->is_df = 1;
+
+	if (stat(gpriv->image, &st) == 0 && !S_ISDIR(st.st_mode)) {
+		r = virtual_load_script(ctx, gpriv);
+		LOG_TEST_RET(ctx, r, "Cannot load card script");
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	snprintf(path, sizeof(path), "%s/atr", gpriv->image);
+	atr.len = sizeof(atr.value);
+	r = virtual_read_hex_file(path, atr.value, &atr.len);
+	if (r == SC_SUCCESS)
+		gpriv->atr = atr;
+	else if (r != SC_ERROR_FILE_NOT_FOUND)
+		LOG_TEST_RET(ctx, r, "Invalid ATR in card image");
+
+	snprintf(path, sizeof(path), "%s/3F00", gpriv->image);
+	r = virtual_load_df(ctx, path, gpriv->mf);
+	LOG_TEST_RET(ctx, r, "Cannot load card image");
+
+	r = virtual_load_pins(ctx, gpriv);
+	LOG_TEST_RET(ctx, r, "Cannot load PINs of card image");
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+static int virtual_init(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv;
+	struct virtual_private_data *priv = NULL;
+	sc_reader_t *reader = NULL;
+	scconf_block *conf_block;
+	const char *image = NULL;
+	int r;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+
+	gpriv = calloc(1, sizeof(*gpriv));
+	if (gpriv == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	ctx->reader_drv_data = gpriv;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block) {
+		image = scconf_get_str(conf_block, "card_image", NULL);
+		gpriv->latency = scconf_get_int(conf_block, "latency", 0);
+	}
+	if (image == NULL) {
+		sc_log(ctx, "No card image configured for the virtual reader");
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	gpriv->image = strdup(image);
+	if (gpriv->image == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	r = virtual_load_image(ctx, gpriv);
+	LOG_TEST_RET(ctx, r, "Cannot load virtual card");
+
+	reader = calloc(1, sizeof(*reader));
+	priv = calloc(1, sizeof(*priv));
+	if (reader == NULL || priv == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	priv->gpriv = gpriv;
+	reader->drv_data = priv;
+	reader->ops = &virtual_ops;
+	reader->driver = &virtual_reader_driver;
+	reader->name = strdup("Virtual reader");
+	if (reader->name == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	reader->supported_protocols = SC_PROTO_T1;
+	/* report the limits like a CCID reader does */
+	reader->max_send_size = 65535;
+	reader->max_recv_size = 65536;
+
+	r = _sc_add_reader(ctx, reader);
+	if (r != SC_SUCCESS)
+		goto err;
+
+	sc_log(ctx, "Virtual reader serving card image '%s', %u ms per APDU", gpriv->image, gpriv->latency);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+err:
+	if (reader != NULL)
+		free(reader->name);
+	free(reader);
+	free(priv);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+static int virtual_finish(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv = (struct virtual_global_private_data *) ctx->reader_drv_data;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	if (gpriv) {
+		while (gpriv->pins) {
+			struct virtual_pin *next = gpriv->pins->next;
+
+			sc_mem_clear(gpriv->pins, sizeof(*gpriv->pins));
+			free(gpriv->pins);
+			gpriv->pins = next;
+		}
+		virtual_free_file(gpriv->mf);
+		free(gpriv->image);
+		free(gpriv);
+	}
+	ctx->reader_drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int virtual_release(sc_reader_t *reader)
+{
+	free(reader->drv_data);
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int virtual_detect_card_presence(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	reader->flags = SC_READER_CARD_PRESENT;
+	if (!priv->presented)
+		reader->flags |= SC_READER_CARD_CHANGED;
+	priv->presented = 1;
+	return reader->flags;
+}
+
+/* Power up: fresh selection, PINs not verified, same challenge sequence */
+static void virtual_power_up(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	struct virtual_pin *pin;
+
+	priv->current_df = priv->gpriv->mf;
+	priv->current_ef = NULL;
+	priv->rnd = 0x2545F491;
+	for (pin = priv->gpriv->pins; pin != NULL; pin = pin->next)
+		pin->verified = 0;
+}
+
+static int virtual_connect(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	reader->atr = priv->gpriv->atr;
+	reader->active_protocol = SC_PROTO_T1;
+	virtual_power_up(reader);
+	return SC_SUCCESS;
+}
+
+static int virtual_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	virtual_power_up(reader);
+	return SC_SUCCESS;
+}
+
+static struct virtual_file *
+virtual_find_child(struct virtual_file *df, unsigned int id)
+{
+	struct virtual_file *file;
+
+	for (file = df->children; file != NULL; file = file->next)
+		if (file->id == id)
+			return file;
+	return NULL;
+}
+
+static struct virtual_file *
+virtual_find_df_name(struct virtual_file *df, const u8 *name, size_t namelen)
+{
+	struct virtual_file *file, *found;
+
+	if (df->is_df && df->namelen == namelen && !memcmp(df->name, name, namelen))
+		return df;
+	for (file = df->children; file != NULL; file = file->next) {
+		if (!file->is_df)
+			continue;
+		found = virtual_find_df_name(file, name, namelen);
+		if (found != NULL)
+			return found;
+	}
+	return NULL;
+}
+
+static struct virtual_file *
+virtual_find_path(struct virtual_file *df, const u8 *path, size_t pathlen)
+{
+	size_t i;
+
+	if (pathlen == 0 || pathlen % 2)
+		return NULL;
+	for (i = 0; df != NULL && i < pathlen; i += 2) {
+		if (!df->is_df)
+			return NULL;
+		df = virtual_find_child(df, (path[i] << 8) | path[i + 1]);
+	}
+	return df;
+}
+
+static size_t virtual_fcp(const struct virtual_file *file, u8 *out)
+{
+	size_t n = 2;
+
+	if (!file->is_df) {
+		out[n++] = 0x80;
+		out[n++] = 2;
+		out[n++] = (file->size >> 8) & 0xFF;
+		out[n++] = file->size & 0xFF;
+	}
+	out[n++] = 0x82;
+	out[n++] = 1;
+	out[n++] = file->is_df ? 0x38 : 0x01;
+	out[n++] = 0x83;
+	out[n++] = 2;
+	out[n++] = (file->id >> 8) & 0xFF;
+	out[n++] = file->id & 0xFF;
+	if (file->namelen) {
+		out[n++] = 0x84;
+		out[n++] = file->namelen;
+		memcpy(out + n, file->name, file->namelen);
+		n += file->namelen;
+	}
+	out[n++] = 0x8A;
+	out[n++] = 1;
+	out[n++] = 0x05;
+	out[0] = 0x62;
+	out[1] = n - 2;
+	return n;
+}
+
+static unsigned int
+virtual_select(struct virtual_private_data *priv, const sc_apdu_t *cmd, u8 *out, size_t *outlen)
+{
+	struct virtual_file *df = priv->current_df, *file = NULL;
+	const u8 *data = cmd->data;
+	size_t len = cmd->datalen;
+	u8 fcp[64];
+	size_t n;
+
+	switch (cmd->p1) {
+	case 0x00:
+		if (len == 0) {
+			file = priv->gpriv->mf;
+			break;
+		}
+		if (len != 2)
+			return 0x6A87;
+		if (data[0] == 0x3F && data[1] == 0x00)
+			file = priv->gpriv->mf;
+		else if ((file = virtual_find_child(df, (data[0] << 8) | data[1])) == NULL) {
+			if (df->id == (unsigned int)((data[0] << 8) | data[1]))
+				file = df;
+			else if (df->parent && df->parent->id == (unsigned int)((data[0] << 8) | data[1]))
+				file = df->parent;
+		}
+		break;
+	case 0x01:
+	case 0x02:
+		if (len != 2)
+			return 0x6A87;
+		file = virtual_find_child(df, (data[0] << 8) | data[1]);
+		if (file && file->is_df != (cmd->p1 == 0x01))
+			file = NULL;
+		break;
+	case 0x03:
+		file = df->parent ? df->parent : df;
+		break;
+	case 0x04:
+		file = virtual_find_df_name(priv->gpriv->mf, data, len);
+		break;
+	case 0x08:
+		if (len >= 2 && data[0] == 0x3F && data[1] == 0x00) {
+			data += 2;
+			len -= 2;
+		}
+		file = len ? virtual_find_path(priv->gpriv->mf, data, len) : priv->gpriv->mf;
+		break;
+	case 0x09:
+		file = virtual_find_path(df, data, len);
+		break;
+	default:
+		return 0x6A86;
+	}
+	if (file == NULL)
+		return 0x6A82;
+
+	if (file->is_df) {
+		priv->current_df = file;
+		priv->current_ef = NULL;
+	} else {
+		priv->current_df = file->parent;
+		priv->current_ef = file;
+	}
+
+	if ((cmd->p2 & 0x0C) == 0x0C) {
+		*outlen = 0;
+		return 0x9000;
+	}
+	n = virtual_fcp(file, fcp);
+	if (n > *outlen)
+		n = *outlen;
+	memcpy(out, fcp, n);
+	*outlen = n;
+	return 0x9000;
+}
+
+static unsigned int
+virtual_read_binary(struct virtual_private_data *priv, const sc_apdu_t *cmd, u8 *out, size_t *outlen)
+{
+	struct virtual_file *ef = priv->current_ef;
+	size_t offset = ((cmd->p1 & 0x7F) << 8) | cmd->p2;
+	size_t n = cmd->le;
+
+	if (cmd->p1 & 0x80)
+		return 0x6A81;
+	if (ef == NULL)
+		return 0x6986;
+	if (offset > ef->size)
+		return 0x6B00;
+	if (n > *outlen)
+		n = *outlen;
+	if (n > ef->size - offset)
+		n = ef->size - offset;
+	memcpy(out, ef->data + offset, n);
+	*outlen = n;
+	return n < cmd->le ? 0x6282 : 0x9000;
+}
+
+static unsigned int
+virtual_update_binary(struct virtual_private_data *priv, const sc_apdu_t *cmd)
+{
+	struct virtual_file *ef = priv->current_ef;
+	size_t offset = ((cmd->p1 & 0x7F) << 8) | cmd->p2;
+
+	if (cmd->p1 & 0x80)
+		return 0x6A81;
+	if (ef == NULL)
+		return 0x6986;
+	if (offset > ef->size)
+		return 0x6B00;
+	if (cmd->datalen > ef->size - offset)
+		return 0x6700;
+	memcpy(ef->data + offset, cmd->data, cmd->datalen);
+	return 0x9000;
+}
+
+static unsigned int
+virtual_verify(struct virtual_private_data *priv, const sc_apdu_t *cmd)
+{
+	struct virtual_pin *pin;
+
+	for (pin = priv->gpriv->pins; pin != NULL; pin = pin->next)
+		if (pin->ref == cmd->p2)
+			break;
+	if (pin == NULL)
+		return 0x6A88;
+	if (pin->tries_left == 0)
+		return 0x6983;
+	if (cmd->datalen == 0)
+		return pin->verified ? 0x9000 : 0x63C0 | pin->tries_left;
+
+	if (cmd->datalen != pin->len || memcmp(cmd->data, pin->value, pin->len)) {
+		pin->verified = 0;
+		pin->tries_left--;
+		return 0x63C0 | pin->tries_left;
+	}
+	pin->verified = 1;
+	pin->tries_left = VIRTUAL_PIN_TRIES;
+	return 0x9000;
+}
+
+static unsigned int
+virtual_get_challenge(struct virtual_private_data *priv, const sc_apdu_t *cmd, u8 *out, size_t *outlen)
+{
+	size_t i, n = cmd->le < *outlen ? cmd->le : *outlen;
+
+	/* xorshift, restarted on every power up to stay reproducible */
+	for (i = 0; i < n; i++) {
+		priv->rnd ^= priv->rnd << 13;
+		priv->rnd ^= priv->rnd >> 17;
+		priv->rnd ^= priv->rnd << 5;
+		out[i] = priv->rnd & 0xFF;
+	}
+	*outlen = n;
+	return 0x9000;
+}
+
+static int virtual_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	sc_context_t *ctx = reader->ctx;
+	sc_apdu_t cmd;
+	u8 *sbuf = NULL, *rbuf = NULL;
+	size_t ssize = 0, rsize = 0, rroom;
+	unsigned int sw;
+	int r;
+
+	/* encode and decode the APDU like it travels to a real card;
+	 * a short Le of zero is decoded as 256 */
+	rroom = apdu->le > 256 ? apdu->le : 256;
+	r = sc_apdu_get_reader_buffers(reader, apdu, reader->active_protocol,
+			&sbuf, &ssize, &rbuf, rroom + 2);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	r = sc_bytes2apdu(ctx, sbuf, ssize, &cmd);
+	if (r != SC_SUCCESS)
+		goto out;
+	/* an extended Le of zero is decoded as 65536: never answer with
+	 * more than the room reserved for the response */
+	rsize = cmd.le < rroom ? cmd.le : rroom;
+
+	if (priv->gpriv->latency)
+		msleep(priv->gpriv->latency);
+
+	if (cmd.cla & 0x80) {
+		sw = 0x6E00;
+	} else {
+		switch (cmd.ins) {
+		case 0xA4:
+			sw = virtual_select(priv, &cmd, rbuf, &rsize);
+			break;
+		case 0xB0:
+			sw = virtual_read_binary(priv, &cmd, rbuf, &rsize);
+			break;
+		case 0xD6:
+			sw = virtual_update_binary(priv, &cmd);
+			break;
+		case 0x20:
+			sw = virtual_verify(priv, &cmd);
+			break;
+		case 0x84:
+			sw = virtual_get_challenge(priv, &cmd, rbuf, &rsize);
+			break;
+		default:
+			sw = 0x6D00;
+			break;
+		}
+	}
+	if (sw != 0x9000 && sw != 0x6282)
+		rsize = 0;
+	rbuf[rsize] = sw >> 8;
+	rbuf[rsize + 1] = sw & 0xFF;
+	rsize += 2;
+
+	sc_apdu_log(ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	r = sc_apdu_set_resp(ctx, apdu, rbuf, rsize);
+out:
+	sc_apdu_clear_reader_buffers(reader);
+	return r;
+}
+
+struct sc_reader_driver *sc_get_virtual_driver(void)
+{
+	virtual_ops.init = virtual_init;
+	virtual_ops.finish = virtual_finish;
+	virtual_ops.detect_readers = NULL;
+	virtual_ops.release = virtual_release;
+	virtual_ops.detect_card_presence = virtual_detect_card_presence;
+	virtual_ops.connect = virtual_connect;
+	virtual_ops.disconnect = virtual_disconnect;
+	virtual_ops.transmit = virtual_transmit;
+	virtual_ops.lock = NULL;
+	virtual_ops.unlock = NULL;
+	virtual_ops.reset = virtual_reset;
+	virtual_ops.use_reader = NULL;
+
+	return &virtual_reader_driver;
+}
+
+#endif	/* ENABLE_VIRTUAL_READER */
@@ -31,6 +31,39 @@
 
 #include "internal.h"
 
+/* Sends the security environment again if the last sc_set_security_env()
+ * was skipped and the operation failed with an error that a missing
+ * environment causes: the card may have dropped it after all.  Returns 1
+ * if the operation should be retried. */
+static int sc_resend_security_env(sc_card_t *card, int error)
+{
+	sc_security_env_t env;
+	int se_num, r;
+
+	if (!card->cache.se_skipped || !card->cache.se_valid)
+		return 0;
+	switch (error) {
+	case SC_ERROR_INCORRECT_PARAMETERS:
+	case SC_ERROR_SECURITY_STATUS_NOT_SATISFIED:
+	case SC_ERROR_NOT_ALLOWED:
+	case SC_ERROR_DATA_OBJECT_NOT_FOUND:
+		break;
+	default:
+		return 0;
+	}
+
+	memcpy(&env, &card->cache.se, sizeof(env));
+	se_num = card->cache.se_num;
+	_sc_card_cache_forget_se(card);
+
+	sc_log(card->ctx, "operation failed, sending security environment again");
+	r = card->ops->set_security_env(card, &env, se_num);
+	if (r != SC_SUCCESS)
+		return 0;
+	_sc_card_cache_set_se(card, &env, se_num);
+	return 1;
+}
+
 int sc_decipher(sc_card_t *card,
 		const u8 * crgram, size_t crgram_len, u8 * out, size_t outlen)
 {
@@ -41,6 +74,8 @@ int sc_decipher(sc_card_t *card,
 	if (card->ops->decipher == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
+	if (r < 0 && sc_resend_security_env(card, r))
+		r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -55,6 +90,8 @@ int sc_compute_signature(sc_card_t *card,
 	if (card->ops->compute_signature == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->compute_signature(card, data, datalen, out, outlen);
+	if (r < 0 && sc_resend_security_env(card, r))
+		r = card->ops->compute_signature(card, data, datalen, out, outlen);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -68,7 +105,15 @@ int sc_set_security_env(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	if (env != NULL && _sc_card_cache_se_matches(card, env, se_num)) {
+		sc_log(card->ctx, "security environment already set");
+		card->cache.se_skipped = 1;
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+	}
+	_sc_card_cache_forget_se(card);
 	r = card->ops->set_security_env(card, env, se_num);
+	if (r == SC_SUCCESS && env != NULL)
+		_sc_card_cache_set_se(card, env, se_num);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -80,6 +125,7 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	_sc_card_cache_forget_se(card);
 	r = card->ops->restore_security_env(card, se_num);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
@@ -101,6 +147,7 @@ int sc_verify(sc_card_t *card, unsigned int type, int ref,
 
 int sc_logout(sc_card_t *card)
 {
+	_sc_card_cache_forget_se(card);
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
 	return card->ops->logout(card);
@@ -122,6 +122,20 @@ struct sm_gp_keyset {
         unsigned kmc_len;
 };
 
+/*
+ * @struct sm_des3_key
+ *	Two-key 3DES session key with its expanded DES key schedules.
+ *	Kept in the session data so that the schedules are computed once
+ *	per secure channel and not for every secured APDU.
+ *	Filled and used by libsm only (see sm_des3_key_load()).
+ */
+#define SM_DES_KEY_SCHEDULE_SIZE	128
+struct sm_des3_key {
+	unsigned char key[16];
+	unsigned char schedule[2][SM_DES_KEY_SCHEDULE_SIZE];
+	int valid;
+};
+
 /*
  * @struct sm_gp_session
  *	Global Platform SM session data
@@ -136,6 +150,8 @@ struct sm_gp_session {
 
 	unsigned char *session_enc, *session_mac, *session_kek;
 	unsigned char mac_icv[8];
+
+	struct sm_des3_key ks_enc, ks_mac;
 };
 
 
@@ -177,7 +193,7 @@ struct sm_cwa_token_data  {
  * @struct sm_cwa_session
  *	CWA working SM session data:
  *	- ICC and IFD token data;
- *	- ENC and MAC session keys;
+ *	- ENC and MAC session keys and their expanded schedules;
  *	- SSC (SM Sequence Counter);
  *	- 'mutual authentication' data.
  */
@@ -191,6 +207,7 @@ struct sm_cwa_session {
 
 	unsigned char session_enc[16];
 	unsigned char session_mac[16];
+	struct sm_des3_key ks_enc, ks_mac;
 
 	unsigned char ssc[8];
 
@@ -79,39 +79,40 @@
 
 
 /*
- * Inspired by or taken from OpenSSL crypto/des/cbc3_enc.c
+ * The expanded schedules are kept in 'struct sm_des3_key' as plain bytes,
+ * because libopensc/sm.h does not depend on OpenSSL.
  */
-static void
-DES_3cbc_encrypt(DES_cblock *input, DES_cblock *output, long length,
-		 DES_key_schedule *ks1, DES_key_schedule *ks2, DES_cblock *iv,
-		 int enc)
-	{
-	int off=((int)length-1)/8;
-	long l8=((length+7)/8)*8;
-	DES_cblock icv_out;
-
-	memset(&icv_out, 0, sizeof(icv_out));
-	if (enc == DES_ENCRYPT)   {
-		DES_cbc_encrypt((unsigned char*)input,
-				(unsigned char*)output,length,ks1,iv,enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks2,iv,!enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks1,iv,enc);
-		if ((unsigned)length >= sizeof(DES_cblock))
-			memcpy(icv_out,output[off],sizeof(DES_cblock));
+typedef char sm_des_key_schedule_size_check[sizeof(DES_key_schedule) <= SM_DES_KEY_SCHEDULE_SIZE ? 1 : -1];
+
+
+/*
+ * Get the key schedules of the two-key 3DES 'key'.
+ * If 'dk' is not NULL it caches the schedules of the last used key,
+ * so that the expensive key setup is done once per session key.
+ */
+void
+sm_des3_key_load(struct sm_des3_key *dk, const unsigned char *key,
+		DES_key_schedule *ks1, DES_key_schedule *ks2)
+{
+	DES_cblock kk, k2;
+
+	if (dk && dk->valid && !memcmp(dk->key, key, sizeof(dk->key)))   {
+		memcpy(ks1, dk->schedule[0], sizeof(DES_key_schedule));
+		memcpy(ks2, dk->schedule[1], sizeof(DES_key_schedule));
+		return;
 	}
-	else   {
-		if ((unsigned)length >= sizeof(DES_cblock))
-			memcpy(icv_out,input[off],sizeof(DES_cblock));
-		DES_cbc_encrypt((unsigned char*)input,
-				(unsigned char*)output,l8,ks1,iv,enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks2,iv,!enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,length,ks1,iv,enc);
+
+	memcpy(&kk, key, 8);
+	memcpy(&k2, key + 8, 8);
+	DES_set_key_unchecked(&kk, ks1);
+	DES_set_key_unchecked(&k2, ks2);
+
+	if (dk)   {
+		memcpy(dk->key, key, sizeof(dk->key));
+		memcpy(dk->schedule[0], ks1, sizeof(DES_key_schedule));
+		memcpy(dk->schedule[1], ks2, sizeof(DES_key_schedule));
+		dk->valid = 1;
 	}
-	memcpy(*iv,icv_out,sizeof(DES_cblock));
 }
 
 
@@ -262,14 +263,12 @@ sm_encrypt_des_ecb3(unsigned char *key, unsigned char *data, int data_len,
 
 
 int
-sm_decrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
+sm_decrypt_des_cbc3(struct sc_context *ctx, struct sm_des3_key *dk, unsigned char *key,
 		unsigned char *data, size_t data_len,
 		unsigned char **out, size_t *out_len)
 {
-	DES_cblock kk,k2;
 	DES_key_schedule ks,ks2;
 	DES_cblock icv={0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-	size_t st;
 
 	LOG_FUNC_CALLED(ctx);
 	if (!out || !out_len)
@@ -282,30 +281,22 @@ sm_decrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	if (!(*out))
 		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM decrypt_des_cbc3: allocation error");
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
-	for (st=0; st<data_len; st+=8)
-		DES_3cbc_encrypt((DES_cblock *)(data + st),
-				(DES_cblock *)(*out + st), 8, &ks, &ks2, &icv, DES_DECRYPT);
+	sm_des3_key_load(dk, key, &ks, &ks2);
+	DES_ede3_cbc_encrypt(data, *out, *out_len, &ks, &ks2, &ks, &icv, DES_DECRYPT);
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 
 int
-sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
+sm_encrypt_des_cbc3(struct sc_context *ctx, struct sm_des3_key *dk, unsigned char *key,
 		const unsigned char *in, size_t in_len,
 		unsigned char **out, size_t *out_len, int not_force_pad)
 {
-	DES_cblock kk,k2;
 	DES_key_schedule ks,ks2;
 	DES_cblock icv={0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
 	unsigned char *data;
-	size_t data_len, st;
+	size_t data_len;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "SM encrypt_des_cbc3: not_force_pad:%i,in_len:%i", not_force_pad, in_len);
@@ -337,14 +328,8 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM encrypt_des_cbc3: failure");
 	}
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
-	for (st=0; st<data_len; st+=8)
-		DES_3cbc_encrypt((DES_cblock *)(data + st), (DES_cblock *)(*out + st), 8, &ks, &ks2, &icv, DES_ENCRYPT);
+	sm_des3_key_load(dk, key, &ks, &ks2);
+	DES_ede3_cbc_encrypt(data, *out, data_len, &ks, &ks2, &ks, &icv, DES_ENCRYPT);
 
 	free(data);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
@@ -37,11 +37,13 @@ DES_LONG DES_cbc_cksum_3des_emv96(const unsigned char *in, DES_cblock *output,
 		const_DES_cblock *ivec);
 int sm_encrypt_des_ecb3(unsigned char *key, unsigned char *data, int data_len,
 		unsigned char **out, int *out_len);
-int sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
+void sm_des3_key_load(struct sm_des3_key *dk, const unsigned char *key,
+		DES_key_schedule *ks1, DES_key_schedule *ks2);
+int sm_encrypt_des_cbc3(struct sc_context *ctx, struct sm_des3_key *dk, unsigned char *key,
 		const unsigned char *in, size_t in_len,
 		unsigned char **out, size_t *out_len, int
 		not_force_pad);
-int sm_decrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
+int sm_decrypt_des_cbc3(struct sc_context *ctx, struct sm_des3_key *dk, unsigned char *key,
 		unsigned char *data, size_t data_len, unsigned char **out, size_t *out_len);
 void sm_incr_ssc(unsigned char *ssc, size_t ssc_len);
 #ifdef __cplusplus
@@ -59,6 +59,7 @@ struct pkcs15_fw_data {
 	struct pkcs15_any_object *	objects[MAX_OBJECTS];
 	unsigned int			num_objects;
 	unsigned int			locked;
+	unsigned int			lazy_read;	/* binding the token: defer reading object values */
 	unsigned char user_puk[64];
 	unsigned int user_puk_len;
 };
@@ -460,6 +461,7 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs15_object *auth;
 	struct sc_pkcs15_auth_info *pin_info;
 	struct sc_pin_cmd_data data;
@@ -480,6 +482,16 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		goto out;
 	}
 
+	/* PIN info is read from the card: wait for the operation in progress */
+	p11card = slot->card;
+	sc_pkcs11_lock_card(p11card);
+	/* The token could have been removed while waiting */
+	rv = slot_get_slot(slotID, &slot);
+	if (rv == CKR_OK && slot->card != p11card)
+		rv = CKR_TOKEN_NOT_PRESENT;
+	if (rv != CKR_OK)
+		goto out;
+
 	/* User PIN flags are cleared before re-calculation */
 	slot->token_info.flags &= ~(CKF_USER_PIN_COUNT_LOW|CKF_USER_PIN_FINAL_TRY|CKF_USER_PIN_LOCKED);
 	auth = slot_data_auth(slot->fw_data);
@@ -517,6 +529,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	sc_log(context, "C_GetTokenInfo(%lx) returns 0x%lX", slotID, rv);
 	return rv;
@@ -565,6 +578,9 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 	if (cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)  {	/* is the cert private? */
 		p15_cert = NULL;			/* will read cert when needed */
 	}
+	else if (fw_data->lazy_read)   {
+		p15_cert = NULL;			/* read on first use of the value */
+	}
 	else    {
 		rv = sc_pkcs15_read_certificate(fw_data->p15_card, p15_info, &p15_cert);
 		if (rv < 0)
@@ -630,6 +646,10 @@ __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 			sc_log(context, "Use emulated pubkey");
 			p15_key = (struct sc_pkcs15_pubkey *) pubkey->emulated;
 		}
+		else if (fw_data->lazy_read)   {
+			sc_log(context, "Defer reading of pubkey");
+			p15_key = NULL;				/* will read key when needed */
+		}
 		else {
 			sc_log(context, "Get pubkey from PKCS#15 object");
 			rv = sc_pkcs15_read_pubkey(fw_data->p15_card, pubkey, &p15_key);
@@ -727,8 +747,12 @@ pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const
 	if (rv >= 0)
 		sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
 
+	/* only the objects found when binding the token are read lazily,
+	 * the ones created by C_CreateObject/C_GenerateKeyPair are used at once */
+	fw_data->lazy_read = sc_pkcs11_conf.lazy_object_read;
 	for (i = 0; rv >= 0 && i < count; i++)
 		rv = create(fw_data, p15_object[i], NULL);
+	fw_data->lazy_read = 0;
 
 	return count;
 }
@@ -767,7 +791,8 @@ __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_
 			if (sc_pkcs15_compare_id(&pubkey->pub_info->id, id)) {
 				sc_log(context, "Associating object %d as public key", i);
 				pk->prv_pubkey = pubkey;
-				sc_pkcs15_dup_pubkey(context, pubkey->pub_data, &pk->pub_data);
+				if (pubkey->pub_data)
+					sc_pkcs15_dup_pubkey(context, pubkey->pub_data, &pk->pub_data);
 				if (pk->prv_info->modulus_length == 0)
 					pk->prv_info->modulus_length = pubkey->pub_info->modulus_length;
 			}
@@ -871,6 +896,38 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 }
 
 
+/* The public key is not read when it is private or when the objects are
+ * read lazily: get it from the PuKDF object, else from the certificate */
+static int
+check_pubkey_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_pubkey_object *pubkey)
+{
+	struct sc_pkcs15_pubkey *p15_key = NULL;
+	int rv;
+
+	if (!pubkey)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+
+	if (pubkey->pub_data)
+		return 0;
+
+	if (!pubkey->pub_p15obj)
+		return check_cert_data_read(fw_data, pubkey->pub_genfrom);
+
+	rv = sc_pkcs15_read_pubkey(fw_data->p15_card, pubkey->pub_p15obj, &p15_key);
+	if (rv < 0)   {
+		if (pubkey->pub_genfrom)
+			return check_cert_data_read(fw_data, pubkey->pub_genfrom);
+		return rv;
+	}
+
+	pubkey->pub_data = p15_key;
+	if (pubkey->pub_info->modulus_length == 0 && p15_key->algorithm == SC_ALGORITHM_RSA)
+		pubkey->pub_info->modulus_length = 8 * p15_key->u.rsa.modulus.len;
+
+	return 0;
+}
+
+
 static void
 pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		  CK_OBJECT_HANDLE_PTR pHandle)
@@ -883,15 +940,17 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	if (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS))
 		return;
 
-	if (list_contains(&slot->objects, obj))
+	if (slot_get_object(slot, (CK_OBJECT_HANDLE)obj) != NULL)
 		return;
 
-	if (pHandle != NULL)
-		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
-
-	list_append(&slot->objects, obj);
 	sc_log(context, "Slot:%X Setting object handle of 0x%lx to 0x%lx", slot->id, obj->base.handle, (CK_OBJECT_HANDLE)obj);
 	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+	if (slot_add_object(slot, &obj->base) != CKR_OK)
+		return;
+
+	if (pHandle != NULL)
+		*pHandle = obj->base.handle;
+
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
 
@@ -2550,6 +2609,14 @@ pkcs15_create_object(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK
 		}
 
 		sc_pkcs15init_set_p15card(profile, fw_data->p15_card);
+
+		/* Coalesce the authentications and xDF/ODF writes of this object */
+		rc = sc_pkcs15init_begin_batch(fw_data->p15_card, profile);
+		if (rc < 0) {
+			sc_pkcs15init_unbind(profile);
+			sc_unlock(p11card->card);
+			return sc_to_cryptoki_error(rc, "C_CreateObject");
+		}
 	}
 	switch (_class) {
 	case CKO_PRIVATE_KEY:
@@ -2572,6 +2639,9 @@ pkcs15_create_object(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK
 	}
 
 	if (_token == TRUE) {
+		rc = sc_pkcs15init_end_batch(fw_data->p15_card, profile);
+		if (rc < 0 && rv == CKR_OK)
+			rv = sc_to_cryptoki_error(rc, "C_CreateObject");
 		sc_pkcs15init_unbind(profile);
 		sc_unlock(p11card->card);
 	}
@@ -2846,7 +2916,8 @@ pkcs15_gen_keypair(struct sc_pkcs11_slot *slot, CK_MECHANISM_PTR pMechanism,
 	priv_prk_obj->prv_pubkey = (struct pkcs15_pubkey_object *)pub_any_obj;
 
 	/* Duplicate public key so that parameters can be retrieved even if public key object is deleted */
-	rv = sc_pkcs15_dup_pubkey(context, ((struct pkcs15_pubkey_object *)pub_any_obj)->pub_data, &priv_prk_obj->pub_data);
+	if (((struct pkcs15_pubkey_object *)pub_any_obj)->pub_data)
+		rv = sc_pkcs15_dup_pubkey(context, ((struct pkcs15_pubkey_object *)pub_any_obj)->pub_data, &priv_prk_obj->pub_data);
 
 kpgen_done:
 	sc_pkcs15init_unbind(profile);
@@ -2878,7 +2949,7 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcont */
-	list_delete(&session->slot->objects, any_obj);
+	slot_remove_object(session->slot, &any_obj->base);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -2934,7 +3005,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		struct pkcs15_pubkey_object *pubkey = any_obj->related_pubkey;
 
 		/* Check if key is not removed in between */
-		if (list_locate(&session->slot->objects, ao_pubkey) > 0) {
+		if (slot_get_object(session->slot, (CK_OBJECT_HANDLE)ao_pubkey) != NULL) {
 			sc_log(context, "Found related pubkey %p", any_obj->related_pubkey);
 
 			/* Delete reference to related certificate of the public key PKCS#11 object */
@@ -2944,7 +3015,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 				/* Unlink related public key FW object if it has no corresponding PKCS#15 object
 				 * and was created from certificate. */
 				--ao_pubkey->refcount;
-				list_delete(&session->slot->objects, ao_pubkey);
+				slot_remove_object(session->slot, &ao_pubkey->base);
 				/* Delete public key object in pkcs15 */
 				if (pubkey->pub_data)   {
 					sc_log(context, "Found pub_data %p", pubkey->pub_data);
@@ -2962,7 +3033,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcont */
-		list_delete(&session->slot->objects, any_obj);
+		slot_remove_object(session->slot, &any_obj->base);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -3363,10 +3434,10 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 				else if (is_pubkey(obj)) {
 					struct pkcs15_pubkey_object *pubkey = (struct pkcs15_pubkey_object *) obj;
 
-					if (!pubkey->pub_data)
+					if (!pubkey->pub_info || !sc_pkcs15_compare_id(&pubkey->pub_info->id, &prkey->prv_info->id))
 						continue;
 
-					if (sc_pkcs15_compare_id(&pubkey->pub_info->id, &prkey->prv_info->id))   {
+					if (check_pubkey_data_read(fw_data, pubkey) == 0)   {
 						prkey->prv_pubkey = pubkey;
 						key = pubkey->pub_data;
 						sc_log(context, "found friend public key %p", key);
@@ -3861,8 +3932,13 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 		case CKA_EC_PARAMS:
 		case CKA_EC_POINT:
 			if (pubkey->pub_data == NULL)
-				if (SC_SUCCESS != check_cert_data_read(fw_data, cert))
-					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "check_cert_data_read");
+				if (SC_SUCCESS != check_pubkey_data_read(fw_data, pubkey))
+					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "check_pubkey_data_read");
+			break;
+		case CKA_KEY_TYPE:
+			/* without a PuKDF object the type comes from the certificate */
+			if (pubkey->pub_data == NULL && pubkey->pub_p15obj == NULL)
+				check_pubkey_data_read(fw_data, pubkey);
 			break;
 	}
 
@@ -3920,6 +3996,10 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 			*(CK_KEY_TYPE*)attr->pValue = CKK_GOSTR3410;
 		else if (pubkey->pub_data && pubkey->pub_data->algorithm == SC_ALGORITHM_EC)
 			*(CK_KEY_TYPE*)attr->pValue = CKK_EC;
+		else if (!pubkey->pub_data && __p15_type((struct pkcs15_any_object *) pubkey) == SC_PKCS15_TYPE_PUBKEY_GOSTR3410)
+			*(CK_KEY_TYPE*)attr->pValue = CKK_GOSTR3410;
+		else if (!pubkey->pub_data && __p15_type((struct pkcs15_any_object *) pubkey) == SC_PKCS15_TYPE_PUBKEY_EC)
+			*(CK_KEY_TYPE*)attr->pValue = CKK_EC;
 		else
 			*(CK_KEY_TYPE*)attr->pValue = CKK_RSA;
 		break;
@@ -25,10 +25,73 @@ struct signature_data {
 	struct sc_pkcs11_object *key;
 	struct hash_signature_info *info;
 	sc_pkcs11_operation_t *	md;
-	CK_BYTE			buffer[4096/8];
-	unsigned int		buffer_len;
+	/* Data collected for mechanisms the card computes in one go;
+	 * data hashed in software is streamed into 'md' instead. */
+	CK_BYTE			*buffer;
+	CK_ULONG		buffer_len, buffer_size;
 };
 
+/* Raw data of a mechanism without hashing cannot exceed the key size */
+#define SC_PKCS11_RAW_DATA_MAX	(4096/8)
+/* Largest digest produced by the md operations */
+#define SC_PKCS11_MAX_DIGEST	64
+
+static int
+signature_data_is_raw(CK_MECHANISM_TYPE mech)
+{
+	switch (mech) {
+	case CKM_RSA_PKCS:
+	case CKM_RSA_X_509:
+	case CKM_GOSTR3410:
+	case CKM_ECDSA:
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Collect data for a signature mechanism that is computed by the card.
+ * For hash-and-sign mechanisms the card hashes the whole message,
+ * so the buffer grows as needed.
+ */
+static CK_RV
+signature_data_append(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	struct signature_data *data = (struct signature_data *) operation->priv_data;
+	CK_ULONG size;
+	CK_BYTE *p;
+
+	if (ulPartLen == 0)
+		return CKR_OK;
+	if (data->buffer_len + ulPartLen < data->buffer_len)
+		return CKR_DATA_LEN_RANGE;
+	if (signature_data_is_raw(operation->type->mech)
+			&& data->buffer_len + ulPartLen > SC_PKCS11_RAW_DATA_MAX)
+		return CKR_DATA_LEN_RANGE;
+
+	if (data->buffer_len + ulPartLen > data->buffer_size) {
+		size = data->buffer_size ? data->buffer_size : SC_PKCS11_RAW_DATA_MAX;
+		while (size < data->buffer_len + ulPartLen)
+			size *= 2;
+		/* no realloc(): the old buffer is wiped before it is freed */
+		p = malloc(size);
+		if (p == NULL)
+			return CKR_HOST_MEMORY;
+		if (data->buffer) {
+			memcpy(p, data->buffer, data->buffer_len);
+			sc_mem_clear(data->buffer, data->buffer_size);
+			free(data->buffer);
+		}
+		data->buffer = p;
+		data->buffer_size = size;
+	}
+
+	memcpy(data->buffer + data->buffer_len, pPart, ulPartLen);
+	data->buffer_len += ulPartLen;
+	return CKR_OK;
+}
+
 /*
  * Register a mechanism
  */
@@ -401,22 +464,20 @@ sc_pkcs11_signature_update(sc_pkcs11_operation_t *operation,
 		CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	struct signature_data *data;
+	CK_RV rv;
 
 	LOG_FUNC_CALLED(context);
 	sc_log(context, "data part length %li", ulPartLen);
 	data = (struct signature_data *) operation->priv_data;
 	if (data->md) {
-		CK_RV rv = data->md->type->md_update(data->md, pPart, ulPartLen);
+		rv = data->md->type->md_update(data->md, pPart, ulPartLen);
 		LOG_FUNC_RETURN(context, rv);
 	}
 
 	/* This signature mechanism operates on the raw data */
-	if (data->buffer_len + ulPartLen > sizeof(data->buffer))
-		LOG_FUNC_RETURN(context, CKR_DATA_LEN_RANGE);
-	memcpy(data->buffer + data->buffer_len, pPart, ulPartLen);
-	data->buffer_len += ulPartLen;
+	rv = signature_data_append(operation, pPart, ulPartLen);
 	sc_log(context, "data length %li", data->buffer_len);
-	LOG_FUNC_RETURN(context, CKR_OK);
+	LOG_FUNC_RETURN(context, rv);
 }
 
 static CK_RV
@@ -424,26 +485,31 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	struct signature_data *data;
+	CK_BYTE digest[SC_PKCS11_MAX_DIGEST];
+	CK_BYTE_PTR in;
+	CK_ULONG in_len;
 	CK_RV rv;
 
 	LOG_FUNC_CALLED(context);
 	data = (struct signature_data *) operation->priv_data;
 	sc_log(context, "data length %li", data->buffer_len);
+	in = data->buffer;
+	in_len = data->buffer_len;
 	if (data->md) {
 		sc_pkcs11_operation_t	*md = data->md;
-		CK_ULONG len = sizeof(data->buffer);
 
-		rv = md->type->md_final(md, data->buffer, &len);
+		in = digest;
+		in_len = sizeof(digest);
+		rv = md->type->md_final(md, digest, &in_len);
 		if (rv == CKR_BUFFER_TOO_SMALL)
 			rv = CKR_FUNCTION_FAILED;
 		if (rv != CKR_OK)
 			LOG_FUNC_RETURN(context, rv);
-		data->buffer_len = len;
 	}
 
-	sc_log(context, "%li bytes to sign", data->buffer_len);
+	sc_log(context, "%li bytes to sign", in_len);
 	rv = data->key->ops->sign(operation->session, data->key, &operation->mechanism,
-			data->buffer, data->buffer_len, pSignature, pulSignatureLen);
+			in, in_len, pSignature, pulSignatureLen);
 	LOG_FUNC_RETURN(context, rv);
 }
 
@@ -499,6 +565,10 @@ sc_pkcs11_signature_release(sc_pkcs11_operation_t *operation)
 	if (!data)
 	    return;
 	sc_pkcs11_release_operation(&data->md);
+	if (data->buffer) {
+		sc_mem_clear(data->buffer, data->buffer_size);
+		free(data->buffer);
+	}
 	memset(data, 0, sizeof(*data));
 	free(data);
 }
@@ -658,11 +728,7 @@ sc_pkcs11_verify_update(sc_pkcs11_operation_t *operation,
 	}
 
 	/* This verification mechanism operates on the raw data */
-	if (data->buffer_len + ulPartLen > sizeof(data->buffer))
-		return CKR_DATA_LEN_RANGE;
-	memcpy(data->buffer + data->buffer_len, pPart, ulPartLen);
-	data->buffer_len += ulPartLen;
-	return CKR_OK;
+	return signature_data_append(operation, pPart, ulPartLen);
 }
 
 static CK_RV
@@ -184,6 +184,132 @@ CK_RV session_stop_operation(struct sc_pkcs11_session * session, int type)
 	return CKR_OK;
 }
 
+/*
+ * Handle maps
+ *
+ * The handles are the addresses of the structures: mix the bits before
+ * taking the bucket, the low bits of the addresses are always the same.
+ * The buckets are kept at most half full. Removal shifts back the following
+ * entries of the probe sequence, so that no deleted marker is needed.
+ */
+#define HANDLE_MAP_MIN_SIZE	16
+
+static size_t handle_map_bucket(const struct sc_pkcs11_handle_map *map, CK_ULONG handle)
+{
+	CK_ULONG h = handle;
+
+	h ^= h >> 17;
+	h *= 0x2545F491UL;
+	h ^= h >> 13;
+	return (size_t)h & (map->size - 1);
+}
+
+static CK_RV handle_map_resize(struct sc_pkcs11_handle_map *map, size_t size)
+{
+	struct sc_pkcs11_handle_map new_map;
+	size_t ii, jj;
+
+	new_map.size = size;
+	new_map.count = map->count;
+	new_map.handles = calloc(size, sizeof(CK_ULONG));
+	new_map.values = calloc(size, sizeof(void *));
+	if (!new_map.handles || !new_map.values) {
+		free(new_map.handles);
+		free(new_map.values);
+		return CKR_HOST_MEMORY;
+	}
+
+	for (ii = 0; ii < map->size; ii++) {
+		if (!map->handles[ii])
+			continue;
+		jj = handle_map_bucket(&new_map, map->handles[ii]);
+		while (new_map.handles[jj])
+			jj = (jj + 1) & (size - 1);
+		new_map.handles[jj] = map->handles[ii];
+		new_map.values[jj] = map->values[ii];
+	}
+
+	free(map->handles);
+	free(map->values);
+	*map = new_map;
+	return CKR_OK;
+}
+
+CK_RV sc_pkcs11_handle_map_add(struct sc_pkcs11_handle_map *map, CK_ULONG handle, void *value)
+{
+	size_t ii;
+	CK_RV rv;
+
+	if (!handle)
+		return CKR_ARGUMENTS_BAD;
+	if ((map->count + 1) * 2 > map->size) {
+		rv = handle_map_resize(map, map->size ? map->size * 2 : HANDLE_MAP_MIN_SIZE);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	ii = handle_map_bucket(map, handle);
+	while (map->handles[ii] && map->handles[ii] != handle)
+		ii = (ii + 1) & (map->size - 1);
+	if (!map->handles[ii])
+		map->count++;
+	map->handles[ii] = handle;
+	map->values[ii] = value;
+	return CKR_OK;
+}
+
+void *sc_pkcs11_handle_map_get(const struct sc_pkcs11_handle_map *map, CK_ULONG handle)
+{
+	size_t ii;
+
+	if (!map->count || !handle)
+		return NULL;
+	ii = handle_map_bucket(map, handle);
+	while (map->handles[ii]) {
+		if (map->handles[ii] == handle)
+			return map->values[ii];
+		ii = (ii + 1) & (map->size - 1);
+	}
+	return NULL;
+}
+
+void *sc_pkcs11_handle_map_remove(struct sc_pkcs11_handle_map *map, CK_ULONG handle)
+{
+	size_t ii, jj, home, mask = map->size - 1;
+	void *value;
+
+	if (!map->count || !handle)
+		return NULL;
+	ii = handle_map_bucket(map, handle);
+	while (map->handles[ii] != handle) {
+		if (!map->handles[ii])
+			return NULL;
+		ii = (ii + 1) & mask;
+	}
+	value = map->values[ii];
+
+	/* Move back the entries that cannot be reached anymore across the hole */
+	for (jj = (ii + 1) & mask; map->handles[jj]; jj = (jj + 1) & mask) {
+		home = handle_map_bucket(map, map->handles[jj]);
+		if (((jj - home) & mask) < ((jj - ii) & mask))
+			continue;
+		map->handles[ii] = map->handles[jj];
+		map->values[ii] = map->values[jj];
+		ii = jj;
+	}
+	map->handles[ii] = 0;
+	map->values[ii] = NULL;
+	map->count--;
+	return value;
+}
+
+void sc_pkcs11_handle_map_free(struct sc_pkcs11_handle_map *map)
+{
+	free(map->handles);
+	free(map->values);
+	memset(map, 0, sizeof(*map));
+}
+
 CK_RV attr_extract(CK_ATTRIBUTE_PTR pAttr, void *ptr, size_t * sizep)
 {
 	unsigned int size;
@@ -328,6 +454,8 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->create_puk_slot = 0;
 	conf->zero_ckaid_for_ca_certs = 0;
 	conf->create_slots_flags = SC_PKCS11_SLOT_CREATE_ALL;
+	conf->slot_monitor = 0;
+	conf->lazy_object_read = 0;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -339,6 +467,8 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->slots_per_card = scconf_get_int(conf_block, "slots_per_card", conf->slots_per_card);
 	conf->hide_empty_tokens = scconf_get_bool(conf_block, "hide_empty_tokens", conf->hide_empty_tokens);
 	conf->lock_login = scconf_get_bool(conf_block, "lock_login", conf->lock_login);
+	conf->slot_monitor = scconf_get_bool(conf_block, "use_slot_monitor", conf->slot_monitor);
+	conf->lazy_object_read = scconf_get_bool(conf_block, "lazy_object_read", conf->lazy_object_read);
 
 	unblock_style = (char *)scconf_get_str(conf_block, "user_pin_unblock_style", NULL);
 	if (unblock_style && !strcmp(unblock_style, "set_pin_in_unlogged_session"))
@@ -370,8 +500,10 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 
 	sc_log(ctx, "PKCS#11 options: plug_and_play=%d max_virtual_slots=%d slots_per_card=%d "
 		 "hide_empty_tokens=%d lock_login=%d pin_unblock_style=%d "
-		 "zero_ckaid_for_ca_certs=%d create_slots_flags=0x%X",
+		 "zero_ckaid_for_ca_certs=%d create_slots_flags=0x%X slot_monitor=%d "
+		 "lazy_object_read=%d",
 		 conf->plug_and_play, conf->max_virtual_slots, conf->slots_per_card,
 		 conf->hide_empty_tokens, conf->lock_login, conf->pin_unblock_style,
-		 conf->zero_ckaid_for_ca_certs, conf->create_slots_flags);
+		 conf->zero_ckaid_for_ca_certs, conf->create_slots_flags, conf->slot_monitor,
+		 conf->lazy_object_read);
 }
@@ -25,6 +25,9 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "sc-pkcs11.h"
 
@@ -34,7 +37,7 @@
 
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
-list_t sessions;
+struct sc_pkcs11_handle_map sessions;
 list_t virtual_slots;
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
@@ -42,11 +45,15 @@ pid_t initialized_pid = (pid_t)-1;
 static int in_finalize = 0;
 extern CK_FUNCTION_LIST pkcs11_function_list;
 
+static void slot_monitor_start(void);
+static void slot_monitor_stop(void);
+static int slot_monitor_wait(unsigned long gen);
+static unsigned long slot_monitor_gen(void);
+
 #if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
-#include <pthread.h>
 CK_RV mutex_create(void **mutex)
 {
-	pthread_mutex_t *m = calloc(1, sizeof(*mutex));
+	pthread_mutex_t *m = calloc(1, sizeof(*m));
 	if (m == NULL)
 		return CKR_GENERAL_ERROR;;
 	pthread_mutex_init(m, NULL);
@@ -118,6 +125,8 @@ static CK_C_INITIALIZE_ARGS _def_locks = {
 
 static CK_C_INITIALIZE_ARGS_PTR	global_locking;
 static void *			global_lock = NULL;
+/* threads in sc_pkcs11_lock_card() that released the global lock */
+static unsigned int		card_lock_waiting = 0;
 #if (defined(HAVE_PTHREAD) || defined(_WIN32)) && defined(PKCS11_THREAD_LOCKING)
 #define HAVE_OS_LOCKING
 static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = &_def_locks;
@@ -173,14 +182,6 @@ static sc_thread_context_t sc_thread_ctx = {
 };
 
 /* simclist helpers to locate interesting objects by ID */
-static int session_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_session *session = (struct sc_pkcs11_session *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (session->handle == *(CK_SESSION_HANDLE*)key)
-		return 1;
-	return 0;
-}
 static int slot_list_seeker(const void *el, const void *key) {
 	const struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *)el;
 	if ((el == NULL) || (key == NULL))
@@ -235,9 +236,8 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	/* Load configuration */
 	load_pkcs11_parameters(&sc_pkcs11_conf, context);
 
-	/* List of sessions */
-	list_init(&sessions);
-	list_attributes_seeker(&sessions, session_list_seeker);
+	/* Map of sessions */
+	memset(&sessions, 0, sizeof(sessions));
 
 	/* List of slots */
 	list_init(&virtual_slots);
@@ -255,6 +255,9 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 		}
 	}
 
+	if (sc_pkcs11_conf.slot_monitor)
+		slot_monitor_start();
+
 out:
 	if (context != NULL)
 		sc_log(context, "C_Initialize() = %s", lookup_enum ( RV_T, rv ));
@@ -274,7 +277,7 @@ out:
 CK_RV C_Finalize(CK_VOID_PTR pReserved)
 {
 	int i;
-	void *p;
+	size_t j;
 	sc_pkcs11_slot_t *slot;
 	CK_RV rv;
 
@@ -284,6 +287,9 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
+	/* the monitor takes the global lock to update the slots */
+	slot_monitor_stop();
+
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -297,12 +303,14 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
 
-	while ((p = list_fetch(&sessions)))
-		free(p);
-	list_destroy(&sessions);
+	for (j = 0; j < sessions.size; j++)
+		free(sessions.values[j]);
+	sc_pkcs11_handle_map_free(&sessions);
 
 	while ((slot = list_fetch(&virtual_slots))) {
 		list_destroy(&slot->objects);
+		sc_pkcs11_handle_map_free(&slot->object_map);
+		sc_pkcs11_find_index_free(slot);
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
@@ -384,10 +392,13 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 		/* Trick NSS into updating the slot list by changing the hotplug slot ID */
 		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
 		hotplug_slot->id--;
-		sc_ctx_detect_readers(context);
+		if (!slot_monitor_running())
+			sc_ctx_detect_readers(context);
 	}
 
-	card_detect_all();
+	/* With the slot monitor the slots are already up to date */
+	if (!slot_monitor_running())
+		card_detect_all();
 
 	found = calloc(list_size(&virtual_slots), sizeof(CK_SLOT_ID));
 
@@ -588,10 +599,16 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		goto out;
 	}
 
-	/* Make sure there's no open session for this token */
-	for (i=0; i<list_size(&sessions); i++) {
-		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
-		if (session->slot == slot) {
+	/* Make sure there's no open session for this token.
+	 * init_token() removes and detects the card again, so it cannot run
+	 * under the card lock: unlike C_InitToken of PKCS#11, which only looks at
+	 * the sessions of the given slot, a session open on any other slot
+	 * (PIN or application) of the same card also makes it fail. */
+	for (i=0; i<sessions.size; i++) {
+		session = (struct sc_pkcs11_session*)sessions.values[i];
+		if (session == NULL)
+			continue;
+		if (session->slot == slot || session->slot->card == slot->card) {
 			rv = CKR_SESSION_EXISTS;
 			goto out;
 		}
@@ -614,7 +631,9 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 			 CK_VOID_PTR pReserved) /* reserved.  Should be NULL_PTR */
 {
 	sc_reader_t *found;
-	unsigned int mask, events;
+	sc_pkcs11_slot_t *slot;
+	unsigned int mask, events = 0;
+	unsigned long gen;
 	void *reader_states = NULL;
 	CK_SLOT_ID slot_id;
 	CK_RV rv;
@@ -626,7 +645,7 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	sc_log(context, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
 	/* Not all pcsc-lite versions implement consistently used functions as they are */
 	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
-	if (!(flags & CKF_DONT_BLOCK))
+	if (!(flags & CKF_DONT_BLOCK) && !slot_monitor_running())
 		return CKR_FUNCTION_NOT_SUPPORTED;
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -643,6 +662,26 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
 		goto out;
 
+	/* Sleep until the slot monitor has processed the next event.
+	 * The generation is read under the global lock, so that an event
+	 * processed after slot_find_changed() is not missed. */
+	while (slot_monitor_running()) {
+		gen = slot_monitor_gen();
+		sc_pkcs11_unlock();
+		r = slot_monitor_wait(gen);
+		if (r != SC_SUCCESS || in_finalize == 1)
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
+		if ((rv = sc_pkcs11_lock()) != CKR_OK)
+			return rv;
+		rv = slot_find_changed(&slot_id, mask);
+		if (rv == CKR_OK) {
+			/* Reader attached: see the NSS/Firefox hotplug trick below */
+			if (slot_get_slot(slot_id, &slot) == CKR_OK && slot->reader == NULL)
+				slot_id--;
+			goto out;
+		}
+	}
+
 again:
 	sc_log(context, "C_WaitForSlotEvent() reader_states:%p", reader_states);
 	sc_pkcs11_unlock();
@@ -693,8 +732,222 @@ out:
 	return rv;
 }
 
+/*
+ * Slot monitor
+ *
+ * When 'use_slot_monitor' is set, a thread waits for the PC/SC reader and card
+ * events and runs the card detection when one happens. C_GetSlotList() then only
+ * reads the slots, and C_WaitForSlotEvent() can block until the monitor has
+ * processed an event. The monitor updates the slots under the global lock, so it
+ * is only started when the application asked for locking in C_Initialize().
+ */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t slot_monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_monitor_cond = PTHREAD_COND_INITIALIZER;
+static struct {
+	pthread_t thread;
+	int running;
+	int stop;
+	int exited;
+	unsigned long gen;	/* number of the processed events */
+} slot_monitor;
+
+static void slot_monitor_deadline(struct timespec *ts, long ms)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec + ms / 1000;
+	ts->tv_nsec = (tv.tv_usec + (ms % 1000) * 1000) * 1000;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void *slot_monitor_run(void *arg)
+{
+	sc_pkcs11_slot_t *hotplug_slot;
+	sc_reader_t *found;
+	unsigned int mask, events;
+	void *reader_states = NULL;
+	struct timespec ts;
+	int r;
+
+	mask = SC_EVENT_CARD_EVENTS;
+	if (sc_pkcs11_conf.plug_and_play)
+		mask |= SC_EVENT_READER_EVENTS;
+
+	while (!slot_monitor.stop) {
+		events = 0;
+		r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
+		if (slot_monitor.stop)
+			break;
+		if (r == SC_ERROR_NOT_SUPPORTED) {
+			/* The reader driver has no events: the slots are detected by the calls again */
+			sc_log(context, "slot monitor: reader events not supported");
+			break;
+		}
+
+		if (sc_pkcs11_lock() != CKR_OK)
+			break;
+		if (r == SC_SUCCESS && (events & (SC_EVENT_READER_ATTACHED | SC_EVENT_READER_DETACHED))) {
+			sc_ctx_detect_readers(context);
+			if (sc_pkcs11_conf.plug_and_play) {
+				hotplug_slot = list_get_at(&virtual_slots, 0);
+				hotplug_slot->events |= SC_EVENT_READER_ATTACHED;
+			}
+		}
+		card_detect_all();
+		sc_pkcs11_unlock();
+
+		/* The watched readers follow the readers of the context */
+		if (reader_states && (r != SC_SUCCESS || (events & (SC_EVENT_READER_ATTACHED | SC_EVENT_READER_DETACHED))))
+			sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+
+		pthread_mutex_lock(&slot_monitor_mutex);
+		slot_monitor.gen++;
+		pthread_cond_broadcast(&slot_monitor_cond);
+		if (r != SC_SUCCESS && !slot_monitor.stop) {
+			/* No reader, or no PC/SC service: try again later */
+			sc_log(context, "slot monitor: %s", sc_strerror(r));
+			slot_monitor_deadline(&ts, 1000);
+			pthread_cond_timedwait(&slot_monitor_cond, &slot_monitor_mutex, &ts);
+		}
+		pthread_mutex_unlock(&slot_monitor_mutex);
+	}
+
+	if (reader_states)
+		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+
+	pthread_mutex_lock(&slot_monitor_mutex);
+	slot_monitor.exited = 1;
+	pthread_cond_broadcast(&slot_monitor_cond);
+	pthread_mutex_unlock(&slot_monitor_mutex);
+	return NULL;
+}
+
+static void slot_monitor_start(void)
+{
+	if (slot_monitor.running || !global_lock)
+		return;
+
+	/* The calls do not detect the cards anymore: start with the current state */
+	card_detect_all();
+
+	slot_monitor.stop = 0;
+	slot_monitor.exited = 0;
+	slot_monitor.gen = 0;
+	if (pthread_create(&slot_monitor.thread, NULL, slot_monitor_run, NULL) != 0) {
+		sc_log(context, "cannot start the slot monitor");
+		return;
+	}
+	slot_monitor.running = 1;
+	sc_log(context, "slot monitor started");
+}
+
+static void slot_monitor_stop(void)
+{
+	struct timespec ts;
+
+	if (!slot_monitor.running)
+		return;
+	/* The monitor thread does not survive fork() */
+	if (getpid() != initialized_pid) {
+		slot_monitor.running = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&slot_monitor_mutex);
+	slot_monitor.stop = 1;
+	/* The cancel can come before the monitor is waiting: repeat it */
+	while (!slot_monitor.exited) {
+		pthread_cond_broadcast(&slot_monitor_cond);
+		pthread_mutex_unlock(&slot_monitor_mutex);
+		sc_cancel(context);
+		pthread_mutex_lock(&slot_monitor_mutex);
+		if (slot_monitor.exited)
+			break;
+		slot_monitor_deadline(&ts, 100);
+		pthread_cond_timedwait(&slot_monitor_cond, &slot_monitor_mutex, &ts);
+	}
+	pthread_mutex_unlock(&slot_monitor_mutex);
+
+	pthread_join(slot_monitor.thread, NULL);
+	slot_monitor.running = 0;
+}
+
+static unsigned long slot_monitor_gen(void)
+{
+	unsigned long gen;
+
+	pthread_mutex_lock(&slot_monitor_mutex);
+	gen = slot_monitor.gen;
+	pthread_mutex_unlock(&slot_monitor_mutex);
+	return gen;
+}
+
+/* Wait until the monitor has processed an event after the generation 'gen' */
+static int slot_monitor_wait(unsigned long gen)
+{
+	int r = SC_SUCCESS;
+
+	pthread_mutex_lock(&slot_monitor_mutex);
+	while (slot_monitor.gen == gen && !slot_monitor.stop && !slot_monitor.exited)
+		pthread_cond_wait(&slot_monitor_cond, &slot_monitor_mutex);
+	if (slot_monitor.stop)
+		r = SC_ERROR_EVENT_TIMEOUT;
+	pthread_mutex_unlock(&slot_monitor_mutex);
+	return r;
+}
+
+int slot_monitor_running(void)
+{
+	return slot_monitor.running && !slot_monitor.exited;
+}
+#else
+static void slot_monitor_start(void)
+{
+	sc_log(context, "slot monitor is not supported on this platform");
+}
+
+static void slot_monitor_stop(void)
+{
+}
+
+static unsigned long slot_monitor_gen(void)
+{
+	return 0;
+}
+
+static int slot_monitor_wait(unsigned long gen)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+int slot_monitor_running(void)
+{
+	return 0;
+}
+#endif
+
 /*
  * Locking functions
+ *
+ * The global lock protects the lists of the slots and sessions, and the
+ * binding of the cards to the slots. It is held for the whole call by the
+ * functions that change them (slot and token detection, C_OpenSession,
+ * C_CloseSession, ...).
+ *
+ * Every card has its own lock that protects the card I/O, the slots of the
+ * card (objects, login state, framework data) and the state of the sessions
+ * opened on these slots. The functions working on an existing session only
+ * take the global lock to resolve the session handle; they release it
+ * before waiting for the card lock, so that the operations on the different
+ * cards, and the other calls, are not blocked by a slow card operation.
+ *
+ * Lock order is 'global, then card': the functions holding a card lock
+ * never take the global lock.
  */
 
 CK_RV
@@ -775,6 +1028,17 @@ __sc_pkcs11_unlock(void *lock)
 	}
 }
 
+static void
+__sc_pkcs11_lock(void *lock)
+{
+	if (!lock)
+		return;
+	if (global_locking) {
+		while (global_locking->LockMutex(lock) != CKR_OK)
+			;
+	}
+}
+
 void sc_pkcs11_unlock(void)
 {
 	__sc_pkcs11_unlock(global_lock);
@@ -805,6 +1069,155 @@ void sc_pkcs11_free_lock(void)
 	global_locking = NULL;
 }
 
+/*
+ * Create the lock of the newly allocated card
+ */
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *p11card)
+{
+	p11card->lock = NULL;
+	if (!global_lock || !global_locking)
+		return CKR_OK;
+	return global_locking->CreateMutex(&p11card->lock);
+}
+
+static void
+__sc_pkcs11_destroy_card(struct sc_pkcs11_card *p11card)
+{
+	if (p11card->lock && global_locking)
+		global_locking->DestroyMutex(p11card->lock);
+	free(p11card);
+}
+
+/*
+ * Lock the card from a function holding the global lock.
+ * The global lock is released while waiting, so that an operation in
+ * progress on this card does not block the other slots, and is held again
+ * on return: the caller has to check again what it looked up before.
+ * Readers and slots are not deleted while somebody waits here, see
+ * sc_pkcs11_card_lock_waiting().
+ * The threads waiting for this card lock will look up their session again.
+ */
+void sc_pkcs11_lock_card(struct sc_pkcs11_card *p11card)
+{
+	if (p11card == NULL)
+		return;
+	p11card->refs++;
+	if (p11card->lock) {
+		card_lock_waiting++;
+		sc_pkcs11_unlock();
+		__sc_pkcs11_lock(p11card->lock);
+		sc_pkcs11_lock();
+		card_lock_waiting--;
+	}
+	p11card->gen++;
+}
+
+/* Called with the global lock held */
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *p11card)
+{
+	if (p11card == NULL)
+		return;
+	__sc_pkcs11_unlock(p11card->lock);
+	if (--p11card->refs == 0 && p11card->removed)
+		__sc_pkcs11_destroy_card(p11card);
+}
+
+/* Whether a thread waits in sc_pkcs11_lock_card(), called with the global lock held */
+int sc_pkcs11_card_lock_waiting(void)
+{
+	return card_lock_waiting != 0;
+}
+
+/*
+ * Free the removed card, called with the global lock held.
+ * If some thread still waits for the card lock, the card is freed
+ * when the last of them drops its reference.
+ */
+void sc_pkcs11_free_card(struct sc_pkcs11_card *p11card)
+{
+	if (p11card == NULL)
+		return;
+	if (p11card->refs) {
+		p11card->removed = 1;
+		return;
+	}
+	__sc_pkcs11_destroy_card(p11card);
+}
+
+static void
+__sc_pkcs11_unref_card(struct sc_pkcs11_card *p11card)
+{
+	void *lock = global_lock;
+
+	__sc_pkcs11_lock(lock);
+	if (--p11card->refs == 0 && p11card->removed)
+		__sc_pkcs11_destroy_card(p11card);
+	__sc_pkcs11_unlock(lock);
+}
+
+/*
+ * Resolve the session handle and lock the card of the session.
+ * On return the global lock is released, except when the card has no lock
+ * of its own; sc_pkcs11_unlock_session() releases whatever was taken.
+ */
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
+{
+	struct sc_pkcs11_session *sess;
+	struct sc_pkcs11_card *p11card;
+	unsigned int gen;
+	CK_RV rv;
+
+	*session = NULL;
+	for (;;) {
+		rv = sc_pkcs11_lock();
+		if (rv != CKR_OK)
+			return rv;
+
+		rv = get_session(hSession, &sess);
+		if (rv != CKR_OK) {
+			sc_pkcs11_unlock();
+			return rv;
+		}
+
+		p11card = sess->slot->card;
+		if (p11card == NULL || p11card->lock == NULL) {
+			*session = sess;
+			return CKR_OK;
+		}
+
+		p11card->refs++;
+		gen = p11card->gen;
+		sc_pkcs11_unlock();
+
+		__sc_pkcs11_lock(p11card->lock);
+		if (p11card->gen == gen) {
+			*session = sess;
+			return CKR_OK;
+		}
+
+		/* Card state changed while waiting: the session could be closed */
+		__sc_pkcs11_unlock(p11card->lock);
+		__sc_pkcs11_unref_card(p11card);
+	}
+}
+
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_card *p11card;
+
+	if (session == NULL)
+		return;
+
+	p11card = session->slot->card;
+	if (p11card == NULL || p11card->lock == NULL) {
+		sc_pkcs11_unlock();
+		return;
+	}
+
+	__sc_pkcs11_unlock(p11card->lock);
+	__sc_pkcs11_unref_card(p11card);
+}
+
 CK_FUNCTION_LIST pkcs11_function_list = {
 	{ 2, 11 }, /* Note: NSS/Firefox ignores this version number and uses C_GetInfo() */
 	C_Initialize,
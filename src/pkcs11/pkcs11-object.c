@@ -64,65 +64,288 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 }
 
 
+/* Called with the session locked */
 static CK_RV
-get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object)
+get_object_from_session(struct sc_pkcs11_session *session, CK_OBJECT_HANDLE hObject,
+		struct sc_pkcs11_object **object)
 {
-	struct sc_pkcs11_session *sess;
-	CK_RV rv;
-
-	rv = get_session(hSession, &sess);
-	if (rv != CKR_OK)
-		return rv;
-
-	*object = list_seek(&sess->slot->objects, &hObject);
+	*object = slot_get_object(session->slot, hObject);
 	if (!*object)
 		return CKR_OBJECT_HANDLE_INVALID;
-	*session = sess;
 	return CKR_OK;
 }
 
+/*
+ * Search index of the slot objects.
+ *
+ * The values of the attributes most used in the search templates are fetched once
+ * per object and kept in the slot, together with the hash chains over CKA_CLASS,
+ * CKA_ID and CKA_LABEL. C_FindObjectsInit() walks the shortest applicable chain
+ * and compares the cached values instead of querying the framework for every object.
+ * The index is invalidated when the slot objects are added, removed or modified.
+ */
+#define FIND_IDX_CLASS		0
+#define FIND_IDX_ID		1
+#define FIND_IDX_LABEL		2
+#define FIND_IDX_KEY_TYPE	3
+#define FIND_IDX_PRIVATE	4
+#define FIND_IDX_ATTRS		5
+/* Attributes with hash chain: CKA_CLASS, CKA_ID and CKA_LABEL */
+#define FIND_IDX_CHAINS		3
+
+#define FIND_ATTR_NOT_CACHED	0
+#define FIND_ATTR_ABSENT	1
+#define FIND_ATTR_PRESENT	2
+
+static const CK_ATTRIBUTE_TYPE find_index_attrs[FIND_IDX_ATTRS] = {
+	CKA_CLASS, CKA_ID, CKA_LABEL, CKA_KEY_TYPE, CKA_PRIVATE
+};
+
+struct sc_pkcs11_find_attr {
+	int state;
+	CK_ULONG len;
+	CK_BYTE_PTR value;
+};
+
+struct sc_pkcs11_find_entry {
+	struct sc_pkcs11_object *object;
+	struct sc_pkcs11_find_attr attrs[FIND_IDX_ATTRS];
+	/* next entry in the hash chains, plus one; zero terminates the chain */
+	size_t next[FIND_IDX_CHAINS];
+};
+
+struct sc_pkcs11_find_index {
+	int valid;
+	size_t count, size;
+	struct sc_pkcs11_find_entry *entries;
+	/* first entry of the hash chains, plus one */
+	size_t *buckets[FIND_IDX_CHAINS];
+};
+
+
+static unsigned int
+find_index_hash(CK_BYTE_PTR value, CK_ULONG len)
+{
+	unsigned int hash = 2166136261U;
+	CK_ULONG ii;
+
+	for (ii = 0; ii < len; ii++)
+		hash = (hash ^ value[ii]) * 16777619U;
+	return hash ^ (unsigned int)len;
+}
+
+
+static void
+find_index_clear(struct sc_pkcs11_find_index *idx)
+{
+	size_t ii;
+	int jj;
+
+	for (ii = 0; ii < idx->count; ii++)
+		for (jj = 0; jj < FIND_IDX_ATTRS; jj++)
+			free(idx->entries[ii].attrs[jj].value);
+	free(idx->entries);
+	idx->entries = NULL;
+	for (jj = 0; jj < FIND_IDX_CHAINS; jj++)   {
+		free(idx->buckets[jj]);
+		idx->buckets[jj] = NULL;
+	}
+	idx->count = idx->size = 0;
+	idx->valid = 0;
+}
+
+
+void
+sc_pkcs11_find_index_invalidate(struct sc_pkcs11_slot *slot)
+{
+	if (slot && slot->find_index)
+		slot->find_index->valid = 0;
+}
+
+
+void
+sc_pkcs11_find_index_free(struct sc_pkcs11_slot *slot)
+{
+	if (!slot || !slot->find_index)
+		return;
+	find_index_clear(slot->find_index);
+	free(slot->find_index);
+	slot->find_index = NULL;
+}
+
+
+static void
+find_index_fetch_attr(struct sc_pkcs11_session *session, struct sc_pkcs11_find_entry *entry, int ii)
+{
+	struct sc_pkcs11_object *object = entry->object;
+	struct sc_pkcs11_find_attr *cached = &entry->attrs[ii];
+	CK_ATTRIBUTE attr;
+
+	if (ii == FIND_IDX_KEY_TYPE)   {
+		struct sc_pkcs11_find_attr *class = &entry->attrs[FIND_IDX_CLASS];
+
+		/* The key type of the public key can change when its data is finally read,
+		 * so it is always asked from the object */
+		if (class->state == FIND_ATTR_PRESENT && class->len == sizeof(CK_OBJECT_CLASS)
+				&& *(CK_OBJECT_CLASS *)class->value == CKO_PUBLIC_KEY)
+			return;
+	}
+
+	cached->state = FIND_ATTR_ABSENT;
+
+	attr.type = find_index_attrs[ii];
+	attr.pValue = NULL;
+	attr.ulValueLen = 0;
+	if (object->ops->get_attribute(session, object, &attr) != CKR_OK)
+		return;
+
+	/* Keep at least one byte allocated for the empty values */
+	attr.pValue = calloc(1, attr.ulValueLen ? attr.ulValueLen : 1);
+	if (!attr.pValue)   {
+		cached->state = FIND_ATTR_NOT_CACHED;
+		return;
+	}
+
+	if (object->ops->get_attribute(session, object, &attr) != CKR_OK)   {
+		free(attr.pValue);
+		return;
+	}
+
+	cached->value = attr.pValue;
+	cached->len = attr.ulValueLen;
+	cached->state = FIND_ATTR_PRESENT;
+}
+
+
+static CK_RV
+find_index_build(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_find_index *idx = slot->find_index;
+	struct sc_pkcs11_object *object;
+	size_t num, ii, size = 16;
+	int jj;
+
+	if (idx && idx->valid)
+		return CKR_OK;
+
+	if (!idx)   {
+		idx = slot->find_index = calloc(1, sizeof(struct sc_pkcs11_find_index));
+		if (!idx)
+			return CKR_HOST_MEMORY;
+	}
+	find_index_clear(idx);
+
+	num = list_size(&slot->objects);
+	while (size < num * 2)
+		size *= 2;
+
+	idx->entries = calloc(num ? num : 1, sizeof(struct sc_pkcs11_find_entry));
+	for (jj = 0; jj < FIND_IDX_CHAINS; jj++)
+		idx->buckets[jj] = calloc(size, sizeof(size_t));
+	if (!idx->entries || !idx->buckets[0] || !idx->buckets[1] || !idx->buckets[2])   {
+		find_index_clear(idx);
+		return CKR_HOST_MEMORY;
+	}
+	idx->size = size;
+
+	if (!list_iterator_start(&slot->objects))   {
+		find_index_clear(idx);
+		return CKR_GENERAL_ERROR;
+	}
+	while (idx->count < num && list_iterator_hasnext(&slot->objects))   {
+		object = (struct sc_pkcs11_object *)list_iterator_next(&slot->objects);
+		idx->entries[idx->count++].object = object;
+	}
+	list_iterator_stop(&slot->objects);
+
+	for (ii = 0; ii < idx->count; ii++)
+		for (jj = 0; jj < FIND_IDX_ATTRS; jj++)
+			find_index_fetch_attr(session, &idx->entries[ii], jj);
+
+	/* Chains are filled from the end to keep the order of the slot objects */
+	for (ii = idx->count; ii > 0; ii--)   {
+		struct sc_pkcs11_find_entry *entry = &idx->entries[ii - 1];
+
+		for (jj = 0; jj < FIND_IDX_CHAINS; jj++)   {
+			struct sc_pkcs11_find_attr *cached = &entry->attrs[jj];
+			size_t *head;
+
+			if (cached->state != FIND_ATTR_PRESENT)
+				continue;
+			head = &idx->buckets[jj][find_index_hash(cached->value, cached->len) & (size - 1)];
+			entry->next[jj] = *head;
+			*head = ii;
+		}
+	}
+
+	sc_log(context, "Search index of slot 0x%lx built for %i objects", slot->id, (int)idx->count);
+	idx->valid = 1;
+	return CKR_OK;
+}
+
+
+static int
+find_index_lookup(CK_ATTRIBUTE_TYPE type)
+{
+	int ii;
+
+	for (ii = 0; ii < FIND_IDX_ATTRS; ii++)
+		if (find_index_attrs[ii] == type)
+			return ii;
+	return -1;
+}
+
+
+static int
+find_index_match(struct sc_pkcs11_session *session, struct sc_pkcs11_find_entry *entry,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct sc_pkcs11_object *object = entry->object;
+	CK_ULONG ii;
+
+	for (ii = 0; ii < ulCount; ii++)   {
+		int kk = find_index_lookup(pTemplate[ii].type);
+		struct sc_pkcs11_find_attr *cached = kk >= 0 ? &entry->attrs[kk] : NULL;
+
+		if (cached && cached->state != FIND_ATTR_NOT_CACHED)   {
+			if (cached->state != FIND_ATTR_PRESENT || cached->len != pTemplate[ii].ulValueLen
+					|| (cached->len && memcmp(cached->value, pTemplate[ii].pValue, cached->len)))
+				return 0;
+		}
+		else if (!object->ops->cmp_attribute(session, object, &pTemplate[ii]))   {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
 /* C_CreateObject can be called from C_DeriveKey
- * which is holding the sc_pkcs11_lock
+ * which is holding the session lock
  * So dont get the lock again. */
 static
-CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle */
+CK_RV sc_create_object_int(struct sc_pkcs11_session *session,	/* the locked session */
 		CK_ATTRIBUTE_PTR pTemplate,		/* the object's template */
 		CK_ULONG ulCount,			/* attributes in template */
-		CK_OBJECT_HANDLE_PTR phObject,		/* receives new object's handle. */
-		int use_lock)
+		CK_OBJECT_HANDLE_PTR phObject)		/* receives new object's handle. */
 {
 	CK_RV rv = CKR_OK;
-	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_card *card;
 
 	LOG_FUNC_CALLED(context);
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	if (use_lock) {
-	    rv = sc_pkcs11_lock();
-	    if (rv != CKR_OK)
-		return rv;
-	}
-
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	card = session->slot->card;
 	if (card->framework->create_object == NULL)
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
-out:
-	if (use_lock)
-		sc_pkcs11_unlock();
 	LOG_FUNC_RETURN(context, rv);
 }
 
@@ -133,7 +356,20 @@ C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phObject)
 {
-	return sc_create_object_int(hSession, pTemplate, ulCount, phObject, 1);
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if (pTemplate == NULL_PTR || ulCount == 0)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_create_object_int(session, pTemplate, ulCount, phObject);
+
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 
@@ -158,12 +394,12 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribure = {CKA_TOKEN, &is_token, sizeof(is_token)};
 
-	rv = sc_pkcs11_lock();
+	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -179,7 +415,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -217,11 +453,13 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	/* The card lock is needed even for the cached attributes: the object
+	 * is only kept alive by it, and a value read lazily uses the card */
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
-		return rv;
+		goto out;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -257,7 +495,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -276,13 +514,13 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
-
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -299,10 +537,11 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		sc_pkcs11_find_index_invalidate(session->slot);
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -313,23 +552,18 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount)		/* attributes in search template */
 {
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
+	int hide_private, chain = -1;
+	size_t next = 0;
+	unsigned int j;
 	struct sc_pkcs11_session *session;
-	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
+	struct sc_pkcs11_find_index *idx;
 	struct sc_pkcs11_slot *slot;
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -352,61 +586,78 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
 		hide_private = 1;
 
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_log(context, "Object with handle 0x%lx", object->handle);
+	rv = find_index_build(session);
+	if (rv != CKR_OK)
+		goto out;
+	idx = slot->find_index;
+
+	/* Select the most selective hash chain: CKA_ID, then CKA_LABEL, then CKA_CLASS */
+	for (j = 0; j < ulCount; j++)   {
+		int kk = find_index_lookup(pTemplate[j].type);
+
+		if (kk < 0 || kk >= FIND_IDX_CHAINS)
+			continue;
+		if (pTemplate[j].pValue == NULL_PTR && pTemplate[j].ulValueLen)
+			continue;
+		if (chain < 0 || (kk == FIND_IDX_ID) || (kk == FIND_IDX_LABEL && chain == FIND_IDX_CLASS))   {
+			chain = kk;
+			next = idx->buckets[kk][find_index_hash(pTemplate[j].pValue, pTemplate[j].ulValueLen) & (idx->size - 1)];
+		}
+	}
+
+	/* For each candidate object in token do */
+	for (j = 0; ; j++)   {
+		struct sc_pkcs11_find_entry *entry;
+		struct sc_pkcs11_find_attr *private_attr;
+
+		if (chain >= 0)   {
+			if (!next)
+				break;
+			entry = &idx->entries[next - 1];
+			next = entry->next[chain];
+		}
+		else   {
+			if (j >= idx->count)
+				break;
+			entry = &idx->entries[j];
+		}
 
 		/* User not logged in and private object? */
 		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
+			private_attr = &entry->attrs[FIND_IDX_PRIVATE];
+			if (private_attr->state != FIND_ATTR_PRESENT)
 			        continue;
-			if (is_private) {
+			if (private_attr->len != sizeof(CK_BBOOL) || *(CK_BBOOL *)private_attr->value) {
 				sc_log(context, "Object %d/%d: Private object and not logged in.",
-					 slot->id, object->handle);
+					 slot->id, entry->object->handle);
 				continue;
 			}
 		}
 
 		/* Try to match every attribute */
-		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
-					 slot->id, object->handle, pTemplate[j].type);
-				match = 0;
-				break;
-			}
-
-			if (context->debug >= 4) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
-					 slot->id, object->handle, pTemplate[j].type);
+		if (!find_index_match(session, entry, pTemplate, ulCount))
+			continue;
+
+		sc_log(context, "Object %d/%d matches\n", slot->id, entry->object->handle);
+		/* Realloc handles - remove restriction on only 32 matching objects -dee */
+		if (operation->num_handles >= operation->allocated_handles) {
+			operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
+			sc_log(context, "realloc for %d handles", operation->allocated_handles);
+			operation->handles = realloc(operation->handles,
+				sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
+			if (operation->handles == NULL) {
+				rv = CKR_HOST_MEMORY;
+				goto out;
 			}
 		}
-
-		if (match) {
-			sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
-			/* Realloc handles - remove restriction on only 32 matching objects -dee */
-			if (operation->num_handles >= operation->allocated_handles) {
-				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_log(context, "realloc for %d handles", operation->allocated_handles);
-				operation->handles = realloc(operation->handles,
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					goto out;
-				}
-			}
-			operation->handles[operation->num_handles++] = object->handle;
-		}
+		operation->handles[operation->num_handles++] = entry->object->handle;
 	}
 	rv = CKR_OK;
 
 	sc_log(context, "%d matching objects\n", operation->num_handles);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -425,11 +676,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -447,7 +694,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -458,11 +705,7 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -470,7 +713,7 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -488,17 +731,13 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_log(context, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -514,12 +753,8 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG  ulBuflen = 0;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -542,7 +777,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 out:	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -555,16 +790,12 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -585,16 +816,12 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_log(context, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -615,11 +842,11 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -646,7 +873,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -662,11 +889,7 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -690,7 +913,7 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -703,16 +926,12 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -726,11 +945,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_ULONG length;
 	CK_RV rv;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -751,7 +966,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -826,11 +1041,11 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -860,7 +1075,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -873,17 +1088,13 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
 				pData, pulDataLen);
 
 	sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -966,14 +1177,10 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -992,7 +1199,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 				phPublicKey, phPrivateKey);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1040,11 +1247,11 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	rv = get_object_from_session(session, hBaseKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1073,11 +1280,11 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	switch(key_type) {
 	    case CKK_EC:
 
-		rv = sc_create_object_int(hSession, pTemplate, ulAttributeCount, phKey, 0);
+		rv = sc_create_object_int(session, pTemplate, ulAttributeCount, phKey);
 		if (rv != CKR_OK)
 		    goto out;
 
-		rv = get_object_from_session(hSession, *phKey, &session, &key_object);
+		rv = get_object_from_session(session, *phKey, &key_object);
 		if (rv != CKR_OK) {
 			if (rv == CKR_OBJECT_HANDLE_INVALID)
 				rv = CKR_KEY_HANDLE_INVALID;
@@ -1094,7 +1301,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1113,11 +1320,7 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK) {
 		slot = session->slot;
 		if (slot->card->framework->get_random == NULL)
@@ -1126,7 +1329,7 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = slot->card->framework->get_random(slot, RandomData, ulRandomLen);
 	}
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1156,12 +1359,11 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1176,7 +1378,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_verif_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1193,11 +1395,7 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1206,7 +1404,7 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 out:	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1221,16 +1419,12 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1245,16 +1439,12 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 	sc_log(context, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
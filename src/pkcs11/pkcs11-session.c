@@ -28,7 +28,7 @@
 
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	*session = sc_pkcs11_handle_map_get(&sessions, hSession);
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
@@ -76,9 +76,13 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
-	slot->nsessions++;
 	session->handle = (CK_SESSION_HANDLE) session;	/* cast a pointer to long */
-	list_append(&sessions, session);
+	rv = sc_pkcs11_handle_map_add(&sessions, session->handle, session);
+	if (rv != CKR_OK) {
+		free(session);
+		goto out;
+	}
+	slot->nsessions++;
 	*phSession = session->handle;
 	sc_log(context, "C_OpenSession handle: 0x%lx", session->handle);
 
@@ -89,7 +93,7 @@ out:
 }
 
 /* Internal version of C_CloseSession that gets called with
- * the global lock held */
+ * the global lock and the card lock held */
 static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 {
 	struct sc_pkcs11_slot *slot;
@@ -97,7 +101,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = sc_pkcs11_handle_map_remove(&sessions, hSession);
 	if (!session)
 		return CKR_SESSION_HANDLE_INVALID;
 
@@ -110,25 +114,29 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 		slot->card->framework->logout(slot);
 	}
 
-	if (list_delete(&sessions, session) != 0)
-		sc_log(context, "Could not delete session from list!");
 	free(session);
 	return CKR_OK;
 }
 
 /* Internal version of C_CloseAllSessions that gets called with
- * the global lock held */
+ * the global lock and the card lock held */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
 	CK_RV rv = CKR_OK, error;
 	struct sc_pkcs11_session *session;
-	unsigned int i;
-	sc_log(context, "real C_CloseAllSessions(0x%lx) %d", slotID, list_size(&sessions));
-	for (i = 0; i < list_size(&sessions); i++) {
-		session = list_get_at(&sessions, i);
-		if (session->slot->id == slotID)
+	size_t i;
+
+	sc_log(context, "real C_CloseAllSessions(0x%lx) %d", slotID, (int)sessions.count);
+	/* Closing a session can move a following entry of the map into
+	 * the same bucket: look at the bucket again */
+	for (i = 0; i < sessions.size; ) {
+		session = sessions.values[i];
+		if (session != NULL && session->slot->id == slotID) {
 			if ((error = sc_pkcs11_close_session(session->handle)) != CKR_OK)
 				rv = error;
+			continue;
+		}
+		i++;
 	}
 	return rv;
 }
@@ -136,6 +144,8 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -143,8 +153,21 @@ CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "C_CloseSession(0x%lx)", hSession);
 
-	rv = sc_pkcs11_close_session(hSession);
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
 
+	p11card = session->slot->card;
+	sc_pkcs11_lock_card(p11card);
+	/* The session could have been closed while waiting for the card */
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK && session->slot->card != p11card)
+		rv = CKR_SESSION_HANDLE_INVALID;
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_close_session(hSession);
+	sc_pkcs11_unlock_card(p11card);
+
+out:
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -153,6 +176,7 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 {				/* the token's slot */
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -164,7 +188,12 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	if (rv != CKR_OK)
 		goto out;
 
-	rv = sc_pkcs11_close_all_sessions(slotID);
+	p11card = slot->card;
+	sc_pkcs11_lock_card(p11card);
+	/* If the token was removed while waiting, its sessions are closed */
+	if (slot_get_slot(slotID, &slot) == CKR_OK && slot->card == p11card)
+		rv = sc_pkcs11_close_all_sessions(slotID);
+	sc_pkcs11_unlock_card(p11card);
 
       out:sc_pkcs11_unlock();
 	return rv;
@@ -180,17 +209,11 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	sc_log(context, "C_GetSessionInfo(slot:0x%lx)", session->slot->id);
 	pInfo->slotID = session->slot->id;
@@ -210,7 +233,7 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_GetSessionInfo(0x%lx) = %s", hSession, lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -242,7 +265,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
@@ -250,11 +273,6 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
 
 	sc_log(context, "C_Login(0x%lx, %d)", hSession, userType);
 
@@ -293,7 +311,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -303,16 +321,10 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
 	slot = session->slot;
@@ -323,7 +335,7 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
-      out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -337,16 +349,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -363,7 +369,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -377,16 +383,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	slot = session->slot;
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
 
@@ -397,6 +397,6 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 
 	rv = slot->card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
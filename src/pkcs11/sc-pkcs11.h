@@ -71,6 +71,7 @@ extern "C" {
 struct sc_pkcs11_session;
 struct sc_pkcs11_slot;
 struct sc_pkcs11_card;
+struct sc_pkcs11_find_index;
 
 struct sc_pkcs11_config {
 	unsigned int plug_and_play;
@@ -83,6 +84,17 @@ struct sc_pkcs11_config {
 	unsigned int zero_ckaid_for_ca_certs;
 	unsigned int create_slots_flags;
 	unsigned char ignore_pin_length;
+	unsigned char slot_monitor;
+	unsigned char lazy_object_read;
+};
+
+/* Map of the session and object handles, that are the addresses of the
+ * structures, to the structures: open addressing with linear probing */
+struct sc_pkcs11_handle_map {
+	size_t size;		/* number of buckets, zero or a power of two */
+	size_t count;
+	CK_ULONG *handles;	/* zero in the empty buckets */
+	void **values;
 };
 
 /*
@@ -200,6 +212,14 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+
+	/* Lock of the card I/O, of its slots and of the sessions opened on them.
+	 * 'refs' counts the threads waiting for or holding the lock, 'gen' is
+	 * changed every time the card state is modified under the global lock. */
+	void *lock;
+	unsigned int refs;
+	unsigned int gen;
+	int removed;
 };
 
 struct sc_pkcs11_slot {
@@ -217,6 +237,8 @@ struct sc_pkcs11_slot {
 
 	int fw_data_idx;		/* Index of framework data */
 	struct sc_app_info *app_info;	/* Application assosiated to slot */
+	struct sc_pkcs11_find_index *find_index;	/* Search index of the objects */
+	struct sc_pkcs11_handle_map object_map;		/* Handles of the objects */
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
@@ -319,7 +341,7 @@ typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 /* Module variables */
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
-extern list_t sessions;
+extern struct sc_pkcs11_handle_map sessions;
 extern list_t virtual_slots;
 extern list_t cards;
 
@@ -331,9 +353,11 @@ void strcpy_bp(u8 *dst, const char *src, size_t dstsize);
 CK_RV sc_to_cryptoki_error(int rc, const char *ctx);
 void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const char *function,
 		const char *info, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
-#define dump_template(level, info, pTemplate, ulCount) \
+#define dump_template(level, info, pTemplate, ulCount) do { \
+	if (sc_log_enabled(context, level)) \
 		sc_pkcs11_print_attrs(level, __FILE__, __LINE__, __FUNCTION__, \
-				info, pTemplate, ulCount)
+				info, pTemplate, ulCount); \
+} while (0)
 
 /* Slot and card handling functions */
 CK_RV card_removed(sc_reader_t *reader);
@@ -346,6 +370,10 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_add_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_remove_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+struct sc_pkcs11_object *slot_get_object(struct sc_pkcs11_slot *, CK_OBJECT_HANDLE);
+int slot_monitor_running(void);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
@@ -365,6 +393,14 @@ CK_RV sc_pkcs11_create_secret_key(struct sc_pkcs11_session *,
 /* Generic object handling */
 int sc_pkcs11_any_cmp_attribute(struct sc_pkcs11_session *,
 			void *, CK_ATTRIBUTE_PTR);
+void sc_pkcs11_find_index_invalidate(struct sc_pkcs11_slot *);
+void sc_pkcs11_find_index_free(struct sc_pkcs11_slot *);
+
+/* Handle maps (misc.c) */
+CK_RV sc_pkcs11_handle_map_add(struct sc_pkcs11_handle_map *, CK_ULONG, void *);
+void *sc_pkcs11_handle_map_get(const struct sc_pkcs11_handle_map *, CK_ULONG);
+void *sc_pkcs11_handle_map_remove(struct sc_pkcs11_handle_map *, CK_ULONG);
+void sc_pkcs11_handle_map_free(struct sc_pkcs11_handle_map *);
 
 /* Get attributes from template (misc.c) */
 CK_RV attr_find(CK_ATTRIBUTE_PTR, CK_ULONG, CK_ULONG, void *, size_t *);
@@ -433,6 +469,13 @@ CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *);
+void sc_pkcs11_lock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *);
+int sc_pkcs11_card_lock_waiting(void);
+void sc_pkcs11_free_card(struct sc_pkcs11_card *);
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE, struct sc_pkcs11_session **);
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *);
 
 #ifdef __cplusplus
 }
@@ -50,6 +50,42 @@ static struct sc_pkcs11_slot * reader_get_slot(sc_reader_t *reader)
 	return NULL;
 }
 
+static struct sc_pkcs11_card * reader_get_card(sc_reader_t *reader)
+{
+	unsigned int i;
+
+	/* Locate the card bound to a slot of the reader */
+	for (i = 0; i<list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == reader && slot->card)
+			return slot->card;
+	}
+	return NULL;
+}
+
+/*
+ * The reader driver updates the reader flags and the ATR while detecting,
+ * and the operations in progress on the card use them: detect under the
+ * lock of the card bound to the reader. Called with the global lock held.
+ */
+static int detect_card_presence(sc_reader_t *reader)
+{
+	struct sc_pkcs11_card *card;
+	int rc;
+
+	for (;;) {
+		card = reader_get_card(reader);
+		sc_pkcs11_lock_card(card);
+		/* Another card could have been bound in the meantime */
+		if (reader_get_card(reader) == card)
+			break;
+		sc_pkcs11_unlock_card(card);
+	}
+	rc = sc_detect_card_presence(reader);
+	sc_pkcs11_unlock_card(card);
+	return rc;
+}
+
 static void init_slot_info(CK_SLOT_INFO_PTR pInfo)
 {
 	strcpy_bp(pInfo->slotDescription, "Virtual hotplug slot", 64);
@@ -105,6 +141,8 @@ void delete_slot(struct sc_pkcs11_slot *slot)
 {
 	if (slot) {
 		list_destroy(&slot->objects);
+		sc_pkcs11_handle_map_free(&slot->object_map);
+		sc_pkcs11_find_index_free(slot);
 		list_delete(&virtual_slots, slot);
 		free(slot);
 	}
@@ -139,7 +177,7 @@ CK_RV initialize_reader(sc_reader_t *reader)
 	}
 
 	sc_log(context, "Initialize reader '%s': detect SC card presence", reader->name);
-	if (sc_detect_card_presence(reader))   {
+	if (detect_card_presence(reader))   {
 		sc_log(context, "Initialize reader '%s': detect PKCS11 card presence", reader->name);
 		card_detect(reader);
 	}
@@ -156,15 +194,27 @@ CK_RV card_removed(sc_reader_t * reader)
 	/* Mark all slots as "token not present" */
 	sc_log(context, "%s: card removed", reader->name);
 
+	/* Wait for the operations in progress on the card */
+	card = reader_get_card(reader);
+	if (card) {
+		sc_pkcs11_lock_card(card);
+
+		/* Another thread could have removed it in the meantime */
+		for (i=0; i < list_size(&virtual_slots); i++) {
+			sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+			if (slot->card == card)
+				break;
+		}
+		if (i == list_size(&virtual_slots)) {
+			sc_pkcs11_unlock_card(card);
+			return CKR_OK;
+		}
+	}
 
 	for (i=0; i < list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
-			/* Save the "card" object */
-			if (slot->card)
-				card = slot->card;
+		if (slot->reader == reader)
 			slot_token_removed(slot->id);
-		}
 	}
 
 	if (card) {
@@ -177,7 +227,8 @@ CK_RV card_removed(sc_reader_t * reader)
 			free(card->mechanisms[i]);
 		}
 		free(card->mechanisms);
-		free(card);
+		sc_pkcs11_unlock_card(card);
+		sc_pkcs11_free_card(card);
 	}
 
 	return CKR_OK;
@@ -197,7 +248,7 @@ CK_RV card_detect(sc_reader_t *reader)
 	sc_log(context, "%s: Detecting smart card", reader->name);
 	/* Check if someone inserted a card */
 again:
-	rc = sc_detect_card_presence(reader);
+	rc = detect_card_presence(reader);
 	if (rc < 0) {
 		sc_log(context, "%s: failed, %s", reader->name, sc_strerror(rc));
 		return sc_to_cryptoki_error(rc, NULL);
@@ -235,6 +286,11 @@ again:
 		p11card = (struct sc_pkcs11_card *)calloc(1, sizeof(struct sc_pkcs11_card));
 		if (!p11card)
 			return CKR_HOST_MEMORY;
+		rv = sc_pkcs11_init_card_lock(p11card);
+		if (rv != CKR_OK)   {
+			free(p11card);
+			return rv;
+		}
 		p11card->reader = reader;
 	}
 
@@ -337,6 +393,10 @@ card_detect_all(void)
 		if (reader->flags & SC_READER_REMOVED) {
 			struct sc_pkcs11_slot *slot;
 			card_removed(reader);
+			/* Other threads may still refer to the reader while waiting
+			 * for a card: delete it at a later detection */
+			if (sc_pkcs11_card_lock_waiting())
+				continue;
 			while ((slot = reader_get_slot(reader))) {
 				delete_slot(slot);
 			}
@@ -378,7 +438,10 @@ CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
+	/* The slot IDs are the positions in the list, but the hotplug slot */
+	*slot = id < list_size(&virtual_slots) ? list_get_at(&virtual_slots, id) : NULL;
+	if (!*slot || (*slot)->id != id)
+		*slot = list_seek(&virtual_slots, &id);
 	if (!*slot)
 		return CKR_SLOT_ID_INVALID;
 	return CKR_OK;
@@ -430,6 +493,8 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 		if (object->ops->release)
 			object->ops->release(object);
 	}
+	sc_pkcs11_handle_map_free(&slot->object_map);
+	sc_pkcs11_find_index_free(slot);
 
 	/* Release framework stuff */
 	if (slot->card != NULL) {
@@ -449,13 +514,44 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	return CKR_OK;
 }
 
+/* Add the object to the slot: its handle has to be set */
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	CK_RV rv;
+
+	rv = sc_pkcs11_handle_map_add(&slot->object_map, object->handle, object);
+	if (rv != CKR_OK)
+		return rv;
+	if (list_append(&slot->objects, object) < 0) {
+		sc_pkcs11_handle_map_remove(&slot->object_map, object->handle);
+		return CKR_HOST_MEMORY;
+	}
+	sc_pkcs11_find_index_invalidate(slot);
+	return CKR_OK;
+}
+
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	if (!sc_pkcs11_handle_map_remove(&slot->object_map, object->handle))
+		return;
+	list_delete(&slot->objects, object);
+	sc_pkcs11_find_index_invalidate(slot);
+}
+
+struct sc_pkcs11_object *slot_get_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle)
+{
+	return sc_pkcs11_handle_map_get(&slot->object_map, handle);
+}
+
 /* Called from C_WaitForSlotEvent */
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 {
 	unsigned int i;
 	LOG_FUNC_CALLED(context);
 
-	card_detect_all();
+	/* the slot monitor keeps the slots up to date */
+	if (!slot_monitor_running())
+		card_detect_all();
 	for (i=0; i<list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
 		sc_log(context, "slot 0x%lx token: %d events: 0x%02X",slot->id, (slot->slot_info.flags & CKF_TOKEN_PRESENT), slot->events);
@@ -372,6 +372,9 @@ extern int	sc_pkcs15init_delete_by_path(struct sc_profile *,
 				struct sc_pkcs15_card *, const struct sc_path *);
 extern int	sc_pkcs15init_update_any_df(struct sc_pkcs15_card *, struct sc_profile *,
 			struct sc_pkcs15_df *, int);
+extern int	sc_pkcs15init_begin_batch(struct sc_pkcs15_card *, struct sc_profile *);
+extern int	sc_pkcs15init_end_batch(struct sc_pkcs15_card *, struct sc_profile *);
+extern int	sc_pkcs15init_cancel_batch(struct sc_pkcs15_card *, struct sc_profile *);
 extern int	sc_pkcs15init_select_intrinsic_id(struct sc_pkcs15_card *, struct sc_profile *,
 			int, struct sc_pkcs15_id *, void *);
 
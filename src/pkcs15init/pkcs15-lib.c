@@ -416,6 +416,13 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "Pksc15init Unbind: %i:%p:%i", profile->dirty, profile->p15_data, profile->pkcs15.do_last_update);
+	if (profile->batch && profile->p15_data != NULL)   {
+		/* write what an unfinished batch has collected */
+		profile->batch = 1;
+		r = sc_pkcs15init_end_batch(profile->p15_data, profile);
+		if (r < 0)
+			sc_log(ctx, "Failed to end batch: %s", sc_strerror(r));
+	}
 	if (profile->dirty != 0 && profile->p15_data != NULL && profile->pkcs15.do_last_update) {
 		r = sc_pkcs15init_update_lastupdate(profile->p15_data, profile);
 		if (r < 0)
@@ -1359,18 +1366,34 @@ sc_pkcs15init_generate_key(struct sc_pkcs15_card *p15card, struct sc_profile *pr
 	r = sc_pkcs15_encode_pubkey(ctx, pubkey, &object->content.value, &object->content.len);
 	LOG_TEST_RET(ctx, r, "Failed to encode public key");
 
+	/* PrKDF and PuKDF are written together */
+	r = sc_pkcs15init_begin_batch(p15card, profile);
+	LOG_TEST_RET(ctx, r, "Cannot start batch");
+
 	r = sc_pkcs15init_add_object(p15card, profile, SC_PKCS15_PRKDF, object);
-	LOG_TEST_RET(ctx, r, "Failed to add generated private key object");
+	if (r < 0)   {
+		sc_pkcs15init_end_batch(p15card, profile);
+		LOG_TEST_RET(ctx, r, "Failed to add generated private key object");
+	}
 
 	if (!r && profile->ops->emu_store_data)   {
 		r = profile->ops->emu_store_data(p15card, profile, object, NULL, NULL);
 		if (r == SC_ERROR_NOT_IMPLEMENTED)
 			r = SC_SUCCESS;
-		LOG_TEST_RET(ctx, r, "Card specific 'store data' failed");
+		if (r < 0)   {
+			sc_pkcs15init_end_batch(p15card, profile);
+			LOG_TEST_RET(ctx, r, "Card specific 'store data' failed");
+		}
 	}
 
 	r = sc_pkcs15init_store_public_key(p15card, profile, &pubkey_args, NULL);
-	LOG_TEST_RET(ctx, r, "Failed to store public key");
+	if (r < 0)   {
+		sc_pkcs15init_end_batch(p15card, profile);
+		LOG_TEST_RET(ctx, r, "Failed to store public key");
+	}
+
+	r = sc_pkcs15init_end_batch(p15card, profile);
+	LOG_TEST_RET(ctx, r, "Failed to update PKCS#15 directory files");
 
 	if (res_obj)
 		*res_obj = object;
@@ -2686,6 +2709,124 @@ sc_pkcs15init_update_lastupdate(struct sc_pkcs15_card *p15card, struct sc_profil
 }
 
 
+static struct sc_profile_df_image *
+sc_pkcs15init_get_df_image(struct sc_profile *profile, const struct sc_path *path, int create)
+{
+	struct sc_profile_df_image *di;
+
+	for (di = profile->df_images; di; di = di->next)
+		if (sc_compare_path(&di->path, path))
+			return di;
+	if (!create)
+		return NULL;
+
+	di = calloc(1, sizeof(*di));
+	if (di == NULL)
+		return NULL;
+	di->path = *path;
+	di->next = profile->df_images;
+	profile->df_images = di;
+	return di;
+}
+
+
+/*
+ * Write the new content of a PKCS#15 directory file, sending only the
+ * bytes that differ from what is known to be on the card.
+ * The file content is read once per profile binding; when it cannot be
+ * read the whole file is rewritten by sc_pkcs15init_update_file().
+ */
+static int
+sc_pkcs15init_update_df_file(struct sc_profile *profile, struct sc_pkcs15_card *p15card,
+		struct sc_file *file, const unsigned char *data, size_t datalen)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_card	*card = p15card->card;
+	struct sc_profile_df_image *di;
+	struct sc_file	*selected_file = NULL;
+	unsigned char	*chunk = NULL;
+	size_t		first, last, ii;
+	int		r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!file)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	di = sc_pkcs15init_get_df_image(profile, &file->path, 1);
+	if (di == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	r = sc_select_file(card, &file->path, &selected_file);
+	if (r < 0 || selected_file->ef_structure != SC_FILE_EF_TRANSPARENT
+			|| selected_file->size < datalen || selected_file->size == 0)
+		goto full_update;
+
+	if (di->data == NULL || di->size != selected_file->size)   {
+		if (di->data)
+			free(di->data);
+		di->size = 0;
+		di->data = malloc(selected_file->size);
+		if (di->data == NULL)
+			goto full_update;
+
+		r = sc_read_binary(card, 0, di->data, selected_file->size, 0);
+		if (r != (int)selected_file->size)   {
+			sc_log(ctx, "Cannot read %s (%i), rewrite it", sc_print_path(&file->path), r);
+			free(di->data);
+			di->data = NULL;
+			goto full_update;
+		}
+		di->size = selected_file->size;
+	}
+
+	/* The bytes past the new content are zeroed, as in sc_pkcs15init_update_file() */
+	for (first = 0; first < datalen && data[first] == di->data[first]; first++)
+		;
+	for (last = di->size; last > datalen && di->data[last - 1] == 0; last--)
+		;
+	if (last <= datalen)
+		for (last = datalen; last > first && data[last - 1] == di->data[last - 1]; last--)
+			;
+	if (first >= last)   {
+		sc_log(ctx, "%s is unchanged", sc_print_path(&file->path));
+		sc_file_free(selected_file);
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	chunk = calloc(1, last - first);
+	if (chunk == NULL)   {
+		sc_file_free(selected_file);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+	for (ii = first; ii < last && ii < datalen; ii++)
+		chunk[ii - first] = data[ii];
+
+	sc_log(ctx, "update %s at offset %lu, %lu of %lu bytes", sc_print_path(&file->path),
+			(unsigned long) first, (unsigned long) (last - first), (unsigned long) di->size);
+
+	/* the file is still selected, or selected again by the PIN verification */
+	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
+	if (r >= 0)
+		r = sc_update_binary(card, first, chunk, last - first, 0);
+	if (r >= 0)
+		memcpy(di->data + first, chunk, last - first);
+	else
+		/* card content is unknown now */
+		di->size = 0;
+
+	free(chunk);
+	sc_file_free(selected_file);
+	LOG_FUNC_RETURN(ctx, r < 0 ? r : SC_SUCCESS);
+
+full_update:
+	if (selected_file)
+		sc_file_free(selected_file);
+	di->size = 0;
+	r = sc_pkcs15init_update_file(profile, p15card, file, (void *) data, datalen);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
 static int
 sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
 {
@@ -2697,39 +2838,32 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	LOG_FUNC_CALLED(ctx);
 	r = sc_pkcs15_encode_odf(ctx, p15card, &buf, &size);
 	if (r >= 0)
-		r = sc_pkcs15init_update_file(profile, p15card, p15card->file_odf, buf, size);
+		r = sc_pkcs15init_update_df_file(profile, p15card, p15card->file_odf, buf, size);
 	if (buf)
 		free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
-/*
- * Update any PKCS15 DF file (except ODF and DIR)
- */
-int
-sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
-		struct sc_profile *profile,
-		struct sc_pkcs15_df *df,
-		int is_new)
+
+static int
+sc_pkcs15init_write_df(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15_df *df, int *update_odf)
 {
 	struct sc_context	*ctx = p15card->card->ctx;
 	struct sc_card	*card = p15card->card;
 	struct sc_file	*file = NULL;
 	unsigned char	*buf = NULL;
 	size_t		bufsize;
-	int		update_odf = is_new, r = 0;
+	int		r;
 
 	LOG_FUNC_CALLED(ctx);
-	if (!df)
-		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
-
 	r = sc_profile_get_file_by_path(profile, &df->path, &file);
 	if (r < 0 || file == NULL)
 		sc_select_file(card, &df->path, &file);
 
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		r = sc_pkcs15init_update_df_file(profile, p15card, file, buf, bufsize);
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -2740,16 +2874,47 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 		 * fairly big, without having to read the entire file
 		 * every time we parse the CDF.
 		 */
-		if (profile->pkcs15.encode_df_length) {
+		if (profile->pkcs15.encode_df_length && df->path.count != (int)bufsize) {
 			df->path.count = bufsize;
 			df->path.index = 0;
-			update_odf = 1;
+			*update_odf = 1;
 		}
 		free(buf);
 	}
 	if (file)
 		sc_file_free(file);
 
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+/*
+ * Update any PKCS15 DF file (except ODF and DIR)
+ */
+int
+sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
+		struct sc_profile *profile,
+		struct sc_pkcs15_df *df,
+		int is_new)
+{
+	struct sc_context	*ctx = p15card->card->ctx;
+	struct sc_profile_df_image *di;
+	int		update_odf = is_new, r = 0;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!df)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
+
+	if (profile->batch)   {
+		/* Written once by sc_pkcs15init_end_batch() */
+		di = sc_pkcs15init_get_df_image(profile, &df->path, 1);
+		if (di == NULL)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		di->dirty = 1;
+		profile->batch_update_odf |= is_new;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	r = sc_pkcs15init_write_df(p15card, profile, df, &update_odf);
 	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
 
 	/* Now update the ODF if we have to */
@@ -2760,6 +2925,113 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r > 0 ? SC_SUCCESS : r);
 }
 
+
+/*
+ * Start a batch of changes to the PKCS#15 application. Until the matching
+ * sc_pkcs15init_end_batch() the card stays locked, a global PIN is verified
+ * only once per DF, and the directory files changed by the object
+ * additions are only marked. They are written once when the outermost batch
+ * ends, followed by at most one ODF update.
+ * Batches nest; sc_pkcs15init_cancel_batch() drops the pending xDF writes.
+ */
+int
+sc_pkcs15init_begin_batch(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	int		r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->batch == 0)   {
+		r = sc_lock(p15card->card);
+		LOG_TEST_RET(ctx, r, "Cannot lock card for the batch");
+
+		profile->batch_update_odf = 0;
+		profile->batch_auth_count = 0;
+	}
+	profile->batch++;
+	sc_log(ctx, "batch depth %i", profile->batch);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+static void
+sc_pkcs15init_drop_batch(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_profile_df_image *di;
+
+	for (di = profile->df_images; di; di = di->next)
+		di->dirty = 0;
+	profile->batch = 0;
+	profile->batch_update_odf = 0;
+	profile->batch_auth_count = 0;
+	sc_unlock(p15card->card);
+}
+
+
+int
+sc_pkcs15init_end_batch(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_profile_df_image *di;
+	struct sc_pkcs15_df *df;
+	int		update_odf, r = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!profile->batch)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "No batch started");
+	if (profile->batch > 1)   {
+		profile->batch--;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	/* The batch stays open while writing, so that the verified access
+	 * conditions are reused; sc_pkcs15init_write_df() is not deferred. */
+	update_odf = profile->batch_update_odf;
+
+	for (di = profile->df_images; di; di = di->next)   {
+		if (!di->dirty)
+			continue;
+		di->dirty = 0;
+
+		for (df = p15card->df_list; df; df = df->next)
+			if (sc_compare_path(&df->path, &di->path))
+				break;
+		if (df == NULL)   {
+			sc_log(ctx, "DF %s is gone, nothing to write", sc_print_path(&di->path));
+			continue;
+		}
+
+		r = sc_pkcs15init_write_df(p15card, profile, df, &update_odf);
+		if (r < 0)
+			break;
+	}
+
+	if (r >= 0 && update_odf)
+		r = sc_pkcs15init_update_odf(p15card, profile);
+
+	sc_pkcs15init_drop_batch(p15card, profile);
+	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF or ODF");
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/*
+ * Leave the directory files on the card as they were before the batch.
+ * Files created for the objects are not removed, and the objects stay in
+ * the PKCS#15 card structure: the caller is expected to unbind it.
+ */
+int
+sc_pkcs15init_cancel_batch(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!profile->batch)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "No batch started");
+	sc_pkcs15init_drop_batch(p15card, profile);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
 /*
  * Add an object to one of the pkcs15 directory files.
  */
@@ -2805,6 +3077,8 @@ sc_pkcs15init_add_object(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	else {
 		sc_log(ctx, "Reuse existing object");
 		assert(object->df == df);
+		/* Attributes of the object could have been changed */
+		sc_pkcs15_invalidate_object_index(p15card);
 	}
 
 	if (profile->ops->emu_update_any_df)
@@ -2916,6 +3190,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 		default:
 			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot change ID attribute");
 		}
+		sc_pkcs15_invalidate_object_index(p15card);
 		break;
 	default:
 		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Only 'LABEL' or 'ID' attributes can be changed");
@@ -2933,7 +3208,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 			r = sc_profile_get_file_by_path(profile, &df->path, &file);
 			LOG_TEST_RET(ctx, r, "Cannot instantiate file by path");
 
-			r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+			r = sc_pkcs15init_update_df_file(profile, p15card, file, buf, bufsize);
 			free(buf);
 			sc_file_free(file);
 		}
@@ -3396,6 +3671,80 @@ found:
  * in their response to SELECT FILE), so the latter case has been
  * used in most cards while the first case was added much later.
  */
+/*
+ * Only the status of a global PIN is known to survive the selection of other
+ * files: cards may reset a DF specific PIN or an external authentication.
+ */
+static int
+sc_pkcs15init_is_global_pin(struct sc_profile *profile, struct sc_pkcs15_card *p15card,
+		struct sc_file *file, const struct sc_acl_entry *acl)
+{
+	struct sc_pkcs15_object *pin_obj = NULL;
+	struct sc_pkcs15_auth_info *auth_info;
+	struct sc_path	path;
+	unsigned int	type = acl->method;
+	int		reference = acl->key_ref, iter, r;
+
+	if (type == SC_AC_SYMBOLIC)   {
+		reference = sc_pkcs15init_get_pin_reference(p15card, profile, type, reference);
+		if (reference == -1)
+			return 0;
+		type = SC_AC_CHV;
+	}
+	/* Bit 8 of the reference marks a DF specific PIN (ISO 7816-4) */
+	if (type != SC_AC_CHV || (reference & 0x80))
+		return 0;
+
+	path = file->path;
+	r = SC_ERROR_OBJECT_NOT_FOUND;
+	for (iter = path.len/2; iter >= 0 && r == SC_ERROR_OBJECT_NOT_FOUND; iter--, path.len -= 2)
+		r = sc_pkcs15_find_pin_by_type_and_reference(p15card,
+				path.len ? &path : NULL, type, reference, &pin_obj);
+	if (r || pin_obj == NULL)
+		return 0;
+
+	auth_info = (struct sc_pkcs15_auth_info *) pin_obj->data;
+	return (auth_info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_LOCAL) == 0;
+}
+
+
+/*
+ * Inside a batch the card is locked, so a global PIN verified once stays
+ * satisfied for the other files of the same DF.
+ */
+static int
+sc_pkcs15init_batch_verified(struct sc_profile *profile, struct sc_pkcs15_card *p15card,
+		struct sc_file *file, const struct sc_acl_entry *acl, int add)
+{
+	struct sc_profile_batch_auth *ba;
+	struct sc_path	df_path;
+	unsigned int	ii;
+
+	if (!profile->batch)
+		return 0;
+
+	df_path = file->path;
+	if (df_path.len >= 2)
+		df_path.len -= 2;
+
+	for (ii = 0; ii < profile->batch_auth_count; ii++)   {
+		ba = &profile->batch_auth[ii];
+		if (ba->method == acl->method && ba->key_ref == acl->key_ref
+				&& sc_compare_path(&ba->df_path, &df_path))
+			return 1;
+	}
+
+	if (add && profile->batch_auth_count < SC_PKCS15INIT_MAX_BATCH_AUTH
+			&& sc_pkcs15init_is_global_pin(profile, p15card, file, acl))   {
+		ba = &profile->batch_auth[profile->batch_auth_count++];
+		ba->method = acl->method;
+		ba->key_ref = acl->key_ref;
+		ba->df_path = df_path;
+	}
+	return 0;
+}
+
+
 int
 sc_pkcs15init_authenticate(struct sc_profile *profile, struct sc_pkcs15_card *p15card,
 		struct sc_file *file, int op)
@@ -3431,8 +3780,14 @@ sc_pkcs15init_authenticate(struct sc_profile *profile, struct sc_pkcs15_card *p1
 			sc_log(ctx, "unknown acl method");
 			break;
 		}
+		if (sc_pkcs15init_batch_verified(profile, p15card, file_tmp ? file_tmp : file, acl, 0))   {
+			sc_log(ctx, "acl(method:%i,reference:%i) already verified in this batch", acl->method, acl->key_ref);
+			continue;
+		}
 		sc_log(ctx, "verify acl(method:%i,reference:%i)", acl->method, acl->key_ref);
 		r = sc_pkcs15init_verify_secret(profile, p15card, file_tmp ? file_tmp : file, acl->method, acl->key_ref);
+		if (r == 0)
+			sc_pkcs15init_batch_verified(profile, p15card, file_tmp ? file_tmp : file, acl, 1);
 	}
 
 	if (file_tmp)
@@ -36,6 +36,7 @@
 #endif
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -44,6 +45,7 @@
 
 #include "common/compat_strlcpy.h"
 #include "scconf/scconf.h"
+#include "libopensc/internal.h"
 #include "libopensc/log.h"
 #include "libopensc/pkcs15.h"
 #include "pkcs15-init.h"
@@ -280,6 +282,85 @@ init_file(unsigned int type)
 	return file;
 }
 
+/*
+ * Parsed profile files are kept in the context, so that binding the same
+ * card again does not read and parse the files again.
+ * An entry is parsed again when the modification time of its file changed.
+ */
+struct sc_profile_cache {
+	char *path;
+	time_t mtime;
+	scconf_context *conf;
+	struct sc_profile_cache *next;
+};
+
+static void
+sc_profile_cache_free(void *data)
+{
+	struct sc_profile_cache *cache = (struct sc_profile_cache *) data, *next;
+
+	for (; cache; cache = next) {
+		next = cache->next;
+		scconf_free(cache->conf);
+		free(cache->path);
+		free(cache);
+	}
+}
+
+/* Called with the context mutex held */
+static scconf_context *
+sc_profile_cache_get(struct sc_context *ctx, const char *path, int *res)
+{
+	struct sc_profile_cache *entry;
+	scconf_context *conf;
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		*res = -1;
+		return NULL;
+	}
+
+	for (entry = (struct sc_profile_cache *) ctx->profile_cache; entry; entry = entry->next)
+		if (!strcmp(entry->path, path))
+			break;
+	if (entry && entry->mtime == st.st_mtime) {
+		sc_log(ctx, "profile %s taken from cache", path);
+		*res = 1;
+		return entry->conf;
+	}
+
+	conf = scconf_new(path);
+	if (conf == NULL) {
+		*res = -1;
+		return NULL;
+	}
+	*res = scconf_parse(conf);
+	if (*res <= 0) {
+		scconf_free(conf);
+		return NULL;
+	}
+
+	if (entry == NULL) {
+		entry = calloc(1, sizeof(*entry));
+		if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+			free(entry);
+			scconf_free(conf);
+			*res = -1;
+			return NULL;
+		}
+		entry->next = (struct sc_profile_cache *) ctx->profile_cache;
+		ctx->profile_cache = entry;
+		ctx->profile_cache_free = sc_profile_cache_free;
+	}
+	else {
+		scconf_free(entry->conf);
+	}
+	entry->conf = conf;
+	entry->mtime = st.st_mtime;
+
+	return conf;
+}
+
 /*
  * Initialize profile
  */
@@ -375,23 +456,24 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 
 	sc_log(ctx, "Trying profile file %s", path);
 
-	conf = scconf_new(path);
-	res = scconf_parse(conf);
-
-	sc_log(ctx, "profile %s loaded ok", path);
+	/* the cached files are shared: keep them while in use */
+	sc_mutex_lock(ctx, ctx->mutex);
+	conf = sc_profile_cache_get(ctx, path, &res);
 
 	if (res < 0) {
-		scconf_free(conf);
+		sc_mutex_unlock(ctx, ctx->mutex);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
 	}
 
 	if (res == 0) {
-		scconf_free(conf);
+		sc_mutex_unlock(ctx, ctx->mutex);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_SYNTAX_ERROR);
 	}
 
+	sc_log(ctx, "profile %s loaded ok", path);
+
 	res = process_conf(profile, conf);
-	scconf_free(conf);
+	sc_mutex_unlock(ctx, ctx->mutex);
 	LOG_FUNC_RETURN(ctx, res);
 }
 
@@ -461,6 +543,7 @@ sc_profile_free(struct sc_profile *profile)
 	struct pin_info *pi;
 	sc_macro_t	*mi;
 	sc_template_t	*ti;
+	struct sc_profile_df_image *di;
 
 	if (profile->name)
 		free(profile->name);
@@ -495,6 +578,13 @@ sc_profile_free(struct sc_profile *profile)
 		free(pi);
 	}
 
+	while ((di = profile->df_images) != NULL) {
+		profile->df_images = di->next;
+		if (di->data)
+			free(di->data);
+		free(di);
+	}
+
 	if (profile->p15_spec)
 		sc_pkcs15_card_free(profile->p15_spec);
 	memset(profile, 0, sizeof(*profile));
@@ -78,6 +78,24 @@ typedef struct sc_template {
 	struct file_info *	file;
 } sc_template_t;
 
+/* Last known content of a PKCS#15 directory file on the card, used
+ * to write back only the bytes that changed */
+struct sc_profile_df_image {
+	struct sc_path		path;
+	unsigned char *		data;	/* NULL if not read from the card yet */
+	size_t			size;
+	int			dirty;	/* pending write in a batch */
+	struct sc_profile_df_image *next;
+};
+
+/* Global PIN verified during a batch */
+struct sc_profile_batch_auth {
+	unsigned int		method;
+	unsigned int		key_ref;
+	struct sc_path		df_path;
+};
+
+#define SC_PKCS15INIT_MAX_BATCH_AUTH 8
 #define SC_PKCS15INIT_MAX_OPTIONS 16
 struct sc_profile {
 	char *			name;
@@ -122,6 +140,13 @@ struct sc_profile {
 	 * has been changed) */
 	int			dirty;
 
+	/* xDF images and the batch state, see sc_pkcs15init_begin_batch() */
+	struct sc_profile_df_image *df_images;
+	int			batch;	/* nesting depth */
+	int			batch_update_odf;
+	struct sc_profile_batch_auth batch_auth[SC_PKCS15INIT_MAX_BATCH_AUTH];
+	unsigned int		batch_auth_count;
+
 	/* PKCS15 object ID style */
 	unsigned int id_style;
 
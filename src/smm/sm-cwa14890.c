@@ -57,10 +57,9 @@ static const struct sc_asn1_entry c_asn1_iasecc_response[4] = {
 };
 
 int
-sm_cwa_get_mac(struct sc_context *ctx, unsigned char *key, DES_cblock *icv,
+sm_cwa_get_mac(struct sc_context *ctx, struct sm_des3_key *dk, unsigned char *key, DES_cblock *icv,
 			unsigned char *in, int in_len, DES_cblock *out, int force_padding)
 {
-	DES_cblock kk, k2;
 	DES_key_schedule ks,ks2;
 	unsigned char padding[8] = {0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 	unsigned char *buf;
@@ -84,10 +83,7 @@ sm_cwa_get_mac(struct sc_context *ctx, unsigned char *key, DES_cblock *icv,
 	sc_log(ctx, "sm_cwa_get_mac() data to MAC(%i) %s", in_len, sc_dump_hex(buf, in_len));
 	sc_log(ctx, "sm_cwa_get_mac() ICV %s", sc_dump_hex((unsigned char *)icv, 8));
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
+	sm_des3_key_load(dk, key, &ks, &ks2);
 	DES_cbc_cksum_3des_emv96(buf, out, in_len ,&ks, &ks2, icv);
 
 	free(buf);
@@ -148,14 +144,14 @@ sm_cwa_decode_authentication_data(struct sc_context *ctx, struct sm_cwa_keyset *
 	LOG_FUNC_CALLED(ctx);
 
 	memset(icv, 0, sizeof(icv));
-	rv = sm_cwa_get_mac(ctx, keyset->mac, &icv, session_data->mdata, 0x40, &cblock, 1);
+	rv = sm_cwa_get_mac(ctx, NULL, keyset->mac, &icv, session_data->mdata, 0x40, &cblock, 1);
 	LOG_TEST_RET(ctx, rv, "Decode authentication data:  sm_ecc_get_mac failed");
 	sc_log(ctx, "MAC:%s", sc_dump_hex(cblock, sizeof(cblock)));
 
 	if(memcmp(session_data->mdata + 0x40, cblock, 8))
 		LOG_FUNC_RETURN(ctx, SC_ERROR_SM_AUTHENTICATION_FAILED);
 
-	rv = sm_decrypt_des_cbc3(ctx, keyset->enc, session_data->mdata, session_data->mdata_len, &decrypted, &decrypted_len);
+	rv = sm_decrypt_des_cbc3(ctx, NULL, keyset->enc, session_data->mdata, session_data->mdata_len, &decrypted, &decrypted_len);
 	LOG_TEST_RET(ctx, rv, "sm_ecc_decode_auth_data() DES CBC3 decrypt error");
 
 	sc_log(ctx, "sm_ecc_decode_auth_data() decrypted(%i) %s", decrypted_len, sc_dump_hex(decrypted, decrypted_len));
@@ -281,7 +277,7 @@ sm_cwa_initialize(struct sc_context *ctx, struct sm_info *sm_info, struct sc_rem
 
 	sc_log(ctx, "S(%i) %s", offs, sc_dump_hex(buf, offs));
 
-	rv = sm_encrypt_des_cbc3(ctx, cwa_keyset->enc, buf, offs, &encrypted, &encrypted_len, 1);
+	rv = sm_encrypt_des_cbc3(ctx, NULL, cwa_keyset->enc, buf, offs, &encrypted, &encrypted_len, 1);
 	LOG_TEST_RET(ctx, rv, "_encrypt_des_cbc3() failed");
 
 	sc_log(ctx, "ENCed(%i) %s", encrypted_len, sc_dump_hex(encrypted, encrypted_len));
@@ -289,7 +285,7 @@ sm_cwa_initialize(struct sc_context *ctx, struct sm_info *sm_info, struct sc_rem
 	memcpy(buf, encrypted, encrypted_len);
 	offs = encrypted_len;
 
-	rv = sm_cwa_get_mac(ctx, cwa_keyset->mac, &icv, buf, offs, &cblock, 1);
+	rv = sm_cwa_get_mac(ctx, NULL, cwa_keyset->mac, &icv, buf, offs, &cblock, 1);
 	LOG_TEST_RET(ctx, rv, "sm_ecc_get_mac() failed");
 	sc_log(ctx, "MACed(%i) %s", sizeof(cblock), sc_dump_hex(cblock, sizeof(cblock)));
 
@@ -326,7 +322,7 @@ sm_cwa_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info, struct sc_
 
 	sm_incr_ssc(session_data->ssc, sizeof(session_data->ssc));
 
-	rv = sm_encrypt_des_cbc3(ctx, session_data->session_enc, apdu->data, apdu->datalen, &encrypted, &encrypted_len, 0);
+	rv = sm_encrypt_des_cbc3(ctx, &session_data->ks_enc, session_data->session_enc, apdu->data, apdu->datalen, &encrypted, &encrypted_len, 0);
 	LOG_TEST_RET(ctx, rv, "securize APDU: DES CBC3 encryption failed");
 	sc_log(ctx, "encrypted data (len:%i, %s)", encrypted_len, sc_dump_hex(encrypted, encrypted_len));
 
@@ -377,7 +373,7 @@ sm_cwa_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info, struct sc_
 	sc_log(ctx, "securize APDU: MAC data(len:%i,%s)", mac_len, sc_dump_hex(mac_data, mac_len));
 
 	memset(icv, 0, sizeof(icv));
-	rv = sm_cwa_get_mac(ctx, session_data->session_mac, &icv, mac_data, mac_len, &cblock, 0);
+	rv = sm_cwa_get_mac(ctx, &session_data->ks_mac, session_data->session_mac, &icv, mac_data, mac_len, &cblock, 0);
 	LOG_TEST_RET(ctx, rv, "securize APDU: MAC calculation error");
 	sc_log(ctx, "securize APDU: MAC:%s", sc_dump_hex(cblock, sizeof(cblock)));
 
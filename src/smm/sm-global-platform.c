@@ -164,12 +164,11 @@ sm_gp_get_cryptogram(unsigned char *session_key,
 
 
 int
-sm_gp_get_mac(unsigned char *key, DES_cblock *icv,
+sm_gp_get_mac(struct sm_des3_key *dk, unsigned char *key, DES_cblock *icv,
 		unsigned char *in, int in_len, DES_cblock *out)
 {
 	int len;
 	unsigned char *block;
-	DES_cblock kk, k2;
 	DES_key_schedule ks,ks2;
 
 	block = malloc(in_len + 8);
@@ -181,11 +180,7 @@ sm_gp_get_mac(unsigned char *key, DES_cblock *icv,
 	len = in_len + 8;
 	len -= (len%8);
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
+	sm_des3_key_load(dk, key, &ks, &ks2);
 	DES_cbc_cksum_3des(block, out, len ,&ks, &ks2, icv);
 
 	free(block);
@@ -254,6 +249,9 @@ sm_gp_close_session(struct sc_context *ctx, struct sm_gp_session *gp_session)
 	free(gp_session->session_enc);
 	free(gp_session->session_mac);
 	free(gp_session->session_kek);
+
+	memset(&gp_session->ks_enc, 0, sizeof(gp_session->ks_enc));
+	memset(&gp_session->ks_mac, 0, sizeof(gp_session->ks_mac));
 }
 
 
@@ -311,7 +309,7 @@ sm_gp_external_authentication(struct sc_context *ctx, struct sm_info *sm_info,
 
 	memcpy(raw_apdu + offs, host_cryptogram, 8);
 	offs += 8;
-	rv = sm_gp_get_mac(gp_session->session_mac, &gp_session->mac_icv, raw_apdu, offs, &mac);
+	rv = sm_gp_get_mac(&gp_session->ks_mac, gp_session->session_mac, &gp_session->mac_icv, raw_apdu, offs, &mac);
 	LOG_TEST_RET(ctx, rv, "SM GP authentication: get MAC error");
 
 	memcpy(new_rapdu->sbuf, host_cryptogram, 8);
@@ -323,7 +321,7 @@ sm_gp_external_authentication(struct sc_context *ctx, struct sm_info *sm_info,
 
 
 static int
-sm_gp_encrypt_command_data(struct sc_context *ctx, unsigned char *session_key,
+sm_gp_encrypt_command_data(struct sc_context *ctx, struct sm_des3_key *dk, unsigned char *session_key,
 		const unsigned char *in, size_t in_len, unsigned char **out, size_t *out_len)
 {
 	unsigned char *data = NULL;
@@ -349,7 +347,7 @@ sm_gp_encrypt_command_data(struct sc_context *ctx, unsigned char *session_key,
 	*data = in_len;
 	memcpy(data + 1, in, in_len);
 
-	rv = sm_encrypt_des_cbc3(ctx, session_key, data, in_len + 1, out, out_len, 1);
+	rv = sm_encrypt_des_cbc3(ctx, dk, session_key, data, in_len + 1, out, out_len, 1);
 	free(data);
 	LOG_TEST_RET(ctx, rv, "SM GP encrypt command data: encryption error");
 
@@ -389,7 +387,7 @@ sm_gp_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info,
 		if (!gp_session->session_enc)
 			LOG_TEST_RET(ctx, SC_ERROR_SM_INVALID_SESSION_KEY, "SM GP securize APDU: no ENC session key found");
 
-		if (sm_gp_encrypt_command_data(ctx, gp_session->session_enc, apdu->data, apdu->datalen, &encrypted, &encrypted_len))
+		if (sm_gp_encrypt_command_data(ctx, &gp_session->ks_enc, gp_session->session_enc, apdu->data, apdu->datalen, &encrypted, &encrypted_len))
 			LOG_TEST_RET(ctx, SC_ERROR_SM_ENCRYPT_FAILED, "SM GP securize APDU: data encryption error");
 
 		if (encrypted_len + 8 > SC_MAX_APDU_BUFFER_SIZE)
@@ -409,7 +407,7 @@ sm_gp_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info,
 
 	memcpy(buff + 5, apdu_data, apdu->datalen);
 
-	rv = sm_gp_get_mac(gp_session->session_mac, &gp_session->mac_icv, buff, 5 + apdu->datalen, &mac);
+	rv = sm_gp_get_mac(&gp_session->ks_mac, gp_session->session_mac, &gp_session->mac_icv, buff, 5 + apdu->datalen, &mac);
 	LOG_TEST_RET(ctx, rv, "SM GP securize APDU: get MAC error");
 
 	if (gp_level == SM_GP_SECURITY_MAC)   {
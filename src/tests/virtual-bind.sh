@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Binds the PKCS#15 application of the card scripted in virtual-card.txt
+# through the virtual reader and checks the objects that p15dump lists.
+
+srcdir=${srcdir:-.}
+conf=virtual-bind.conf
+
+cat > $conf <<EOC
+app default {
+	force_reader_driver = virtual;
+	force_card_driver = default;
+	reader_driver virtual {
+		card_image = $srcdir/virtual-card.txt;
+	}
+}
+EOC
+
+out=`OPENSC_CONF=$conf ./p15dump -r 0 2>&1`
+status=$?
+rm -f $conf
+if test $status -ne 0; then
+	echo "$out"
+	echo "p15dump failed with status $status"
+	exit 1
+fi
+
+for expected in \
+		'PKCS#15 Card \[Virtual test card\]' \
+		'PIN \[User PIN\]' \
+		'Private RSA key \[Private key\]' \
+		'Public RSA key \[Public key\]' \
+		'X.509 Certificate \[Certificate\]'; do
+	if ! echo "$out" | grep "^$expected" > /dev/null; then
+		echo "$out"
+		echo "not found: $expected"
+		exit 1
+	fi
+done
+exit 0
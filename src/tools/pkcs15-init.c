@@ -424,7 +424,7 @@ main(int argc, char **argv)
 {
 	struct sc_profile	*profile = NULL;
 	unsigned int		n;
-	int			r = 0;
+	int			r = 0, batch = 0;
 
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
 	OPENSSL_config(NULL);
@@ -511,6 +511,15 @@ main(int argc, char **argv)
 
 			sc_pkcs15init_set_p15card(profile, p15card);
 
+			/* Write the directory files changed by all the
+			 * following actions once, at the end */
+			r = sc_pkcs15init_begin_batch(p15card, profile);
+			if (r < 0)   {
+				fprintf(stderr, "Cannot start batch: %s\n", sc_strerror(r));
+				break;
+			}
+			batch = 1;
+
 			if (opt_verify_pin)   {
 				r = verify_pin(p15card, opt_authid);
 				if (r)   {
@@ -521,6 +530,18 @@ main(int argc, char **argv)
 			}
 		}
 
+		if (batch && (action == ACTION_FINALIZE_CARD
+		 || action == ACTION_SANITY_CHECK
+		 || action == ACTION_ERASE_APPLICATION)) {
+			/* These need the PKCS#15 directory up to date */
+			batch = 0;
+			r = sc_pkcs15init_end_batch(p15card, profile);
+			if (r < 0) {
+				fprintf(stderr, "Failed to update PKCS#15 directory files: %s\n", sc_strerror(r));
+				break;
+			}
+		}
+
 		if (verbose && action != ACTION_ASSERT_PRISTINE)
 			printf("About to %s.\n", action_names[action]);
 
@@ -586,6 +607,19 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (batch) {
+		/* Also after a failure: the files of the objects stored by the
+		 * previous actions are on the card, list them in the PKCS#15
+		 * directory like it was done without the batch */
+		int rv = sc_pkcs15init_end_batch(p15card, profile);
+
+		if (rv < 0) {
+			fprintf(stderr, "Failed to update PKCS#15 directory files: %s\n", sc_strerror(rv));
+			if (r >= 0)
+				r = rv;
+		}
+	}
+
 	for (n = 0; n < sizeof(pins)/sizeof(pins[0]); n++) {
 		free(pins[n]);
 	}